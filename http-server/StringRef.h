@@ -3,6 +3,7 @@
 
 #include <tuple>
 #include <string>
+#include <string_view>
 #include <cassert>
 #include <cstring>
 #include <iostream>
@@ -27,30 +28,42 @@ public:
 	using const_iterator = const char *;
 	using size_type = size_t;
 
-	StringRef() :
+	constexpr StringRef() :
 		data(""), length(0)
 	{
 	}
 
-	StringRef(const char *s) :
-		data(s), length(s ? ::strlen(s) : 0)
+	constexpr StringRef(const char *s) :
+		data(s), length(s ? std::char_traits<char>::length(s) : 0)
 	{
 	}
 
-	StringRef(const char *begin, size_t length) :
+	constexpr StringRef(const char *begin, size_t length) :
 		data(begin), length(length)
 	{
 	}
 
+	constexpr StringRef(std::string_view s) :
+		data(s.data()), length(s.size())
+	{
+	}
+
+	// std::string, or one with another allocator
+	template<class Allocator>
+	StringRef(const std::basic_string<char, std::char_traits<char>, Allocator> &s) :
+		data(s.data()), length(s.size())
+	{
+	}
+
 	StringRef(const StringRef &that) = default;
 	StringRef(StringRef &&that) = default;
 
 	StringRef& operator=(const StringRef &that) = default;
 	StringRef& operator=(StringRef &&that) = default;
 
-	const char *getData() const { return data; }
+	constexpr const char *getData() const { return data; }
 
-	char operator[](const size_t idx) const {
+	constexpr char operator[](const size_t idx) const {
 		return data[idx];
 	}
 
@@ -61,14 +74,14 @@ public:
 		return data[idx];
 	}
 
-	iterator begin() const { return data; }
-	iterator end()   const { return data + length; }
+	constexpr iterator begin() const { return data; }
+	constexpr iterator end()   const { return data + length; }
 
-	bool empty() const {
+	constexpr bool empty() const {
 		return !(data && length);
 	}
 
-	size_t size() {
+	constexpr size_t size() const {
 		return length;
 	}
 
@@ -179,6 +192,10 @@ public:
 	operator std::string() {
 		return std::string(data, data + length);
 	}
+
+	constexpr operator std::string_view() const {
+		return std::string_view(data, length);
+	}
 };
 
 inline bool operator==(StringRef lhs, StringRef rhs) {
@@ -1,18 +1,64 @@
 #ifndef THREADSAFEQUEUE_H
 #define THREADSAFEQUEUE_H
 
-#include <queue>
+#include <vector>
 #include <mutex>
 #include <memory>
 #include <condition_variable>
 
 
+/* FIFO over one array used as a ring, doubled when full. Once it has grown
+ * to the longest the queue gets, push and pop allocate nothing (std::queue
+ * takes and frees a deque block every few elements).
+ */
+template<class T>
+class RingQueue {
+	std::vector<T> slots;   // size is zero or a power of two
+	size_t head;
+	size_t count;
+
+	void grow() {
+		std::vector<T> bigger(slots.empty() ? 16 : slots.size() * 2);
+		for(size_t i = 0; i < count; i++)
+			bigger[i] = std::move(slots[(head + i) & (slots.size() - 1)]);
+		slots.swap(bigger);
+		head = 0;
+	}
+
+public:
+	RingQueue() : slots(), head(0), count(0) {}
+
+	void push(T &&value) {
+		if(count == slots.size())
+			grow();
+		slots[(head + count) & (slots.size() - 1)] = std::move(value);
+		count++;
+	}
+	void push(const T &value) {
+		T copy(value);
+		push(std::move(copy));
+	}
+
+	T &front() { return slots[head]; }
+	void pop() {
+		// what the element holds goes now, not when the slot is reused
+		slots[head] = T();
+		head = (head + 1) & (slots.size() - 1);
+		count--;
+	}
+
+	bool empty() const { return count == 0; }
+	size_t size() const { return count; }
+};
+
+
 template<class T>
 class ThreadSafeQueue{
 private:
     mutable std::mutex mut;
     mutable std::condition_variable condition;
-	std::queue<T> data;
+	RingQueue<T> data;
+	RingQueue<T> urgent;   // always dequeued before data
 public:
 
     ThreadSafeQueue() = default;
@@ -43,22 +89,29 @@ public:
         condition.notify_one();
     }
 
+    void enqueue_urgent(T &&value){
+        std::lock_guard<std::mutex>lock(mut);
+        urgent.push(std::move(value));
+        condition.notify_one();
+    }
+
 	T dequeue(){
         std::unique_lock<std::mutex> lock(mut);
-        condition.wait(lock, [this]{return !this->data.empty();});
-        auto value=std::move(data.front());
-        data.pop();
+        condition.wait(lock, [this]{return !this->urgent.empty() || !this->data.empty();});
+        auto &queue = urgent.empty() ? data : urgent;
+        auto value=std::move(queue.front());
+        queue.pop();
         return value;
     }
 
     bool empty() const {
         std::lock_guard<std::mutex> lock(mut);
-        return data.empty();
+        return data.empty() && urgent.empty();
     }
 
     size_t size() const {
         std::lock_guard<std::mutex> lock(mut);
-        return data.size();
+        return data.size() + urgent.size();
     }
 };
 
@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <memory_resource>
+
+
+/* Memory for one request. Strings and containers of the request, the
+ * route captures and the response head are carved out of a buffer kept
+ * while the connection is served, at the cost of a pointer bump each, and
+ * are dropped all together by reset() instead of one by one. A request
+ * that outgrows the buffer takes larger blocks from the heap, which
+ * reset() gives back, so nothing of a request outlives it to fragment the
+ * heap.
+ */
+class Arena {
+public:
+	// enough for the header of a typical browser request
+	static constexpr size_t initial_size = 4 * 1024;
+
+private:
+	alignas(std::max_align_t) std::byte buffer[initial_size];
+	std::pmr::monotonic_buffer_resource resource;
+
+public:
+	Arena() :
+		resource(buffer, sizeof(buffer), std::pmr::new_delete_resource())
+	{
+	}
+
+	Arena(const Arena &) = delete;
+	Arena& operator= (const Arena &) = delete;
+
+	std::pmr::memory_resource *get() { return &resource; }
+	// everything allocated since the last reset is gone
+	void reset() { resource.release(); }
+};
+
+
+#endif
@@ -0,0 +1,154 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "async.h"
+#include "file.h"
+#include "debug.h"
+
+
+namespace async {
+
+Executor *Executor::instance = nullptr;
+
+Executor::Executor(EventLoop &loop, submit_t workers, submit_t resume, submit_t blocking) :
+	event_loop(loop),
+	workers(std::move(workers)),
+	resume(std::move(resume)),
+	blocking(std::move(blocking))
+{
+	instance = this;
+}
+
+Executor::~Executor() {
+	if(instance == this)
+		instance = nullptr;
+}
+
+Executor &Executor::current() {
+	assert(instance && "no executor is running");
+	return *instance;
+}
+
+void Executor::schedule(std::coroutine_handle<> h) {
+	resume([h] { h.resume(); });
+}
+
+void Executor::submit(task_t func) {
+	workers(std::move(func));
+}
+
+void Executor::offload(task_t func) {
+	blocking(std::move(func));
+}
+
+
+void IOAwaiter::await_suspend(std::coroutine_handle<> h) {
+	auto &executor = Executor::current();
+	auto &loop = executor.loop();
+	loop.post([this, h, &executor, &loop] {
+		loop.watch(fd, events, [this, h, &executor](uint32_t r) {
+			ready = r;
+			executor.schedule(h);
+		});
+	});
+}
+
+void TransferAwaiter::await_suspend(std::coroutine_handle<> h) {
+	auto &executor = Executor::current();
+	auto &loop = executor.loop();
+	loop.post([this, h, &executor, &loop] {
+		auto done = [this, h, &executor](ssize_t res) {
+			result = res;
+			executor.schedule(h);
+		};
+		if(sending)
+			loop.send(fd, buf, n, done);
+		else
+			loop.recv(fd, buf, n, done);
+	});
+}
+
+void SleepAwaiter::await_suspend(std::coroutine_handle<> h) {
+	auto &executor = Executor::current();
+	auto &loop = executor.loop();
+	loop.run_after(delay_ms, [h, &executor] { executor.schedule(h); });
+}
+
+
+static bool retry(ssize_t err) {
+	return err == -EAGAIN || err == -EWOULDBLOCK || err == -EINTR;
+}
+
+/* Try the call here first, data is often there already. Otherwise the loop
+ * does it once the socket is ready, on io_uring without a wakeup in between.
+ */
+Task<ssize_t> read_some(int fd, void *buf, size_t n) {
+	auto num = recv(fd, buf, n, MSG_DONTWAIT);
+	if(num >= 0)
+		co_return num;
+	num = -errno;
+	while(retry(num))
+		num = co_await TransferAwaiter(false, fd, buf, n);
+	if(num < 0) {
+		errno = -num;
+		co_return -1;
+	}
+	co_return num;
+}
+
+Task<ssize_t> write_all(int fd, const void *buf, size_t n) {
+	auto *p = (const char *)buf;
+	size_t done = 0;
+	while(done < n) {
+		auto num = send(fd, p + done, n - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(num < 0)
+			num = -errno;
+		while(retry(num))
+			num = co_await TransferAwaiter(true, fd, (void *)(p + done), n - done);
+		if(num < 0) {
+			errno = -num;
+			co_return -1;
+		}
+		done += num;
+	}
+	co_return done;
+}
+
+Task<ssize_t> send_file(int fd, int file, off_t offset, size_t n) {
+	// sendfile() has no MSG_DONTWAIT, the socket is non-blocking meanwhile
+	int flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	size_t done = 0;
+	while(done < n) {
+		auto num = sendfile(fd, file, &offset, n - done);
+		if(num > 0) {
+			done += num;
+			continue;
+		}
+		// the file shrank underneath
+		if(num == 0)
+			break;
+		if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			break;
+		co_await writable(fd);
+	}
+
+	fcntl(fd, F_SETFL, flags);
+	co_return done == n ? (ssize_t)done : -1;
+}
+
+Task<std::string> read_file(std::string path) {
+	// keep the lambda named: g++-12 destroys a capturing temporary twice
+	// when it is created inside a co_await expression
+	auto readall = [path] {
+		return File(path).readall();
+	};
+	auto content = co_await offload(std::move(readall));
+	co_return content;
+}
+
+}
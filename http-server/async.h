@@ -0,0 +1,163 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#include <sys/types.h>
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+#include "task.h"
+#include "eventloop.h"
+#include "unique_function.h"
+
+
+namespace async {
+
+/* Where suspended coroutines come back to life. Worker threads resume
+ * handlers, the event loop wakes them on readiness and timers, and the
+ * blocking pool runs calls that would otherwise stall a worker.
+ */
+class Executor {
+public:
+	using task_t = unique_function<void ()>;
+	using submit_t = std::function<void (task_t)>;
+
+private:
+	EventLoop &event_loop;
+	submit_t workers;
+	submit_t resume;     // worker lane that overtakes new work
+	submit_t blocking;
+
+	static Executor *instance;
+
+public:
+	Executor(EventLoop &loop, submit_t workers, submit_t resume, submit_t blocking);
+	~Executor();
+
+	Executor(const Executor &) = delete;
+	Executor& operator= (const Executor &) = delete;
+
+	static Executor &current();
+
+	EventLoop &loop() { return event_loop; }
+
+	// resume h on a worker thread, ahead of requests not yet started
+	void schedule(std::coroutine_handle<> h);
+	// run func on a worker thread
+	void submit(task_t func);
+	// run func on the blocking pool
+	void offload(task_t func);
+};
+
+
+// suspend until fd is ready, returns the IOEvent bits
+class IOAwaiter {
+	int fd;
+	uint32_t events;
+	uint32_t ready;
+public:
+	IOAwaiter(int fd, uint32_t events) : fd(fd), events(events), ready(0) {}
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h);
+	uint32_t await_resume() const noexcept { return ready; }
+};
+
+inline IOAwaiter readable(int fd) { return IOAwaiter(fd, IO_READ); }
+inline IOAwaiter writable(int fd) { return IOAwaiter(fd, IO_WRITE); }
+
+
+// suspend while the loop does one recv()/send(), returns its byte count or -errno
+class TransferAwaiter {
+	bool sending;
+	int fd;
+	void *buf;
+	size_t n;
+	ssize_t result;
+public:
+	TransferAwaiter(bool sending, int fd, void *buf, size_t n) :
+		sending(sending), fd(fd), buf(buf), n(n), result(0) {}
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h);
+	ssize_t await_resume() const noexcept { return result; }
+};
+
+
+class SleepAwaiter {
+	int delay_ms;
+public:
+	explicit SleepAwaiter(int delay_ms) : delay_ms(delay_ms) {}
+
+	bool await_ready() const noexcept { return delay_ms <= 0; }
+	void await_suspend(std::coroutine_handle<> h);
+	void await_resume() const noexcept {}
+};
+
+inline SleepAwaiter sleep_for(int delay_ms) { return SleepAwaiter(delay_ms); }
+
+
+// run func() on the blocking pool, resume on a worker with its result
+template<class Func>
+class OffloadAwaiter {
+	using result_t = std::invoke_result_t<Func>;
+	using storage_t = std::conditional_t<std::is_void<result_t>::value, bool, result_t>;
+
+	Func func;
+	std::optional<storage_t> result;
+	std::exception_ptr error;
+
+public:
+	explicit OffloadAwaiter(Func func) : func(std::move(func)), result(), error() {}
+
+	bool await_ready() const noexcept { return false; }
+
+	void await_suspend(std::coroutine_handle<> h) {
+		auto &executor = Executor::current();
+		executor.offload([this, h, &executor] {
+			try {
+				if constexpr (std::is_void<result_t>::value) {
+					func();
+					result.emplace(true);
+				} else {
+					result.emplace(func());
+				}
+			} catch(...) {
+				error = std::current_exception();
+			}
+			executor.schedule(h);
+		});
+	}
+
+	result_t await_resume() {
+		if(error)
+			std::rethrow_exception(error);
+		if constexpr (!std::is_void<result_t>::value)
+			return std::move(*result);
+	}
+};
+
+template<class Func>
+OffloadAwaiter<std::decay_t<Func>> offload(Func &&func) {
+	return OffloadAwaiter<std::decay_t<Func>>(std::forward<Func>(func));
+}
+
+
+// socket I/O on a connection, suspends instead of blocking
+Task<ssize_t> read_some(int fd, void *buf, size_t n);
+Task<ssize_t> write_all(int fd, const void *buf, size_t n);
+// n bytes of file from offset to the socket with sendfile()
+Task<ssize_t> send_file(int fd, int file, off_t offset, size_t n);
+
+// whole-file read on the blocking pool
+Task<std::string> read_file(std::string path);
+
+}
+
+
+#endif
@@ -0,0 +1,199 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <memory>
+
+#include "body.h"
+#include "async.h"
+#include "debug.h"
+
+
+BodyReader::BodyReader(std::istream &is) :
+	is(is),
+	content_length(0),
+	remaining(0),
+	consumed(0),
+	max_size(unknown_length),
+	chunked(false),
+	last_chunk(false),
+	first_chunk(true),
+	failed(false),
+	expect_continue(false),
+	continue_sent(false),
+	conn(-1),
+	progress()
+{
+}
+
+void BodyReader::init(size_t length, bool chunked, bool expect_continue, size_t max_size) {
+	this->content_length = chunked ? unknown_length : length;
+	this->remaining = chunked ? 0 : length;
+	this->chunked = chunked;
+	this->expect_continue = expect_continue;
+	this->max_size = max_size;
+
+	// known to be too big, refuse before reading a single byte
+	if(!chunked && length > max_size)
+		failed = true;
+}
+
+void BodyReader::attach(int conn) {
+	this->conn = conn;
+}
+
+void BodyReader::on_progress(std::function<void ()> hook) {
+	progress = std::move(hook);
+}
+
+void BodyReader::send_continue() {
+	static const char line[] = "HTTP/1.1 100 Continue\r\n\r\n";
+	continue_sent = true;
+	if(conn >= 0)
+		send(conn, line, sizeof(line) - 1, MSG_NOSIGNAL);
+}
+
+bool BodyReader::next_chunk() {
+	using traits = std::istream::traits_type;
+	auto *sb = is.rdbuf();
+
+	// the previous chunk's data ends with CRLF
+	if(!first_chunk) {
+		auto ch = sb->sbumpc();
+		if(ch == '\r') ch = sb->sbumpc();
+		if(ch != '\n') return false;
+	}
+	first_chunk = false;
+
+	size_t size = 0;
+	int digits = 0;
+	for(auto ch = sb->sgetc(); ch != traits::eof() && std::isxdigit(ch); ch = sb->snextc()) {
+		if(++digits > 15) return false;
+		size = size * 16 + (std::isdigit(ch) ? ch - '0' : std::tolower(ch) - 'a' + 10);
+	}
+	if(digits == 0) return false;
+
+	// skip chunk extensions
+	traits::int_type ch;
+	while((ch = sb->sbumpc()) != traits::eof() && ch != '\n')
+		;
+	if(ch == traits::eof()) return false;
+
+	if(size == 0) {
+		// trailer fields, up to an empty line
+		last_chunk = true;
+		while(1) {
+			size_t length = 0;
+			while((ch = sb->sbumpc()) != traits::eof() && ch != '\n')
+				if(ch != '\r') length++;
+			if(ch == traits::eof()) return false;
+			if(length == 0) break;
+		}
+	}
+
+	remaining = size;
+	return true;
+}
+
+ssize_t BodyReader::read(char *buf, size_t n) {
+	auto num = read_body(buf, n);
+	if(num >= 0 && progress)
+		progress();
+	return num;
+}
+
+ssize_t BodyReader::read_body(char *buf, size_t n) {
+	if(failed) return -1;
+	if(n == 0) return 0;
+
+	if(expect_continue && !continue_sent)
+		send_continue();
+
+	if(chunked && remaining == 0) {
+		if(last_chunk) return 0;
+		if(!next_chunk()) {
+			failed = true;
+			return -1;
+		}
+		if(last_chunk) return 0;
+	}
+
+	if(remaining == 0)
+		return 0;
+
+	auto num = is.rdbuf()->sgetn(buf, std::min(n, remaining));
+	if(num <= 0) {
+		// peer went away in the middle of the body
+		failed = true;
+		return -1;
+	}
+
+	remaining -= num;
+	consumed += num;
+	if(consumed > max_size) {
+		failed = true;
+		return -1;
+	}
+	return num;
+}
+
+Task<ssize_t> BodyReader::async_read(char *buf, size_t n) {
+	if(expect_continue && !continue_sent)
+		send_continue();
+
+	if(conn >= 0 && !failed && !eof() && is.rdbuf()->in_avail() <= 0)
+		co_await async::readable(conn);
+
+	co_return read(buf, n);
+}
+
+std::string BodyReader::readall() {
+	std::string body;
+	if(content_length != unknown_length)
+		body.reserve(std::min(content_length, max_size));
+
+	char buf[16 * 1024];
+	ssize_t num;
+	while((num = read(buf, sizeof(buf))) > 0)
+		body.append(buf, num);
+
+	if(num < 0)
+		body.clear();
+	return body;
+}
+
+bool BodyReader::drain(size_t limit) {
+	if(awaiting_continue())
+		return false;
+
+	std::unique_ptr<char[]> buf(new char[16 * 1024]);
+	size_t drained = 0;
+	while(!eof()) {
+		if(drained > limit)
+			return false;
+		auto num = read(buf.get(), 16 * 1024);
+		if(num <= 0)
+			return num == 0;
+		drained += num;
+	}
+	return true;
+}
+
+size_t BodyReader::length() const {
+	return content_length;
+}
+
+bool BodyReader::eof() const {
+	return !failed && remaining == 0 && (!chunked || last_chunk);
+}
+
+bool BodyReader::too_large() const {
+	return (content_length != unknown_length && content_length > max_size)
+		|| consumed > max_size;
+}
+
+bool BodyReader::awaiting_continue() const {
+	return expect_continue && !continue_sent;
+}
@@ -0,0 +1,75 @@
+#ifndef BODY_H
+#define BODY_H
+
+#include <sys/types.h>
+
+#include <functional>
+#include <istream>
+#include <string>
+
+#include "task.h"
+
+
+/* Pull-based view of a request body. Handlers read it in pieces instead of
+ * the server buffering the whole Content-Length up front. Both fixed-length
+ * and chunked bodies are decoded, and the configured maximum is enforced
+ * while reading.
+ */
+class BodyReader {
+	std::istream &is;
+
+	size_t content_length;
+	size_t remaining;      // bytes left in the body, or in the current chunk
+	size_t consumed;       // body bytes handed out so far
+	size_t max_size;
+
+	bool chunked;
+	bool last_chunk;
+	bool first_chunk;
+	bool failed;
+
+	bool expect_continue;
+	bool continue_sent;
+	int conn;
+
+	std::function<void ()> progress;
+
+	bool next_chunk();
+	void send_continue();
+	ssize_t read_body(char *buf, size_t n);
+
+public:
+	static constexpr size_t unknown_length = ~size_t(0);
+
+	BodyReader(std::istream &is);
+
+	BodyReader(const BodyReader &) = delete;
+	BodyReader& operator= (const BodyReader &) = delete;
+
+	void init(size_t length, bool chunked, bool expect_continue, size_t max_size);
+
+	// socket the body arrives on, used for "100 Continue" and async_read
+	void attach(int conn);
+	// called after every successful read, the server re-arms its timeout
+	void on_progress(std::function<void ()> hook);
+
+	// at most n bytes; 0 at the end of the body, -1 on error or overflow
+	ssize_t read(char *buf, size_t n);
+	// like read, but suspends instead of blocking while nothing is buffered
+	Task<ssize_t> async_read(char *buf, size_t n);
+	// the rest of the body, empty if it exceeds the maximum
+	std::string readall();
+
+	// discard what the handler left unread, false if more than limit remains
+	bool drain(size_t limit);
+
+	// Content-Length, or unknown_length for chunked bodies
+	size_t length() const;
+	bool eof() const;
+	bool too_large() const;
+	// client still waits for "100 Continue" and has not sent the body
+	bool awaiting_continue() const;
+};
+
+
+#endif
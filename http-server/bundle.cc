@@ -0,0 +1,128 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bundle.h"
+#include "manifest.h"
+#include "debug.h"
+
+
+Bundle::Bundle(const std::string &filename) :
+	filename(filename),
+	fd(-1),
+	base(nullptr),
+	length(0),
+	header(nullptr),
+	entries(nullptr),
+	slots(nullptr)
+{
+}
+
+Bundle::~Bundle() {
+	if(base)
+		munmap(const_cast<char *>(base), length);
+	if(fd >= 0)
+		close(fd);
+}
+
+std::shared_ptr<const Bundle> Bundle::open(const std::string &filename) {
+	std::shared_ptr<Bundle> bundle(new Bundle(filename));
+	if(!bundle->load())
+		return nullptr;
+	wlog("bundle %: % entries, % bytes mapped\n", filename, bundle->size(), bundle->length);
+	return bundle;
+}
+
+bool Bundle::load() {
+	fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) < 0) {
+		wlog("cannot open bundle %: %\n", filename, strerror(errno));
+		return false;
+	}
+	length = st.st_size;
+	if(length < sizeof(BundleHeader)) {
+		wlog("bundle % is truncated\n", filename);
+		return false;
+	}
+
+	void *addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+	if(addr == MAP_FAILED) {
+		wlog("cannot map bundle %: %\n", filename, strerror(errno));
+		return false;
+	}
+	base = static_cast<const char *>(addr);
+	// the index is touched by every request, the bodies by sendfile() or on demand
+	madvise(addr, length, MADV_RANDOM);
+
+	header = reinterpret_cast<const BundleHeader *>(base);
+	if(memcmp(header->magic, bundle_magic, sizeof(bundle_magic)) != 0
+			|| header->version != bundle_version) {
+		wlog("% is not a bundle of version %\n", filename, bundle_version);
+		return false;
+	}
+
+	auto nslots = uint64_t(header->nslots);
+	auto index_size = sizeof(BundleHeader) + header->count * sizeof(BundleEntry)
+		+ nslots * sizeof(uint32_t);
+	if(header->file_size != length || index_size > length
+			|| nslots == 0 || (nslots & (nslots - 1)) != 0 || nslots <= header->count) {
+		wlog("bundle % has a broken index\n", filename);
+		return false;
+	}
+	entries = reinterpret_cast<const BundleEntry *>(header + 1);
+	slots = reinterpret_cast<const uint32_t *>(entries + header->count);
+
+	// checked once here, so lookups can trust every range
+	auto fits = [this](const BundleRange &range) {
+		return range.offset <= length && range.size <= length - range.offset;
+	};
+	for(uint32_t i = 0; i < header->count; i++) {
+		auto &entry = entries[i];
+		if(!fits(entry.path) || !fits(entry.header) || !fits(entry.body)
+				|| !fits(entry.gzip_header) || !fits(entry.gzip_body)
+				|| entry.index > header->count
+				|| memchr(entry.etag, '\0', sizeof(entry.etag)) == nullptr
+				|| memchr(entry.gzip_etag, '\0', sizeof(entry.gzip_etag)) == nullptr) {
+			wlog("bundle % has a broken entry %\n", filename, i);
+			return false;
+		}
+	}
+	for(uint64_t i = 0; i < nslots; i++) {
+		if(slots[i] > header->count) {
+			wlog("bundle % has a broken slot %\n", filename, i);
+			return false;
+		}
+	}
+	return true;
+}
+
+const BundleEntry *Bundle::lookup(std::string_view path) const {
+	auto key = normalize_path(path);
+	auto hash = bundle_hash(key);
+	auto mask = header->nslots - 1;
+
+	// the builder keeps the table at most half full, so an empty slot is near
+	for(auto slot = hash & mask; slots[slot] != 0; slot = (slot + 1) & mask) {
+		auto *entry = &entries[slots[slot] - 1];
+		if(entry->hash == hash && view(entry->path) == key)
+			return entry;
+	}
+	return nullptr;
+}
+
+const BundleEntry *Bundle::find(std::string_view path) const {
+	auto *entry = lookup(path);
+	if(entry && (entry->flags & BUNDLE_DIRECTORY) && entry->index)
+		return &entries[entry->index - 1];
+	return entry;
+}
+
+bool Bundle::is_directory(std::string_view path) const {
+	auto *entry = lookup(path);
+	return entry && (entry->flags & BUNDLE_DIRECTORY);
+}
@@ -0,0 +1,99 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+
+/* A directory tree packed into one file by tools/bundle_builder.cc, served
+ * straight from a read-only mapping. Layout, native byte order:
+ *
+ *   BundleHeader
+ *   BundleEntry[count]
+ *   uint32_t slots[nslots]  open addressing on the path hash, entry + 1, 0 empty
+ *   paths and precomputed header lines
+ *   bodies, each aligned to bundle_alignment (page size from 64KB on)
+ */
+constexpr char bundle_magic[8] = { 'H', 'T', 'T', 'P', 'B', 'U', 'N', '1' };
+constexpr uint32_t bundle_version = 1;
+constexpr uint64_t bundle_alignment = 64;
+
+enum BundleFlags : uint32_t {
+	BUNDLE_DIRECTORY = 1u << 0,
+};
+
+struct BundleRange {
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct BundleHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;
+	uint32_t nslots;       // power of two
+	uint32_t reserved;
+	uint64_t file_size;
+};
+
+struct BundleEntry {
+	uint64_t hash;
+	BundleRange path;      // relative to the root, no leading '/'
+	uint32_t flags;
+	uint32_t index;        // directories: entry of index.html + 1, 0 if none
+	BundleRange header;    // "Content-Type: ...\r\nContent-Length: ...\r\nETag: ...\r\n"
+	BundleRange body;
+	BundleRange gzip_header;
+	BundleRange gzip_body; // size 0 if there is no precompressed copy
+	char etag[24];         // quoted, NUL terminated
+	char gzip_etag[24];
+};
+
+// FNV-1a, the hash slots are probed with
+inline uint64_t bundle_hash(std::string_view path) {
+	uint64_t hash = 14695981039346656037ull;
+	for(unsigned char c : path) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+class Bundle {
+	std::string filename;
+	int fd;
+	const char *base;
+	size_t length;
+
+	const BundleHeader *header;
+	const BundleEntry *entries;
+	const uint32_t *slots;
+
+	Bundle(const std::string &filename);
+	bool load();
+	const BundleEntry *lookup(std::string_view path) const;
+
+public:
+	// nullptr if the file is missing or malformed, the reason is logged
+	static std::shared_ptr<const Bundle> open(const std::string &filename);
+	~Bundle();
+
+	Bundle(const Bundle &) = delete;
+	Bundle& operator= (const Bundle &) = delete;
+
+	// path relative to the root; a directory resolves to its index
+	const BundleEntry *find(std::string_view path) const;
+	bool is_directory(std::string_view path) const;
+
+	std::string_view view(const BundleRange &range) const {
+		return std::string_view(base + range.offset, range.size);
+	}
+	// the bundle file itself, for sendfile() at body offsets
+	int file() const { return fd; }
+	size_t size() const { return header->count; }
+};
+
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef EMBEDDED_H
+#define EMBEDDED_H
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+
+// a file compiled into the binary, see tools/embed_generator.cc
+struct EmbeddedAsset {
+	std::string_view path;      // relative to the embedded root, no leading '/'
+	bool directory;
+	uint32_t index;             // directories: asset of index.html + 1, 0 if none
+	std::string_view header;    // "Content-Type: ...\r\nETag: ...\r\nContent-Length: ...\r\n"
+	std::string_view body;
+	std::string_view etag;
+};
+
+/* The directory given to CMake with -DEMBED_DIRECTORY={dir}, built into
+ * the executable (HTTP_EMBEDDED is defined then). The index is a perfect
+ * hash the compiler builds, the headers are generated with the sources.
+ */
+namespace embedded {
+
+// path relative to the root; a directory resolves to its index
+const EmbeddedAsset *find(std::string_view path);
+bool is_directory(std::string_view path);
+size_t size();
+
+}
+
+
+#endif
@@ -0,0 +1,808 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <unordered_map>
+#include <algorithm>
+
+#include "eventloop.h"
+#include "debug.h"
+
+
+EventLoop::EventLoop() :
+	pending_mutex(),
+	pending(),
+	stopped(false),
+	timers(),
+	reserve_fd(open("/dev/null", O_RDONLY | O_CLOEXEC)),
+	last_accept_report(),
+	accept_failures(0),
+	wakefd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+{
+	if(wakefd < 0) {
+		wloge("fail to create eventfd.\n");
+	}
+}
+
+EventLoop::~EventLoop() {
+	restore_reserve();
+	close(reserve_fd);
+	close(wakefd);
+}
+
+constexpr int EventLoop::accept_budget;
+constexpr int EventLoop::accept_backoff_ms;
+
+void EventLoop::accept_failed(int err) {
+	accept_failures++;
+	auto now = std::chrono::steady_clock::now();
+	if(now - last_accept_report < std::chrono::seconds(1))
+		return;
+
+	wlog("fail to accept client: % (% failures since last logged)\n", strerror(err), accept_failures);
+	last_accept_report = now;
+	accept_failures = 0;
+}
+
+bool EventLoop::release_reserve() {
+	if(reserve_fd < 0)
+		return false;
+	close(reserve_fd);
+	reserve_fd = -1;
+	return true;
+}
+
+void EventLoop::restore_reserve() {
+	if(reserve_fd < 0)
+		reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+void EventLoop::drain_wakefd() {
+	eventfd_t value;
+	eventfd_read(wakefd, &value);
+}
+
+void EventLoop::run_pending() {
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		running.swap(pending);
+	}
+
+	// the two vectors trade places and keep their capacity
+	for(auto &task : running)
+		task();
+	running.clear();
+}
+
+void EventLoop::post(task_t task) {
+	{
+		std::lock_guard<std::mutex> lock(pending_mutex);
+		pending.push_back(std::move(task));
+	}
+	eventfd_write(wakefd, 1);
+}
+
+// the loop only needs waking when a timer is due before its current wait ends
+void EventLoop::run_after(int delay_ms, task_t task) {
+	if(timers.schedule(delay_ms, std::move(task)))
+		eventfd_write(wakefd, 1);
+}
+
+void EventLoop::schedule(TimerNode &node, int delay_ms, task_t task) {
+	if(timers.schedule(node, delay_ms, std::move(task)))
+		eventfd_write(wakefd, 1);
+}
+
+void EventLoop::cancel(TimerNode &node) {
+	timers.cancel(node);
+}
+
+void EventLoop::recv(int fd, void *buf, size_t n, complete_t done) {
+	watch(fd, IO_READ, [this, fd, buf, n, done = std::move(done)](uint32_t) mutable {
+		auto num = ::recv(fd, buf, n, MSG_DONTWAIT);
+		if(num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			recv(fd, buf, n, std::move(done));
+		else
+			done(num < 0 ? -errno : num);
+	});
+}
+
+void EventLoop::send(int fd, const void *buf, size_t n, complete_t done) {
+	watch(fd, IO_WRITE, [this, fd, buf, n, done = std::move(done)](uint32_t) mutable {
+		auto num = ::send(fd, buf, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(num < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			send(fd, buf, n, std::move(done));
+		else
+			done(num < 0 ? -errno : num);
+	});
+}
+
+void EventLoop::run() {
+	while(!stopped) {
+		poll(timers.next_timeout());
+		timers.advance();
+		run_pending();
+	}
+}
+
+void EventLoop::stop() {
+	stopped = true;
+	eventfd_write(wakefd, 1);
+}
+
+
+///   epoll backend
+class EpollLoop : public EventLoop {
+	int epfd;
+	std::unordered_map<int, accept_t> listeners;
+
+	struct Watch {
+		uint32_t events;
+		handler_t handler;
+	};
+	// a reader and a writer may wait on one fd at the same time; a watch
+	// that includes IO_WRITE is the writer
+	struct Watchers {
+		Watch read;
+		Watch write;
+	};
+	std::unordered_map<int, Watchers> handlers;
+
+	static constexpr int max_events = 64;
+
+	void accept_from(int servfd, accept_t &on_accept);
+	// one-shot registration for everything still waited for on fd
+	bool arm(int fd, const Watchers &w);
+
+protected:
+	void poll(int timeout_ms) override;
+
+public:
+	EpollLoop();
+	~EpollLoop();
+
+	const char *name() const override { return "epoll"; }
+
+	void listen(int servfd, accept_t on_accept) override;
+	void unlisten(int servfd) override;
+	void watch(int fd, uint32_t events, handler_t handler) override;
+	void unwatch(int fd) override;
+};
+
+constexpr int EpollLoop::max_events;
+
+EpollLoop::EpollLoop() :
+	epfd(epoll_create1(EPOLL_CLOEXEC)),
+	listeners(),
+	handlers()
+{
+	if(epfd < 0) {
+		wloge("fail to create epoll instance.\n");
+	}
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = wakefd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+}
+
+EpollLoop::~EpollLoop() {
+	close(epfd);
+}
+
+void EpollLoop::listen(int servfd, accept_t on_accept) {
+	// level triggered, so a backlog left behind wakes us up again
+	fcntl(servfd, F_SETFL, fcntl(servfd, F_GETFL) | O_NONBLOCK);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = servfd;
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, servfd, &ev) < 0) {
+		wloge("fail to watch server fd %\n", servfd);
+	}
+
+	listeners[servfd] = std::move(on_accept);
+}
+
+void EpollLoop::unlisten(int servfd) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, servfd, nullptr);
+	listeners.erase(servfd);
+}
+
+/* Drains the backlog up to accept_budget, level triggering brings us back
+ * for the rest. Connections stay blocking, the workers read them so.
+ */
+void EpollLoop::accept_from(int servfd, accept_t &on_accept) {
+	for(int i = 0; i < accept_budget; i++) {
+		int conn = accept4(servfd, nullptr, nullptr, SOCK_CLOEXEC);
+		if(conn >= 0) {
+			on_accept(conn);
+			continue;
+		}
+
+		int err = errno;
+		if(err == EAGAIN || err == EWOULDBLOCK)
+			return;
+		if(err == EINTR || err == ECONNABORTED)
+			continue;
+		accept_failed(err);
+
+		// out of descriptors: the spare one takes the connection off the
+		// backlog to close it, or it would wake us up again at once
+		if((err == EMFILE || err == ENFILE) && release_reserve()) {
+			conn = accept4(servfd, nullptr, nullptr, SOCK_CLOEXEC);
+			if(conn >= 0)
+				close(conn);
+			restore_reserve();
+			continue;
+		}
+
+		// nothing to do about it but not spin on the listener
+		epoll_ctl(epfd, EPOLL_CTL_DEL, servfd, nullptr);
+		run_after(accept_backoff_ms, [this, servfd]() {
+			if(!listeners.count(servfd))
+				return;
+			struct epoll_event ev;
+			ev.events = EPOLLIN;
+			ev.data.fd = servfd;
+			epoll_ctl(epfd, EPOLL_CTL_ADD, servfd, &ev);
+		});
+		return;
+	}
+}
+
+bool EpollLoop::arm(int fd, const Watchers &w) {
+	uint32_t events = (w.read.handler ? w.read.events : 0) | (w.write.handler ? w.write.events : 0);
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT;
+	if(events & IO_READ)  ev.events |= EPOLLIN | EPOLLRDHUP;
+	if(events & IO_WRITE) ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+
+	// a one-shot fd stays registered after firing, so re-arm it with MOD
+	if(epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		if(errno != EEXIST || epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
+			wlog("fail to watch fd %: %\n", fd, strerror(errno));
+			return false;
+		}
+	}
+	return true;
+}
+
+void EpollLoop::watch(int fd, uint32_t events, handler_t handler) {
+	auto &w = handlers[fd];
+	auto &slot = events & IO_WRITE ? w.write : w.read;
+	slot.events = events;
+	slot.handler = std::move(handler);
+	if(!arm(fd, w)) {
+		slot.handler = nullptr;
+		if(!w.read.handler && !w.write.handler)
+			handlers.erase(fd);
+	}
+}
+
+void EpollLoop::unwatch(int fd) {
+	epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+	handlers.erase(fd);
+}
+
+void EpollLoop::poll(int timeout_ms) {
+	struct epoll_event events[max_events];
+	int n = epoll_wait(epfd, events, max_events, timeout_ms);
+	if(n < 0) {
+		if(errno != EINTR)
+			wlog("epoll_wait failed: %\n", strerror(errno));
+		return;
+	}
+
+	for(int i = 0; i < n; i++) {
+		int fd = events[i].data.fd;
+		if(fd == wakefd) {
+			drain_wakefd();
+			continue;
+		}
+
+		auto lit = listeners.find(fd);
+		if(lit != listeners.end()) {
+			accept_from(fd, lit->second);
+			continue;
+		}
+
+		auto hit = handlers.find(fd);
+		if(hit == handlers.end())
+			continue;
+
+		uint32_t ready = 0;
+		if(events[i].events & (EPOLLIN | EPOLLRDHUP)) ready |= IO_READ;
+		if(events[i].events & EPOLLOUT)               ready |= IO_WRITE;
+		if(events[i].events & (EPOLLERR | EPOLLHUP))  ready |= IO_ERROR;
+
+		// handlers may re-watch the same fd, so take them out first
+		auto &w = hit->second;
+		handler_t on_read, on_write;
+		if(w.read.handler && (ready & (w.read.events | IO_ERROR)))
+			on_read = std::move(w.read.handler);
+		if(w.write.handler && (ready & (w.write.events | IO_ERROR)))
+			on_write = std::move(w.write.handler);
+		// the one that did not fire still waits
+		if(w.read.handler || w.write.handler)
+			arm(fd, w);
+		else
+			handlers.erase(hit);
+
+		if(on_read)
+			on_read(ready);
+		if(on_write)
+			on_write(ready);
+	}
+}
+
+
+///   io_uring backend
+/* Talks to the kernel through the raw syscalls, so no liburing is needed.
+ * Accepts use multishot IORING_OP_ACCEPT on registered (fixed) listening
+ * files, readiness uses IORING_OP_POLL_ADD, and recv()/send() become
+ * IORING_OP_RECV/IORING_OP_SEND, which complete with the data moved instead
+ * of a wakeup to move it. Every SQE queued while dispatching is submitted
+ * together with the next wait in one io_uring_enter call.
+ */
+class UringLoop : public EventLoop {
+	enum OpKind { AcceptOp, PollOp, TransferOp, WakeOp };
+
+	struct Op {
+		OpKind kind;
+		int fd;        // raw fd, or fixed-file index for AcceptOp (-1 once cancelled)
+		accept_t on_accept;
+		handler_t on_ready;
+		complete_t on_done;
+	};
+
+	int ringfd;
+	struct io_uring_params params;
+
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	unsigned sq_local_tail;
+	unsigned to_submit;
+
+	bool multishot_accept;
+	// the reserve fd is released and the next accepted connection is closed
+	bool shedding;
+
+	std::unordered_map<uint64_t, Op> ops;
+	// poll and transfer tokens by fd, a reader and a writer can wait on one
+	// fd together
+	std::unordered_multimap<int, uint64_t> watched;
+	uint64_t next_token;
+	std::vector<int> fixed_files;
+
+	static constexpr unsigned ring_entries = 256;
+	static constexpr uint64_t wake_token = 1;
+	static constexpr uint64_t ignore_token = 0;
+
+	UringLoop();
+	bool setup();
+
+	struct io_uring_sqe *get_sqe();
+	int enter(unsigned min_complete, int timeout_ms);
+	void submit_accept(uint64_t token, const Op &op);
+	void submit_poll(uint64_t token, int fd, uint32_t poll_mask);
+	void submit_transfer(uint8_t opcode, int fd, const void *buf, size_t n, complete_t done);
+	// forget token, which was waiting on fd
+	void drop_watched(int fd, uint64_t token);
+	void dispatch(const struct io_uring_cqe &cqe);
+
+protected:
+	void poll(int timeout_ms) override;
+
+public:
+	static std::unique_ptr<EventLoop> try_create();
+	~UringLoop();
+
+	const char *name() const override { return "io_uring"; }
+
+	void listen(int servfd, accept_t on_accept) override;
+	void unlisten(int servfd) override;
+	void watch(int fd, uint32_t events, handler_t handler) override;
+	void unwatch(int fd) override;
+	void recv(int fd, void *buf, size_t n, complete_t done) override;
+	void send(int fd, const void *buf, size_t n, complete_t done) override;
+};
+
+constexpr unsigned UringLoop::ring_entries;
+constexpr uint64_t UringLoop::wake_token;
+constexpr uint64_t UringLoop::ignore_token;
+
+UringLoop::UringLoop() :
+	ringfd(-1),
+	params(),
+	sq_ptr(MAP_FAILED), cq_ptr(MAP_FAILED),
+	sq_size(0), cq_size(0),
+	sq_head(nullptr), sq_tail(nullptr), sq_mask(nullptr), sq_array(nullptr),
+	cq_head(nullptr), cq_tail(nullptr), cq_mask(nullptr),
+	sqes((struct io_uring_sqe *)MAP_FAILED),
+	cqes(nullptr),
+	sq_local_tail(0),
+	to_submit(0),
+	multishot_accept(true),
+	shedding(false),
+	ops(),
+	watched(),
+	next_token(wake_token + 1),
+	fixed_files()
+{
+}
+
+UringLoop::~UringLoop() {
+	if(sqes != MAP_FAILED)
+		munmap(sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+	if(cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_size);
+	if(sq_ptr != MAP_FAILED)
+		munmap(sq_ptr, sq_size);
+	if(ringfd >= 0)
+		close(ringfd);
+}
+
+std::unique_ptr<EventLoop> UringLoop::try_create() {
+	std::unique_ptr<UringLoop> loop(new UringLoop);
+	if(!loop->setup())
+		return nullptr;
+	return loop;
+}
+
+bool UringLoop::setup() {
+	memset(&params, 0, sizeof(params));
+	ringfd = syscall(__NR_io_uring_setup, ring_entries, &params);
+	if(ringfd < 0) {
+		wlog("io_uring_setup failed: %\n", strerror(errno));
+		return false;
+	}
+
+	// timed waits go through IORING_ENTER_EXT_ARG (5.11+)
+	if(!(params.features & IORING_FEAT_EXT_ARG)) {
+		wlog("io_uring lacks IORING_FEAT_EXT_ARG\n");
+		return false;
+	}
+
+	sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_size = cq_size = std::max(sq_size, cq_size);
+
+	sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_SQ_RING);
+	if(sq_ptr == MAP_FAILED)
+		return false;
+
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ringfd, IORING_OFF_CQ_RING);
+		if(cq_ptr == MAP_FAILED)
+			return false;
+	}
+
+	sqes = (struct io_uring_sqe *)mmap(nullptr,
+			params.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ringfd, IORING_OFF_SQES);
+	if(sqes == MAP_FAILED)
+		return false;
+
+	auto *sq = (char *)sq_ptr;
+	auto *cq = (char *)cq_ptr;
+	sq_head  = (unsigned *)(sq + params.sq_off.head);
+	sq_tail  = (unsigned *)(sq + params.sq_off.tail);
+	sq_mask  = (unsigned *)(sq + params.sq_off.ring_mask);
+	sq_array = (unsigned *)(sq + params.sq_off.array);
+	cq_head  = (unsigned *)(cq + params.cq_off.head);
+	cq_tail  = (unsigned *)(cq + params.cq_off.tail);
+	cq_mask  = (unsigned *)(cq + params.cq_off.ring_mask);
+	cqes     = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	sq_local_tail = *sq_tail;
+
+	ops[wake_token] = Op { WakeOp, wakefd, nullptr, nullptr, nullptr };
+	submit_poll(wake_token, wakefd, POLLIN);
+	return true;
+}
+
+struct io_uring_sqe *UringLoop::get_sqe() {
+	unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if(sq_local_tail - head >= params.sq_entries) {
+		// ring is full, push what we have without waiting
+		enter(0, 0);
+		head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	}
+
+	unsigned idx = sq_local_tail & *sq_mask;
+	auto *sqe = &sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sq_array[idx] = idx;
+	sq_local_tail++;
+	to_submit++;
+	return sqe;
+}
+
+int UringLoop::enter(unsigned min_complete, int timeout_ms) {
+	__atomic_store_n(sq_tail, sq_local_tail, __ATOMIC_RELEASE);
+
+	unsigned flags = 0;
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	void *argp = nullptr;
+	size_t argsz = 0;
+
+	if(min_complete) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if(timeout_ms >= 0) {
+			ts.tv_sec = timeout_ms / 1000;
+			ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+			memset(&arg, 0, sizeof(arg));
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+			argp = &arg;
+			argsz = sizeof(arg);
+		}
+	}
+
+	int ret = syscall(__NR_io_uring_enter, ringfd, to_submit, min_complete,
+			flags, argp, argsz);
+	if(ret >= 0) {
+		to_submit -= std::min<unsigned>(ret, to_submit);
+	} else if(errno != EINTR && errno != ETIME && errno != EBUSY) {
+		wlog("io_uring_enter failed: %\n", strerror(errno));
+	}
+	return ret;
+}
+
+void UringLoop::submit_accept(uint64_t token, const Op &op) {
+	auto *sqe = get_sqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = op.fd;
+	sqe->flags = IOSQE_FIXED_FILE;
+	sqe->accept_flags = SOCK_CLOEXEC;
+	if(multishot_accept)
+		sqe->ioprio |= IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = token;
+}
+
+void UringLoop::submit_poll(uint64_t token, int fd, uint32_t poll_mask) {
+	auto *sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = poll_mask;
+	sqe->user_data = token;
+}
+
+void UringLoop::submit_transfer(uint8_t opcode, int fd, const void *buf, size_t n, complete_t done) {
+	auto token = next_token++;
+	ops[token] = Op { TransferOp, fd, nullptr, nullptr, std::move(done) };
+	watched.emplace(fd, token);
+
+	auto *sqe = get_sqe();
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buf;
+	sqe->len = std::min<size_t>(n, UINT32_MAX);
+	sqe->msg_flags = opcode == IORING_OP_SEND ? MSG_NOSIGNAL : 0;
+	sqe->user_data = token;
+}
+
+void UringLoop::drop_watched(int fd, uint64_t token) {
+	auto range = watched.equal_range(fd);
+	for(auto it = range.first; it != range.second; ++it) {
+		if(it->second == token) {
+			watched.erase(it);
+			return;
+		}
+	}
+}
+
+void UringLoop::listen(int servfd, accept_t on_accept) {
+	// the listening sockets live in the registered file table, so the
+	// kernel skips the fd lookup on every accept
+	if(!fixed_files.empty())
+		syscall(__NR_io_uring_register, ringfd, IORING_UNREGISTER_FILES, nullptr, 0);
+
+	fixed_files.push_back(servfd);
+	if(syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_FILES,
+				fixed_files.data(), fixed_files.size()) < 0) {
+		wloge("fail to register server fd %: %\n", servfd, strerror(errno));
+	}
+
+	auto token = next_token++;
+	ops[token] = Op { AcceptOp, (int)fixed_files.size() - 1, std::move(on_accept), nullptr, nullptr };
+	submit_accept(token, ops[token]);
+}
+
+void UringLoop::unlisten(int servfd) {
+	for(auto it = ops.begin(); it != ops.end(); ++it) {
+		auto &op = it->second;
+		if(op.kind != AcceptOp || op.fd < 0 || fixed_files[op.fd] != servfd)
+			continue;
+
+		auto *sqe = get_sqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = it->first;
+		sqe->user_data = ignore_token;
+
+		// the registered table holds a reference too, which would keep
+		// the socket listening after the caller closes it
+		int unused = -1;
+		struct io_uring_files_update update;
+		memset(&update, 0, sizeof(update));
+		update.offset = op.fd;
+		update.fds = (uint64_t)(uintptr_t)&unused;
+		syscall(__NR_io_uring_register, ringfd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+		fixed_files[op.fd] = -1;
+
+		// connections the kernel accepted before the cancel still arrive
+		op.fd = -1;
+		return;
+	}
+}
+
+void UringLoop::watch(int fd, uint32_t events, handler_t handler) {
+	uint32_t mask = 0;
+	if(events & IO_READ)  mask |= POLLIN | POLLRDHUP;
+	if(events & IO_WRITE) mask |= POLLOUT;
+
+	auto token = next_token++;
+	ops[token] = Op { PollOp, fd, nullptr, std::move(handler), nullptr };
+	watched.emplace(fd, token);
+	submit_poll(token, fd, mask);
+}
+
+void UringLoop::unwatch(int fd) {
+	auto range = watched.equal_range(fd);
+	for(auto it = range.first; it != range.second; ++it) {
+		auto *sqe = get_sqe();
+		sqe->opcode = ops[it->second].kind == PollOp ? IORING_OP_POLL_REMOVE : IORING_OP_ASYNC_CANCEL;
+		sqe->addr = it->second;
+		sqe->user_data = ignore_token;
+
+		// the cancelled completion finds no op and is dropped
+		ops.erase(it->second);
+	}
+	watched.erase(range.first, range.second);
+}
+
+void UringLoop::recv(int fd, void *buf, size_t n, complete_t done) {
+	submit_transfer(IORING_OP_RECV, fd, buf, n, std::move(done));
+}
+
+void UringLoop::send(int fd, const void *buf, size_t n, complete_t done) {
+	submit_transfer(IORING_OP_SEND, fd, buf, n, std::move(done));
+}
+
+void UringLoop::dispatch(const struct io_uring_cqe &cqe) {
+	auto it = ops.find(cqe.user_data);
+	if(it == ops.end())
+		return;
+
+	auto token = it->first;
+	auto &op = it->second;
+
+	switch(op.kind) {
+	case WakeOp:
+		drain_wakefd();
+		submit_poll(wake_token, wakefd, POLLIN);
+		break;
+
+	case AcceptOp: {
+		bool backoff = false;
+		if(cqe.res == -EINVAL && multishot_accept) {
+			// pre-5.19 kernel, one accept per submission
+			wlog("multishot accept unsupported, using single-shot\n");
+			multishot_accept = false;
+		} else if(cqe.res >= 0 && shedding) {
+			// the connection the reserve fd made room for
+			close(cqe.res);
+			restore_reserve();
+			shedding = false;
+		} else if(cqe.res >= 0) {
+			op.on_accept(cqe.res);
+		} else if(cqe.res != -ECANCELED && cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+			accept_failed(-cqe.res);
+			// out of descriptors: free the spare one so the next accept
+			// takes a connection off the backlog, to be closed
+			bool released = (cqe.res == -EMFILE || cqe.res == -ENFILE) && release_reserve();
+			shedding = shedding || released;
+			backoff = !released;
+		}
+
+		if(cqe.flags & IORING_CQE_F_MORE)
+			break;
+		if(op.fd < 0) {
+			ops.erase(token);
+		} else if(backoff) {
+			// nothing to do about it but not spin on the listener
+			run_after(accept_backoff_ms, [this, token]() {
+				auto it = ops.find(token);
+				if(it == ops.end())
+					return;
+				if(it->second.fd < 0)
+					ops.erase(it);
+				else
+					submit_accept(token, it->second);
+			});
+		} else {
+			submit_accept(token, op);
+		}
+		break;
+	}
+
+	case PollOp: {
+		auto handler = std::move(op.on_ready);
+		drop_watched(op.fd, token);
+		ops.erase(it);
+
+		uint32_t ready = 0;
+		if(cqe.res < 0) {
+			ready = IO_ERROR;
+		} else {
+			if(cqe.res & (POLLIN | POLLRDHUP)) ready |= IO_READ;
+			if(cqe.res & POLLOUT)              ready |= IO_WRITE;
+			if(cqe.res & (POLLERR | POLLHUP))  ready |= IO_ERROR;
+		}
+		handler(ready);
+		break;
+	}
+
+	case TransferOp: {
+		auto done = std::move(op.on_done);
+		drop_watched(op.fd, token);
+		ops.erase(it);
+		done(cqe.res);
+		break;
+	}
+	}
+}
+
+void UringLoop::poll(int timeout_ms) {
+	enter(1, timeout_ms);
+
+	unsigned head = *cq_head;
+	unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+	while(head != tail) {
+		// copy out, handlers may queue new SQEs while we walk the CQ
+		auto cqe = cqes[head & *cq_mask];
+		head++;
+		__atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+		dispatch(cqe);
+	}
+}
+
+
+std::unique_ptr<EventLoop> EventLoop::create(const std::string &backend) {
+	if(backend == "uring" || backend == "io_uring") {
+		auto loop = UringLoop::try_create();
+		if(loop) return loop;
+		wlog("io_uring unavailable, fall back to epoll\n");
+	} else if(backend != "epoll" && backend != "") {
+		wlog("unknown io backend '%', use epoll\n", backend);
+	}
+
+	return std::unique_ptr<EventLoop>(new EpollLoop);
+}
@@ -0,0 +1,117 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "timerwheel.h"
+#include "unique_function.h"
+
+// readiness bits reported to handlers, independent of the backend
+enum IOEvent : uint32_t {
+	IO_READ  = 1u << 0,
+	IO_WRITE = 1u << 1,
+	IO_ERROR = 1u << 2,
+};
+
+/* The event loop owns the listening sockets and every connection that is
+ * waiting for I/O. Handlers run inside the loop thread; other threads hand
+ * work to the loop with post().
+ *
+ * listen/watch/unwatch/recv/send must only be called from the loop thread;
+ * timers and post() work from anywhere.
+ */
+class EventLoop {
+public:
+	using accept_t  = std::function<void (int conn)>;
+	using handler_t = unique_function<void (uint32_t events)>;
+	using task_t    = unique_function<void ()>;
+	// byte count, or -errno
+	using complete_t = unique_function<void (ssize_t res)>;
+
+private:
+	std::mutex pending_mutex;
+	std::vector<task_t> pending;
+	std::vector<task_t> running;  // loop thread: the batch taken from pending
+	std::atomic<bool> stopped;
+
+	TimerWheel timers;
+
+	// a spare descriptor, given up to take connections off the backlog when
+	// the process has run out of them
+	int reserve_fd;
+	std::chrono::steady_clock::time_point last_accept_report;
+	size_t accept_failures;  // since last_accept_report
+
+protected:
+	int wakefd;
+
+	// connections taken per wakeup of a listener before other events get a turn
+	static constexpr int accept_budget = 64;
+	// how long a listener rests after an accept error it cannot work around
+	static constexpr int accept_backoff_ms = 100;
+
+	EventLoop();
+
+	void drain_wakefd();
+	void run_pending();
+
+	// logged at most once a second, with the number of failures in between
+	void accept_failed(int err);
+	// close the reserve fd, false if it is already gone
+	bool release_reserve();
+	void restore_reserve();
+
+	// wait at most timeout_ms (-1 forever) and dispatch ready events
+	virtual void poll(int timeout_ms) = 0;
+
+public:
+	// backend is "epoll" or "uring"; falls back to epoll if uring is unusable
+	static std::unique_ptr<EventLoop> create(const std::string &backend);
+
+	EventLoop(const EventLoop &) = delete;
+	EventLoop& operator= (const EventLoop &) = delete;
+	virtual ~EventLoop();
+
+	virtual const char *name() const = 0;
+
+	// accept connections on servfd until the loop stops or unlisten()
+	virtual void listen(int servfd, accept_t on_accept) = 0;
+	virtual void unlisten(int servfd) = 0;
+
+	// one-shot notification when fd becomes ready for `events`; a reader
+	// (IO_READ) and a writer (IO_WRITE) can wait on the same fd at once
+	virtual void watch(int fd, uint32_t events, handler_t handler) = 0;
+	virtual void unwatch(int fd) = 0;
+
+	/* one recv()/send() of up to n bytes as soon as fd allows it; buf must
+	 * live until done runs. The default waits with watch() and makes the
+	 * call in the loop, io_uring hands the transfer itself to the kernel.
+	 * unwatch(fd) drops them like any watch.
+	 */
+	virtual void recv(int fd, void *buf, size_t n, complete_t done);
+	virtual void send(int fd, const void *buf, size_t n, complete_t done);
+
+	// run task inside the loop thread, callable from any thread
+	void post(task_t task);
+
+	// run task in the loop thread once delay_ms has passed
+	void run_after(int delay_ms, task_t task);
+	// arm (or re-arm) node to run task in the loop thread after delay_ms
+	void schedule(TimerNode &node, int delay_ms, task_t task);
+	void cancel(TimerNode &node);
+
+	void run();
+	void stop();
+};
+
+
+#endif
@@ -0,0 +1,374 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "eventstream.h"
+#include "eventloop.h"
+#include "debug.h"
+
+
+struct EventHub::Subscriber {
+	ConnectionPtr c;
+	int fd;
+	Topic *topic;
+	size_t index;              // in topic->subscribers
+	size_t slot;               // in everyone
+	std::vector<Frame> queue;  // what the socket did not take yet, the first from sent on
+	size_t sent;
+	size_t backlog;            // bytes in queue
+	bool wrote;                // something went out since the last tick
+};
+
+/* as much of count frames, the first from offset, as the socket takes;
+ * frames, count and offset are left at what is still to send. The bytes
+ * sent, -1 if the socket failed.
+ */
+static ssize_t write_frames(int fd, const EventHub::Frame *&frames, size_t &count, size_t &offset) {
+	ssize_t total = 0;
+	while(count > 0) {
+		struct iovec iov[64];
+		size_t n = std::min(count, size_t(64)), want = 0;
+		for(size_t i = 0; i < n; i++) {
+			size_t skip = i == 0 ? offset : 0;
+			iov[i].iov_base = (void *)(frames[i]->data() + skip);
+			iov[i].iov_len = frames[i]->size() - skip;
+			want += iov[i].iov_len;
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		auto r = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(r < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+		total += r;
+
+		size_t left = r;
+		while(count > 0 && left >= frames[0]->size() - offset) {
+			left -= frames[0]->size() - offset;
+			offset = 0;
+			frames++;
+			count--;
+		}
+		offset += left;
+		if(size_t(r) < want)
+			break;
+	}
+	return total;
+}
+
+// "event: ..." and one "data: ..." per line, ended by a blank line
+static std::string encode_event(uint64_t id, std::string_view data, std::string_view event) {
+	std::string s;
+	s.reserve(data.size() + event.size() + 48);
+	s += "id: ";
+	s += std::to_string(id);
+	s += '\n';
+	if(!event.empty()) {
+		// a line break would end the field early
+		s += "event: ";
+		s += event.substr(0, event.find_first_of("\r\n"));
+		s += '\n';
+	}
+	// one data field per line; CRLF, a lone CR and LF all end one
+	while(1) {
+		auto end = data.find_first_of("\r\n");
+		s += "data: ";
+		s += data.substr(0, end);
+		s += '\n';
+		if(end == data.npos)
+			break;
+		bool crlf = data[end] == '\r' && end + 1 < data.size() && data[end + 1] == '\n';
+		data.remove_prefix(end + (crlf ? 2 : 1));
+	}
+	s += '\n';
+	return s;
+}
+
+
+EventHub::EventHub(size_t history_size, int heartbeat_ms, size_t max_backlog, int history_ttl_ms) :
+	history_size(history_size),
+	heartbeat_ms(heartbeat_ms),
+	max_backlog(max_backlog),
+	history_ttl(history_ttl_ms),
+	mutex(),
+	topics(),
+	pending(),
+	posted(false),
+	last_id(0),
+	delivered(0),
+	loop(nullptr),
+	everyone(),
+	heartbeat()
+{
+}
+
+EventHub::~EventHub() {
+	// detach() has closed them unless the loop never ran
+	for(auto *s : everyone)
+		delete s;
+}
+
+uint64_t EventHub::publish(std::string_view topic, std::string_view data, std::string_view event) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = topics.find(topic);
+	if(it == topics.end())
+		it = topics.emplace(std::string(topic), Topic()).first;
+	auto &t = it->second;
+
+	// ids and the order of pending go together, so the loop sends in id order
+	auto id = ++last_id;
+	auto frame = std::make_shared<const std::string>(encode_event(id, data, event));
+	t.history.push_back({ id, frame });
+	if(t.history.size() > history_size)
+		t.history.pop_front();
+	t.last_event = std::chrono::steady_clock::now();
+
+	pending.emplace_back(&t, std::move(frame));
+	if(loop && !posted) {
+		posted = true;
+		loop->post([this] { deliver(); });
+	}
+	return id;
+}
+
+void EventHub::attach(EventLoop &loop) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(this->loop)
+			return;
+		this->loop = &loop;
+		// what came before had no one to go to
+		pending.clear();
+		delivered = last_id;
+		posted = false;
+	}
+	loop.schedule(heartbeat, heartbeat_ms, [this] { tick(); });
+}
+
+void EventHub::detach() {
+	if(!loop)
+		return;
+	loop->cancel(heartbeat);
+	while(!everyone.empty())
+		drop(everyone.back());
+
+	std::lock_guard<std::mutex> lock(mutex);
+	loop = nullptr;
+	pending.clear();
+	delivered = last_id;
+}
+
+void EventHub::subscribe(ConnectionPtr c, std::string_view topic, const std::string &last_event_id) {
+	std::vector<Frame> replay;
+	Topic *t;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// detached by a drain while the head was sent
+		if(!loop)
+			return;
+		auto it = topics.find(topic);
+		if(it == topics.end())
+			it = topics.emplace(std::string(topic), Topic()).first;
+		t = &it->second;
+
+		// what is still pending goes out with the next delivery anyway
+		char *end;
+		auto last = strtoull(last_event_id.c_str(), &end, 10);
+		if(!last_event_id.empty() && *end == '\0') {
+			for(auto &event : t->history) {
+				if(event.id > last && event.id <= delivered)
+					replay.push_back(event.frame);
+			}
+		}
+	}
+
+	int fd = c->fd;
+	auto *s = new Subscriber { std::move(c), fd, t, t->subscribers.size(), everyone.size(), {}, 0, 0, false };
+	t->subscribers.push_back(s);
+	everyone.push_back(s);
+
+	// clients send nothing, a read only finds the end of the connection
+	loop->watch(fd, IO_READ, [this, s](uint32_t events) { on_readable(s); });
+	if(!replay.empty())
+		send(s, replay.data(), replay.size());
+}
+
+void EventHub::deliver() {
+	std::vector<std::pair<Topic *, Frame>> batch;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!loop)
+			return;
+		batch.swap(pending);
+		posted = false;
+		delivered = last_id;
+	}
+
+	// each topic's events together, in the order they were published
+	std::stable_sort(batch.begin(), batch.end(), [](auto &a, auto &b) {
+		return std::less<Topic *>()(a.first, b.first);
+	});
+	std::vector<Frame> frames;
+	for(size_t i = 0; i < batch.size(); ) {
+		auto *t = batch[i].first;
+		frames.clear();
+		for(; i < batch.size() && batch[i].first == t; i++)
+			frames.push_back(std::move(batch[i].second));
+
+		// from the back, a dropped subscriber's place is taken by one already done
+		for(size_t k = t->subscribers.size(); k-- > 0; )
+			send(t->subscribers[k], frames.data(), frames.size());
+	}
+}
+
+bool EventHub::send(Subscriber *s, const Frame *frames, size_t count) {
+	// behind already: the frames wait their turn, sharing the buffers
+	if(!s->queue.empty()) {
+		for(size_t i = 0; i < count; i++) {
+			s->backlog += frames[i]->size();
+			s->queue.push_back(frames[i]);
+		}
+		if(s->backlog > max_backlog) {
+			wlog("event subscriber % is % bytes behind, dropping it\n", s->fd, s->backlog);
+			drop(s);
+			return false;
+		}
+		return true;
+	}
+
+	size_t offset = 0;
+	auto n = write_frames(s->fd, frames, count, offset);
+	if(n < 0) {
+		drop(s);
+		return false;
+	}
+	if(n > 0)
+		s->wrote = true;
+	if(count == 0)
+		return true;
+
+	s->sent = offset;
+	for(size_t i = 0; i < count; i++) {
+		s->backlog += frames[i]->size() - (i == 0 ? offset : 0);
+		s->queue.push_back(frames[i]);
+	}
+	if(s->backlog > max_backlog) {
+		wlog("event subscriber % is % bytes behind, dropping it\n", s->fd, s->backlog);
+		drop(s);
+		return false;
+	}
+	loop->watch(s->fd, IO_WRITE, [this, s](uint32_t events) { flush(s); });
+	return true;
+}
+
+void EventHub::flush(Subscriber *s) {
+	const Frame *frames = s->queue.data();
+	size_t count = s->queue.size();
+	auto n = write_frames(s->fd, frames, count, s->sent);
+	if(n < 0) {
+		drop(s);
+		return;
+	}
+	if(n > 0)
+		s->wrote = true;
+	s->backlog -= n;
+	s->queue.erase(s->queue.begin(), s->queue.end() - count);
+	if(s->queue.empty())
+		std::vector<Frame>().swap(s->queue);
+	else
+		loop->watch(s->fd, IO_WRITE, [this, s](uint32_t events) { flush(s); });
+}
+
+void EventHub::on_readable(Subscriber *s) {
+	char buf[512];
+	while(1) {
+		auto n = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if(n > 0)
+			continue;
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		drop(s);
+		return;
+	}
+	loop->watch(s->fd, IO_READ, [this, s](uint32_t events) { on_readable(s); });
+}
+
+void EventHub::tick() {
+	// a comment line, which keeps proxies from timing the stream out
+	static const Frame comment = std::make_shared<const std::string>(":\n\n");
+
+	for(size_t i = everyone.size(); i-- > 0; ) {
+		auto *s = everyone[i];
+		bool wrote = s->wrote;
+		s->wrote = false;
+		if(!s->queue.empty()) {
+			// not a byte taken in a whole heartbeat
+			if(!wrote)
+				drop(s);
+			continue;
+		}
+		if(!wrote && send(s, &comment, 1))
+			s->wrote = false;
+	}
+	sweep();
+	loop->schedule(heartbeat, heartbeat_ms, [this] { tick(); });
+}
+
+void EventHub::sweep() {
+	auto expired = std::chrono::steady_clock::now() - history_ttl;
+	std::lock_guard<std::mutex> lock(mutex);
+	for(auto it = topics.begin(); it != topics.end(); ) {
+		auto &t = it->second;
+		// pending holds pointers to topics with events past delivered
+		bool idle = t.subscribers.empty() && (t.history.empty()
+			|| (t.history.back().id <= delivered && t.last_event <= expired));
+		if(idle)
+			it = topics.erase(it);
+		else
+			++it;
+	}
+}
+
+void EventHub::drop(Subscriber *s) {
+	loop->unwatch(s->fd);
+
+	auto &list = s->topic->subscribers;
+	list[s->index] = list.back();
+	list[s->index]->index = s->index;
+	list.pop_back();
+	everyone[s->slot] = everyone.back();
+	everyone[s->slot]->slot = s->slot;
+	everyone.pop_back();
+
+	// the socket closes with the last owner of the connection
+	delete s;
+}
+
+
+EventStreamRoute::EventStreamRoute(const std::string &key, std::shared_ptr<EventHub> hub) :
+	pattern(key),
+	hub(std::move(hub))
+{
+}
+
+bool EventStreamRoute::match(std::string_view path, std::string &topic) const {
+	std::match_results<std::string_view::const_iterator> m;
+	if(!std::regex_match(path.begin(), path.end(), m, pattern))
+		return false;
+	topic = m.size() > 1 ? m.str(1) : std::string(path);
+	return true;
+}
@@ -0,0 +1,117 @@
+#ifndef EVENTSTREAM_H
+#define EVENTSTREAM_H
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server.h"
+#include "timerwheel.h"
+
+
+/* Topics of server-sent events (text/event-stream), each with its
+ * subscribers. An event is published once, from any thread, and encoded
+ * once into a shared buffer; the loop writes that same buffer to every
+ * subscriber of its topic, together with whatever else arrived since its
+ * last turn.
+ *
+ * A subscriber belongs to the event loop like an idle keep-alive
+ * connection and holds nothing but its socket while it keeps up. One that
+ * falls max_backlog behind, or whose socket makes no progress for a whole
+ * heartbeat, is dropped; it can come back with Last-Event-ID and is
+ * replayed what it missed, as far as the topic's history reaches.
+ *
+ * A topic without subscribers is forgotten, history and all, once its
+ * last event is history_ttl_ms old, so names nobody uses do not pile up.
+ */
+class EventHub {
+public:
+	using Frame = std::shared_ptr<const std::string>;
+
+private:
+	struct Event {
+		uint64_t id;
+		Frame frame;
+	};
+	struct Subscriber;
+	struct Topic {
+		std::deque<Event> history;               // guarded by mutex, oldest first
+		std::chrono::steady_clock::time_point last_event;  // guarded by mutex
+		std::vector<Subscriber *> subscribers;   // loop thread only
+	};
+
+	size_t history_size;      // events kept per topic for replay
+	int heartbeat_ms;
+	size_t max_backlog;       // unsent bytes a subscriber may have queued
+	std::chrono::milliseconds history_ttl;
+
+	std::mutex mutex;
+	// topics last as long as the hub, subscribers point into them
+	std::map<std::string, Topic, std::less<>> topics;
+	std::vector<std::pair<Topic *, Frame>> pending;  // published, not yet handed to the loop
+	bool posted;              // a deliver() is on its way
+	uint64_t last_id;
+	uint64_t delivered;       // events up to this one reached the subscribers
+	EventLoop *loop;          // while the server runs
+
+	// loop thread only
+	std::vector<Subscriber *> everyone;
+	TimerNode heartbeat;
+
+	// loop thread: write the events published since the last turn
+	void deliver();
+	// false if s was dropped
+	bool send(Subscriber *s, const Frame *frames, size_t count);
+	void flush(Subscriber *s);
+	void on_readable(Subscriber *s);
+	// comment lines to quiet subscribers, and drop the stuck ones
+	void tick();
+	// forget the topics nobody subscribes to and nobody published to lately
+	void sweep();
+	void drop(Subscriber *s);
+
+public:
+	EventHub(size_t history_size = 256, int heartbeat_ms = 15 * 1000, size_t max_backlog = 256 * 1024,
+			int history_ttl_ms = 5 * 60 * 1000);
+	~EventHub();
+
+	EventHub(const EventHub &) = delete;
+	EventHub& operator= (const EventHub &) = delete;
+
+	/* any thread; data may span lines, event names its type (empty: the
+	 * default "message"). The id it is sent with.
+	 */
+	uint64_t publish(std::string_view topic, std::string_view data, std::string_view event = {});
+
+	// the server's loop, from the start of run() to detach()
+	void attach(EventLoop &loop);
+	// loop thread: close every subscriber, later publishes are only kept for replay
+	void detach();
+
+	/* loop thread: c, whose response head is sent, receives topic from now
+	 * on; with a Last-Event-ID, first whatever came after last_event_id
+	 */
+	void subscribe(ConnectionPtr c, std::string_view topic, const std::string &last_event_id);
+
+	// loop thread
+	size_t subscribers() const { return everyone.size(); }
+};
+
+struct EventStreamRoute {
+	// the first capture group names the topic, or else the whole path
+	std::regex pattern;
+	std::shared_ptr<EventHub> hub;
+
+	EventStreamRoute(const std::string &key, std::shared_ptr<EventHub> hub);
+	bool match(std::string_view path, std::string &topic) const;
+};
+
+
+#endif
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "form.h"
+
+
+static inline int hex_value(char ch) {
+	if(ch >= '0' && ch <= '9') return ch - '0';
+	if(ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+	if(ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+	return -1;
+}
+
+// index of the first byte that needs decoding, n if there is none
+static inline size_t find_escape(const char *src, size_t i, size_t n, bool plus_as_space) {
+#ifdef __SSE2__
+	// 16 bytes per step, most of a typical value is plain text
+	const __m128i percent = _mm_set1_epi8('%');
+	const __m128i plus = _mm_set1_epi8(plus_as_space ? '+' : '%');
+	for(; i + 16 <= n; i += 16) {
+		__m128i block = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i hits = _mm_or_si128(_mm_cmpeq_epi8(block, percent), _mm_cmpeq_epi8(block, plus));
+		int mask = _mm_movemask_epi8(hits);
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for(; i < n; i++) {
+		if(src[i] == '%' || (plus_as_space && src[i] == '+'))
+			return i;
+	}
+	return n;
+}
+
+size_t percent_decode(const char *src, size_t n, char *dst, bool plus_as_space) {
+	size_t i = 0, o = 0;
+	while(i < n) {
+		auto next = find_escape(src, i, n, plus_as_space);
+		if(next > i) {
+			if(dst + o != src + i)
+				std::memmove(dst + o, src + i, next - i);
+			o += next - i;
+			i = next;
+		}
+		if(i == n) break;
+
+		if(src[i] == '+') {
+			dst[o++] = ' ';
+			i++;
+			continue;
+		}
+
+		// a malformed escape is kept as it is
+		int hi = i + 2 < n ? hex_value(src[i + 1]) : -1;
+		int lo = i + 2 < n ? hex_value(src[i + 2]) : -1;
+		if(hi < 0 || lo < 0) {
+			dst[o++] = src[i++];
+			continue;
+		}
+
+		dst[o++] = (char)(hi << 4 | lo);
+		i += 3;
+	}
+	return o;
+}
+
+std::string percent_decode(StringRef s, bool plus_as_space) {
+	std::string out(s.begin(), s.end());
+	out.resize(percent_decode(out.data(), out.size(), &out[0], plus_as_space));
+	return out;
+}
+
+
+void FormData::parse(StringRef encoded) {
+	auto *p = encoded.begin();
+	auto *end = encoded.end();
+
+	// one allocation for the whole form
+	pairs.reserve(pairs.size() + std::count(p, end, '&') + 1);
+
+	while(p < end) {
+		auto *amp = (const char *)std::memchr(p, '&', end - p);
+		if(!amp) amp = end;
+
+		if(amp > p) {
+			auto *eq = (const char *)std::memchr(p, '=', amp - p);
+			auto *key_end = eq ? eq : amp;
+			auto *value_begin = eq ? eq + 1 : amp;
+
+			pairs.emplace_back();
+			auto &kv = pairs.back();
+			kv.first.assign(p, key_end);
+			kv.first.resize(percent_decode(kv.first.data(), kv.first.size(), &kv.first[0], true));
+			kv.second.assign(value_begin, amp);
+			kv.second.resize(percent_decode(kv.second.data(), kv.second.size(), &kv.second[0], true));
+		}
+
+		p = amp + 1;
+	}
+}
+
+const std::pmr::string *FormData::find(std::string_view key) const {
+	for(auto &kv : pairs) {
+		if(kv.first == key)
+			return &kv.second;
+	}
+	return nullptr;
+}
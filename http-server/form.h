@@ -0,0 +1,50 @@
+#ifndef FORM_H
+#define FORM_H
+
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "StringRef.h"
+
+
+/* decode %XX escapes from src into dst, returns the decoded length.
+ * dst may alias src (decoding only shrinks). With plus_as_space, '+'
+ * becomes ' ' as application/x-www-form-urlencoded requires.
+ */
+size_t percent_decode(const char *src, size_t n, char *dst, bool plus_as_space);
+std::string percent_decode(StringRef s, bool plus_as_space = false);
+
+
+/* Decoded key/value pairs of a query string or form body, kept in arrival
+ * order in one flat vector. Forms are small, so a linear lookup over
+ * short (SSO) strings beats a node per pair. The pairs live in the given
+ * memory resource, the request arena for request forms.
+ */
+class FormData {
+	using pair_t = std::pair<std::pmr::string, std::pmr::string>;
+	std::pmr::vector<pair_t> pairs;
+public:
+	using const_iterator = std::pmr::vector<pair_t>::const_iterator;
+
+	explicit FormData(std::pmr::memory_resource *memory = std::pmr::get_default_resource()) :
+		pairs(memory)
+	{
+	}
+
+	// append the pairs of "k1=v1&k2=v2..."
+	void parse(StringRef encoded);
+
+	// value of the first pair named key, nullptr if absent
+	const std::pmr::string *find(std::string_view key) const;
+
+	const_iterator begin() const { return pairs.begin(); }
+	const_iterator end() const { return pairs.end(); }
+	size_t size() const { return pairs.size(); }
+	bool empty() const { return pairs.empty(); }
+};
+
+
+#endif
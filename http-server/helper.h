@@ -5,7 +5,9 @@
 #include <utility>
 
 
-inline void strip(std::string &s) {
+// any std::basic_string, whatever its allocator
+template<class String>
+inline void strip(String &s) {
 	s.erase(0, s.find_first_not_of(" \t\r\n"));
 	s.erase(s.find_last_not_of(" \t\r\n") + 1);
 }
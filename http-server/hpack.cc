@@ -0,0 +1,523 @@
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+#include "hpack.h"
+#include "perfect_hash.h"
+
+
+namespace hpack {
+
+/* static table */
+
+struct StaticField {
+	std::string_view name;
+	std::string_view value;
+};
+
+// RFC 7541 appendix A; index 1 is the first
+static constexpr StaticField static_table[] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+static constexpr size_t static_count = sizeof(static_table) / sizeof(static_table[0]);
+
+// first index of each name, entries with the same name follow it
+static constexpr auto static_names = make_perfect_map<uint8_t>({
+	{ ":authority", 1 },
+	{ ":method", 2 },
+	{ ":path", 4 },
+	{ ":scheme", 6 },
+	{ ":status", 8 },
+	{ "accept-charset", 15 },
+	{ "accept-encoding", 16 },
+	{ "accept-language", 17 },
+	{ "accept-ranges", 18 },
+	{ "accept", 19 },
+	{ "access-control-allow-origin", 20 },
+	{ "age", 21 },
+	{ "allow", 22 },
+	{ "authorization", 23 },
+	{ "cache-control", 24 },
+	{ "content-disposition", 25 },
+	{ "content-encoding", 26 },
+	{ "content-language", 27 },
+	{ "content-length", 28 },
+	{ "content-location", 29 },
+	{ "content-range", 30 },
+	{ "content-type", 31 },
+	{ "cookie", 32 },
+	{ "date", 33 },
+	{ "etag", 34 },
+	{ "expect", 35 },
+	{ "expires", 36 },
+	{ "from", 37 },
+	{ "host", 38 },
+	{ "if-match", 39 },
+	{ "if-modified-since", 40 },
+	{ "if-none-match", 41 },
+	{ "if-range", 42 },
+	{ "if-unmodified-since", 43 },
+	{ "last-modified", 44 },
+	{ "link", 45 },
+	{ "location", 46 },
+	{ "max-forwards", 47 },
+	{ "proxy-authenticate", 48 },
+	{ "proxy-authorization", 49 },
+	{ "range", 50 },
+	{ "referer", 51 },
+	{ "refresh", 52 },
+	{ "retry-after", 53 },
+	{ "server", 54 },
+	{ "set-cookie", 55 },
+	{ "strict-transport-security", 56 },
+	{ "transfer-encoding", 57 },
+	{ "user-agent", 58 },
+	{ "vary", 59 },
+	{ "via", 60 },
+	{ "www-authenticate", 61 },
+});
+
+// index of name with value, or else of name alone with exact false; 0 if neither
+static size_t static_find(std::string_view name, std::string_view value, bool &exact) {
+	exact = false;
+	auto *first = static_names.find(name);
+	if(!first)
+		return 0;
+	for(size_t i = *first; i <= static_count && static_table[i - 1].name == name; i++) {
+		if(static_table[i - 1].value == value) {
+			exact = true;
+			return i;
+		}
+	}
+	return *first;
+}
+
+/* Huffman code */
+
+// code length of each symbol, 256 is EOS; the code is canonical, so the
+// codes themselves follow from the lengths
+static constexpr uint8_t code_lengths[257] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+	30,
+};
+
+static constexpr int max_code_length = 30;
+
+struct HuffmanTables {
+	uint32_t codes[257];
+	uint16_t counts[max_code_length + 1];   // codes of each length
+	uint16_t symbols[257];                  // by code, shorter first
+};
+
+static constexpr HuffmanTables huffman = [] {
+	HuffmanTables t {};
+	size_t n = 0;
+	uint32_t code = 0;
+	for(int length = 1; length <= max_code_length; length++) {
+		for(int symbol = 0; symbol < 257; symbol++) {
+			if(code_lengths[symbol] != length)
+				continue;
+			t.codes[symbol] = code++;
+			t.counts[length]++;
+			t.symbols[n++] = symbol;
+		}
+		code <<= 1;
+	}
+	return t;
+}();
+
+size_t huffman_length(std::string_view s) {
+	size_t bits = 0;
+	for(unsigned char c : s)
+		bits += code_lengths[c];
+	return (bits + 7) / 8;
+}
+
+void huffman_encode(std::string_view s, std::string &out) {
+	uint64_t buffer = 0;
+	int bits = 0;
+	for(unsigned char c : s) {
+		buffer = buffer << code_lengths[c] | huffman.codes[c];
+		bits += code_lengths[c];
+		while(bits >= 8) {
+			bits -= 8;
+			out.push_back(char(buffer >> bits));
+		}
+	}
+	// padded with the most significant bits of EOS, all ones
+	if(bits > 0)
+		out.push_back(char(buffer << (8 - bits) | (0xff >> bits)));
+}
+
+bool huffman_decode(std::string_view s, std::string &out) {
+	// canonical decoding one bit at a time: at each length the codes of
+	// that length are the range first..first+count
+	uint32_t code = 0, first = 0, index = 0;
+	int length = 0;
+	bool ones = true;   // the bits since the last symbol could be padding
+	for(unsigned char c : s) {
+		for(int bit = 7; bit >= 0; bit--) {
+			uint32_t b = (c >> bit) & 1;
+			code |= b;
+			ones &= b;
+			length++;
+			uint32_t count = huffman.counts[length];
+			if(code - first < count) {
+				auto symbol = huffman.symbols[index + code - first];
+				if(symbol == 256)
+					return false;
+				out.push_back(char(symbol));
+				code = first = index = 0;
+				length = 0;
+				ones = true;
+				continue;
+			}
+			if(length == max_code_length)
+				return false;
+			index += count;
+			first = (first + count) << 1;
+			code <<= 1;
+		}
+	}
+	return length <= 7 && ones;
+}
+
+/* primitives */
+
+static void encode_integer(uint8_t flags, int prefix, size_t value, std::string &out) {
+	size_t limit = (1u << prefix) - 1;
+	if(value < limit) {
+		out.push_back(char(flags | value));
+		return;
+	}
+	out.push_back(char(flags | limit));
+	value -= limit;
+	while(value >= 128) {
+		out.push_back(char(value % 128 + 128));
+		value /= 128;
+	}
+	out.push_back(char(value));
+}
+
+static void encode_string(std::string_view s, std::string &out) {
+	auto length = huffman_length(s);
+	if(length < s.size()) {
+		encode_integer(0x80, 7, length, out);
+		huffman_encode(s, out);
+	} else {
+		encode_integer(0, 7, s.size(), out);
+		out.append(s);
+	}
+}
+
+// false if the block ends first or the value is absurd
+static bool decode_integer(std::string_view block, size_t &pos, int prefix, size_t &value) {
+	if(pos >= block.size())
+		return false;
+	size_t limit = (1u << prefix) - 1;
+	value = (unsigned char)block[pos++] & limit;
+	if(value < limit)
+		return true;
+
+	// nothing in a header block needs more than 28 bits
+	for(int shift = 0; shift <= 21; shift += 7) {
+		if(pos >= block.size())
+			return false;
+		unsigned char b = block[pos++];
+		value += size_t(b & 127) << shift;
+		if(!(b & 128))
+			return true;
+	}
+	return false;
+}
+
+static bool decode_string(std::string_view block, size_t &pos, std::string &out) {
+	if(pos >= block.size())
+		return false;
+	bool huffman_coded = block[pos] & 0x80;
+	size_t length;
+	if(!decode_integer(block, pos, 7, length) || length > block.size() - pos)
+		return false;
+	auto data = block.substr(pos, length);
+	pos += length;
+
+	out.clear();
+	if(!huffman_coded) {
+		out.assign(data);
+		return true;
+	}
+	out.reserve(length * 8 / 5);
+	return huffman_decode(data, out);
+}
+
+/* dynamic table */
+
+Table::Table(size_t capacity) :
+	fields(),
+	_size(0),
+	_capacity(capacity)
+{
+}
+
+void Table::evict(size_t limit) {
+	while(_size > limit) {
+		_size -= fields.back().size();
+		fields.pop_back();
+	}
+}
+
+void Table::add(std::string_view name, std::string_view value) {
+	auto size = name.size() + value.size() + 32;
+	if(size > _capacity) {
+		evict(0);
+		return;
+	}
+	evict(_capacity - size);
+	fields.push_front(Field{std::string(name), std::string(value)});
+	_size += size;
+}
+
+void Table::set_capacity(size_t capacity) {
+	_capacity = capacity;
+	evict(capacity);
+}
+
+const Field *Table::get(size_t index) const {
+	if(index == 0 || index > fields.size())
+		return nullptr;
+	return &fields[index - 1];
+}
+
+size_t Table::find(std::string_view name, std::string_view value, bool &exact) const {
+	exact = false;
+	size_t found = 0;
+	for(size_t i = 0; i < fields.size(); i++) {
+		if(fields[i].name != name)
+			continue;
+		if(fields[i].value == value) {
+			exact = true;
+			return i + 1;
+		}
+		if(!found)
+			found = i + 1;
+	}
+	return found;
+}
+
+/* decoder */
+
+Decoder::Decoder(size_t max_capacity) :
+	table(max_capacity),
+	max_capacity(max_capacity)
+{
+}
+
+bool Decoder::decode(std::string_view block, std::vector<Field> &fields, size_t max_list_size, bool &oversized) {
+	fields.clear();
+	oversized = false;
+	size_t list_size = 0;
+	bool started = false;
+	Field field;
+
+	// the name at index, from the static table or ours
+	auto lookup = [&](size_t index, bool with_value) {
+		if(index >= 1 && index <= static_count) {
+			field.name.assign(static_table[index - 1].name);
+			if(with_value)
+				field.value.assign(static_table[index - 1].value);
+			return true;
+		}
+		auto *entry = table.get(index - static_count);
+		if(!entry)
+			return false;
+		field.name = entry->name;
+		if(with_value)
+			field.value = entry->value;
+		return true;
+	};
+
+	size_t pos = 0;
+	while(pos < block.size()) {
+		unsigned char b = block[pos];
+		size_t index;
+		if(b & 0x80) {
+			// indexed field
+			if(!decode_integer(block, pos, 7, index) || !lookup(index, true))
+				return false;
+		} else if((b & 0xe0) == 0x20) {
+			// table size update, only ahead of the fields
+			if(started || !decode_integer(block, pos, 5, index) || index > max_capacity)
+				return false;
+			table.set_capacity(index);
+			continue;
+		} else {
+			// literal, added to the table (01), or not (0000, 0001 never)
+			bool indexing = (b & 0xc0) == 0x40;
+			if(!decode_integer(block, pos, indexing ? 6 : 4, index))
+				return false;
+			if(index ? !lookup(index, false) : !decode_string(block, pos, field.name))
+				return false;
+			if(!decode_string(block, pos, field.value))
+				return false;
+			if(indexing)
+				table.add(field.name, field.value);
+		}
+		started = true;
+
+		list_size += field.size();
+		if(list_size > max_list_size)
+			oversized = true;
+		if(!oversized)
+			fields.push_back(field);
+	}
+
+	if(oversized)
+		fields.clear();
+	return true;
+}
+
+/* encoder */
+
+// credentials stay out of the tables of every hop, which a guessing
+// attacker could probe by compressed size
+static bool sensitive(std::string_view name) {
+	return name == "authorization" || name == "proxy-authorization" || name == "set-cookie";
+}
+
+// values that change with every response would only push out ones that repeat
+static bool volatile_value(std::string_view name) {
+	return name == "content-length" || name == "content-range" || name == "etag"
+		|| name == "last-modified" || name == "location" || name == ":path";
+}
+
+Encoder::Encoder() :
+	table(),
+	smallest(0),
+	pending(false)
+{
+}
+
+void Encoder::set_max_capacity(size_t size) {
+	size = std::min<size_t>(size, 4096);
+	if(size == table.capacity())
+		return;
+	smallest = pending ? std::min(smallest, size) : size;
+	pending = true;
+	table.set_capacity(size);
+}
+
+void Encoder::start_block(std::string &out) {
+	if(!pending)
+		return;
+	if(smallest < table.capacity())
+		encode_integer(0x20, 5, smallest, out);
+	encode_integer(0x20, 5, table.capacity(), out);
+	pending = false;
+}
+
+void Encoder::encode(std::string_view name, std::string_view value, std::string &out) {
+	// the static table first, it costs nothing to keep
+	bool exact;
+	size_t name_index = static_find(name, value, exact);
+	if(exact) {
+		encode_integer(0x80, 7, name_index, out);
+		return;
+	}
+
+	size_t index = table.find(name, value, exact);
+	if(exact) {
+		encode_integer(0x80, 7, static_count + index, out);
+		return;
+	}
+	if(!name_index && index)
+		name_index = static_count + index;
+
+	if(sensitive(name)) {
+		encode_integer(0x10, 4, name_index, out);
+	} else if(volatile_value(name)) {
+		encode_integer(0, 4, name_index, out);
+	} else {
+		encode_integer(0x40, 6, name_index, out);
+		table.add(name, value);
+	}
+	if(!name_index)
+		encode_string(name, out);
+	encode_string(value, out);
+}
+
+}
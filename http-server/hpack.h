@@ -0,0 +1,96 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+/* HPACK (RFC 7541), the header compression of HTTP/2. Each direction of a
+ * connection has a table of recently sent fields on both ends, which the
+ * encoder and the decoder keep in step by applying the same insertions and
+ * evictions in the same order, so a connection needs one Encoder for its
+ * responses and one Decoder for its requests, each used by one thread at
+ * a time.
+ */
+namespace hpack {
+
+struct Field {
+	std::string name;
+	std::string value;
+
+	// what the field counts for against a table or a header list limit
+	size_t size() const { return name.size() + value.size() + 32; }
+};
+
+// fields added by one side and referenced by the other, newest first
+class Table {
+	std::deque<Field> fields;
+	size_t _size;
+	size_t _capacity;
+
+	void evict(size_t limit);
+
+public:
+	Table(size_t capacity = 4096);
+
+	// a field larger than the whole table empties it and is not kept
+	void add(std::string_view name, std::string_view value);
+	void set_capacity(size_t capacity);
+
+	// 1 for the newest field
+	const Field *get(size_t index) const;
+	// index of name with value, or else of name alone with exact false; 0 if neither
+	size_t find(std::string_view name, std::string_view value, bool &exact) const;
+
+	size_t size() const { return _size; }
+	size_t capacity() const { return _capacity; }
+	size_t count() const { return fields.size(); }
+};
+
+class Decoder {
+	Table table;
+	// the most a size update from the encoder may ask for, our SETTINGS_HEADER_TABLE_SIZE
+	size_t max_capacity;
+
+public:
+	Decoder(size_t max_capacity = 4096);
+
+	/* Decode one complete header block into fields, in order. false is a
+	 * compression error, after which the tables are out of step and the
+	 * connection has to end. A header list over max_list_size is still
+	 * decoded to the end, to keep the table, but comes back empty with
+	 * oversized set.
+	 */
+	bool decode(std::string_view block, std::vector<Field> &fields, size_t max_list_size, bool &oversized);
+};
+
+class Encoder {
+	Table table;
+	// size updates to send at the start of the next block: the smallest
+	// capacity since the last one, so the decoder evicts as we did, then ours
+	size_t smallest;
+	bool pending;
+
+public:
+	Encoder();
+
+	// the peer's SETTINGS_HEADER_TABLE_SIZE; more than the default 4096 is not used
+	void set_max_capacity(size_t size);
+
+	// begin a header block, then encode each field of it; name must be lowercase
+	void start_block(std::string &out);
+	void encode(std::string_view name, std::string_view value, std::string &out);
+};
+
+// the Huffman code of the spec, for what is not compressed by the tables
+size_t huffman_length(std::string_view s);
+void huffman_encode(std::string_view s, std::string &out);
+// false on bad padding or an EOS symbol in the data
+bool huffman_decode(std::string_view s, std::string &out);
+
+}
+
+
+#endif
@@ -0,0 +1,1038 @@
+#include <sys/socket.h>
+#include <string.h>
+
+#include <algorithm>
+#include <istream>
+#include <optional>
+#include <streambuf>
+
+#include "async.h"
+#include "debug.h"
+#include "http2.h"
+
+
+enum FrameType : uint8_t {
+	FRAME_DATA            = 0x0,
+	FRAME_HEADERS         = 0x1,
+	FRAME_PRIORITY        = 0x2,
+	FRAME_RST_STREAM      = 0x3,
+	FRAME_SETTINGS        = 0x4,
+	FRAME_PUSH_PROMISE    = 0x5,
+	FRAME_PING            = 0x6,
+	FRAME_GOAWAY          = 0x7,
+	FRAME_WINDOW_UPDATE   = 0x8,
+	FRAME_CONTINUATION    = 0x9,
+	FRAME_PRIORITY_UPDATE = 0x10,   // RFC 9218
+};
+
+enum FrameFlags : uint8_t {
+	FLAG_END_STREAM  = 0x1,
+	FLAG_ACK         = 0x1,
+	FLAG_END_HEADERS = 0x4,
+	FLAG_PADDED      = 0x8,
+	FLAG_PRIORITY    = 0x20,
+};
+
+enum ErrorCode : uint32_t {
+	H2_NO_ERROR           = 0x0,
+	H2_PROTOCOL_ERROR     = 0x1,
+	H2_INTERNAL_ERROR     = 0x2,
+	H2_FLOW_CONTROL_ERROR = 0x3,
+	H2_STREAM_CLOSED      = 0x5,
+	H2_FRAME_SIZE_ERROR   = 0x6,
+	H2_REFUSED_STREAM     = 0x7,
+	H2_CANCEL             = 0x8,
+	H2_COMPRESSION_ERROR  = 0x9,
+	H2_ENHANCE_YOUR_CALM  = 0xb,
+};
+
+enum Setting : uint16_t {
+	SETTINGS_HEADER_TABLE_SIZE      = 0x1,
+	SETTINGS_ENABLE_PUSH            = 0x2,
+	SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	SETTINGS_INITIAL_WINDOW_SIZE    = 0x4,
+	SETTINGS_MAX_FRAME_SIZE         = 0x5,
+	SETTINGS_MAX_HEADER_LIST_SIZE   = 0x6,
+};
+
+static constexpr size_t frame_header_size = 9;
+// SETTINGS_MAX_FRAME_SIZE and the windows as the protocol starts them
+static constexpr size_t default_frame_size = 16384;
+static constexpr int64_t default_window = 65535;
+static constexpr int64_t max_window = 0x7fffffff;
+// requests open at once, SETTINGS_MAX_CONCURRENT_STREAMS
+static constexpr size_t max_streams = 100;
+// what one run of the writer sends with one write
+static constexpr size_t write_batch = 64 * 1024;
+
+static uint32_t get32(const char *p) {
+	auto *u = (const unsigned char *)p;
+	return uint32_t(u[0]) << 24 | uint32_t(u[1]) << 16 | uint32_t(u[2]) << 8 | u[3];
+}
+
+static void put32(std::string &out, uint32_t value) {
+	out.push_back(char(value >> 24));
+	out.push_back(char(value >> 16));
+	out.push_back(char(value >> 8));
+	out.push_back(char(value));
+}
+
+static void put_frame_header(char *p, size_t length, uint8_t type, uint8_t flags, uint32_t stream) {
+	p[0] = char(length >> 16);
+	p[1] = char(length >> 8);
+	p[2] = char(length);
+	p[3] = char(type);
+	p[4] = char(flags);
+	p[5] = char(stream >> 24);
+	p[6] = char(stream >> 16);
+	p[7] = char(stream >> 8);
+	p[8] = char(stream);
+}
+
+static void append_frame(std::string &out, uint8_t type, uint8_t flags, uint32_t stream, std::string_view payload) {
+	auto at = out.size();
+	out.resize(at + frame_header_size);
+	put_frame_header(&out[at], payload.size(), type, flags, stream);
+	out.append(payload);
+}
+
+// the synthesized request text, read by HTTPRequest in place
+class MemoryBuf : public std::streambuf {
+public:
+	MemoryBuf(std::string &s) {
+		setg(s.data(), s.data(), s.data() + s.size());
+	}
+};
+
+
+struct H2Connection::Stream {
+	uint32_t id;
+	bool end_received;     // the request is complete
+	bool handling;         // its handler runs
+	bool responded;        // the response (headers) is queued
+	bool body_done;        // END_STREAM is queued
+	bool reset;            // by either side, nothing more is sent
+	bool head;             // HEAD, the response has no body
+	int urgency;           // RFC 9218, 0 is the most urgent
+	bool incremental;
+	int64_t send_window;
+	int64_t recv_window;
+	size_t recv_unacked;
+	int64_t content_length;   // announced by the client, -1 if not
+
+	HTTPRequest *upgraded;    // the request came over HTTP/1
+	std::string text;         // the request as HTTP/1, its body from header_size
+	size_t header_size;
+	Arena arena;
+
+	std::optional<HTTPResponse> response;
+	std::string_view pending;   // body not sent yet, unless generated
+
+	Stream(uint32_t id, int64_t send_window) :
+		id(id),
+		end_received(false),
+		handling(false),
+		responded(false),
+		body_done(false),
+		reset(false),
+		head(false),
+		urgency(3),
+		incremental(false),
+		send_window(send_window),
+		recv_window(default_window),
+		recv_unacked(0),
+		content_length(-1),
+		upgraded(nullptr),
+		text(),
+		header_size(0),
+		arena(),
+		response(),
+		pending()
+	{
+	}
+
+	bool sending() const { return responded && !body_done && !reset; }
+};
+
+
+H2Connection::H2Connection(int fd, const HTTPLimits &limits, dispatch_t dispatch, deadline_t deadline) :
+	fd(fd),
+	limits(limits),
+	dispatch(std::move(dispatch)),
+	deadline(std::move(deadline)),
+	mutex(),
+	decoder(),
+	encoder(),
+	streams(),
+	last_stream(0),
+	last_sent(0),
+	handlers(0),
+	block(),
+	continued(0),
+	continued_flags(0),
+	initial_window(default_window),
+	max_frame(default_frame_size),
+	send_window(default_window),
+	recv_window(default_window),
+	recv_unacked(0),
+	control(),
+	writing(false),
+	broken(false),
+	closing(false),
+	finished(false),
+	waiter()
+{
+}
+
+H2Connection::~H2Connection() {
+}
+
+void H2Connection::frame(uint8_t type, uint8_t flags, uint32_t stream, std::string_view payload) {
+	append_frame(control, type, flags, stream, payload);
+}
+
+void H2Connection::reset(uint32_t stream, uint32_t code) {
+	std::string payload;
+	put32(payload, code);
+	frame(FRAME_RST_STREAM, 0, stream, payload);
+
+	auto it = streams.find(stream);
+	if(it != streams.end()) {
+		it->second->reset = true;
+		retire(*it->second);
+	}
+}
+
+void H2Connection::goaway(uint32_t code) {
+	std::string payload;
+	put32(payload, last_stream);
+	put32(payload, code);
+	frame(FRAME_GOAWAY, 0, 0, payload);
+	closing = true;
+	if(code != H2_NO_ERROR)
+		wlog("http2 connection % ends with error %\n", fd, code);
+}
+
+void H2Connection::go_away() {
+	std::lock_guard<std::mutex> lock(mutex);
+	if(closing || finished)
+		return;
+	goaway(H2_NO_ERROR);
+	wake_writer();
+}
+
+/* reading */
+
+uint32_t H2Connection::on_frame(uint8_t type, uint8_t flags, uint32_t stream, std::string_view payload) {
+	// a header block is not interrupted by anything
+	if(continued && type != FRAME_CONTINUATION)
+		return H2_PROTOCOL_ERROR;
+
+	switch(type) {
+	case FRAME_DATA:
+		return on_data(stream, flags, payload);
+
+	case FRAME_HEADERS:
+		return on_headers(stream, flags, payload);
+
+	case FRAME_CONTINUATION:
+		if(!continued || stream != continued)
+			return H2_PROTOCOL_ERROR;
+		// a block that keeps growing is not a header anybody needs
+		if(block.size() + payload.size() > 2 * limits.max_header_size + default_frame_size)
+			return H2_ENHANCE_YOUR_CALM;
+		block.append(payload);
+		if(flags & FLAG_END_HEADERS)
+			return on_header_block(stream, continued_flags);
+		return H2_NO_ERROR;
+
+	case FRAME_PRIORITY:
+		// the dependency tree of RFC 7540 is deprecated, and ignored
+		if(stream == 0)
+			return H2_PROTOCOL_ERROR;
+		if(payload.size() != 5)
+			reset(stream, H2_FRAME_SIZE_ERROR);
+		return H2_NO_ERROR;
+
+	case FRAME_RST_STREAM: {
+		if(stream == 0 || stream > last_stream)
+			return H2_PROTOCOL_ERROR;
+		if(payload.size() != 4)
+			return H2_FRAME_SIZE_ERROR;
+		auto it = streams.find(stream);
+		if(it != streams.end()) {
+			it->second->reset = true;
+			retire(*it->second);
+		}
+		return H2_NO_ERROR;
+	}
+
+	case FRAME_SETTINGS:
+		if(stream != 0)
+			return H2_PROTOCOL_ERROR;
+		if(flags & FLAG_ACK)
+			return payload.empty() ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+		return on_settings(payload, true);
+
+	case FRAME_PUSH_PROMISE:
+		// only servers push
+		return H2_PROTOCOL_ERROR;
+
+	case FRAME_PING:
+		if(stream != 0)
+			return H2_PROTOCOL_ERROR;
+		if(payload.size() != 8)
+			return H2_FRAME_SIZE_ERROR;
+		if(!(flags & FLAG_ACK))
+			frame(FRAME_PING, FLAG_ACK, 0, payload);
+		return H2_NO_ERROR;
+
+	case FRAME_GOAWAY:
+		if(stream != 0)
+			return H2_PROTOCOL_ERROR;
+		// the client leaves: no new streams, the open ones finish
+		closing = true;
+		check_done();
+		return H2_NO_ERROR;
+
+	case FRAME_WINDOW_UPDATE:
+		return on_window_update(stream, payload);
+
+	case FRAME_PRIORITY_UPDATE:
+		if(stream != 0)
+			return H2_PROTOCOL_ERROR;
+		return on_priority_update(payload);
+	}
+	// unknown types are ignored
+	return H2_NO_ERROR;
+}
+
+uint32_t H2Connection::on_headers(uint32_t stream, uint8_t flags, std::string_view payload) {
+	if(stream == 0)
+		return H2_PROTOCOL_ERROR;
+
+	if(flags & FLAG_PADDED) {
+		if(payload.empty() || (unsigned char)payload[0] >= payload.size())
+			return H2_PROTOCOL_ERROR;
+		payload = payload.substr(1, payload.size() - 1 - (unsigned char)payload[0]);
+	}
+	if(flags & FLAG_PRIORITY) {
+		if(payload.size() < 5)
+			return H2_FRAME_SIZE_ERROR;
+		if((get32(payload.data()) & 0x7fffffff) == stream)
+			return H2_PROTOCOL_ERROR;
+		payload.remove_prefix(5);
+	}
+
+	block.assign(payload);
+	continued = stream;
+	continued_flags = flags;
+	if(flags & FLAG_END_HEADERS)
+		return on_header_block(stream, flags);
+	return H2_NO_ERROR;
+}
+
+uint32_t H2Connection::on_header_block(uint32_t id, uint8_t flags) {
+	std::vector<hpack::Field> fields;
+	bool oversized;
+	bool decoded = decoder.decode(block, fields, limits.max_header_size, oversized);
+	block.clear();
+	continued = 0;
+	if(!decoded)
+		return H2_COMPRESSION_ERROR;
+
+	auto it = streams.find(id);
+	if(it != streams.end()) {
+		// trailers, which nothing here looks at
+		auto &s = *it->second;
+		if(s.end_received || !(flags & FLAG_END_STREAM))
+			return H2_PROTOCOL_ERROR;
+		end_of_request(s);
+		return H2_NO_ERROR;
+	}
+
+	if(id <= last_stream || id % 2 == 0)
+		return H2_PROTOCOL_ERROR;
+	last_stream = id;
+	// after GOAWAY new streams are ignored, the client retries them elsewhere
+	if(closing)
+		return H2_NO_ERROR;
+	if(streams.size() >= max_streams) {
+		reset(id, H2_REFUSED_STREAM);
+		return H2_NO_ERROR;
+	}
+
+	auto &s = *streams.emplace(id, std::make_unique<Stream>(id, initial_window)).first->second;
+	if(oversized) {
+		s.end_received = flags & FLAG_END_STREAM;
+		auto response = HTTPResponse("<html> 431 </html>").status(431);
+		respond(s, std::move(response));
+		return H2_NO_ERROR;
+	}
+	if(!request_text(s, fields)) {
+		reset(id, H2_PROTOCOL_ERROR);
+		return H2_NO_ERROR;
+	}
+	if(flags & FLAG_END_STREAM)
+		end_of_request(s);
+	return H2_NO_ERROR;
+}
+
+uint32_t H2Connection::on_data(uint32_t id, uint8_t flags, std::string_view payload) {
+	if(id == 0)
+		return H2_PROTOCOL_ERROR;
+
+	// padding included, all of the frame counts against the windows
+	int64_t length = payload.size();
+	if(length > recv_window)
+		return H2_FLOW_CONTROL_ERROR;
+	recv_window -= length;
+	recv_unacked += length;
+	// the body is kept whole anyway (up to max_body_size), so the
+	// connection window is given back as soon as half of it is used
+	if(int64_t(recv_unacked) >= default_window / 2) {
+		std::string increment;
+		put32(increment, recv_unacked);
+		frame(FRAME_WINDOW_UPDATE, 0, 0, increment);
+		recv_window += recv_unacked;
+		recv_unacked = 0;
+	}
+
+	if(flags & FLAG_PADDED) {
+		if(payload.empty() || (unsigned char)payload[0] >= payload.size())
+			return H2_PROTOCOL_ERROR;
+		payload = payload.substr(1, payload.size() - 1 - (unsigned char)payload[0]);
+	}
+
+	auto it = streams.find(id);
+	if(it == streams.end() || it->second->end_received) {
+		if(id > last_stream)
+			return H2_PROTOCOL_ERROR;
+		reset(id, H2_STREAM_CLOSED);
+		return H2_NO_ERROR;
+	}
+
+	auto &s = *it->second;
+	if(length > s.recv_window) {
+		reset(id, H2_FLOW_CONTROL_ERROR);
+		return H2_NO_ERROR;
+	}
+	s.recv_window -= length;
+
+	// once answered with 413 the rest of the body is dropped
+	if(!s.responded) {
+		if(s.text.size() + payload.size() > s.header_size + limits.max_body_size) {
+			auto response = HTTPResponse("<html> 413 </html>").status(413);
+			respond(s, std::move(response));
+		} else {
+			s.text.append(payload);
+		}
+	}
+
+	if(flags & FLAG_END_STREAM) {
+		end_of_request(s);
+		return H2_NO_ERROR;
+	}
+	s.recv_unacked += length;
+	if(int64_t(s.recv_unacked) >= default_window / 2) {
+		std::string increment;
+		put32(increment, s.recv_unacked);
+		frame(FRAME_WINDOW_UPDATE, 0, id, increment);
+		s.recv_window += s.recv_unacked;
+		s.recv_unacked = 0;
+	}
+	return H2_NO_ERROR;
+}
+
+uint32_t H2Connection::on_settings(std::string_view payload, bool ack) {
+	if(payload.size() % 6)
+		return H2_FRAME_SIZE_ERROR;
+
+	for(size_t i = 0; i < payload.size(); i += 6) {
+		auto *p = (const unsigned char *)payload.data() + i;
+		uint16_t id = p[0] << 8 | p[1];
+		uint32_t value = get32(payload.data() + i + 2);
+
+		switch(id) {
+		case SETTINGS_HEADER_TABLE_SIZE:
+			encoder.set_max_capacity(value);
+			break;
+		case SETTINGS_ENABLE_PUSH:
+			if(value > 1)
+				return H2_PROTOCOL_ERROR;
+			break;
+		case SETTINGS_INITIAL_WINDOW_SIZE: {
+			if(value > max_window)
+				return H2_FLOW_CONTROL_ERROR;
+			// applies to the windows of open streams as well
+			int64_t delta = int64_t(value) - initial_window;
+			for(auto &entry : streams) {
+				entry.second->send_window += delta;
+				if(entry.second->send_window > max_window)
+					return H2_FLOW_CONTROL_ERROR;
+			}
+			initial_window = value;
+			break;
+		}
+		case SETTINGS_MAX_FRAME_SIZE:
+			if(value < default_frame_size || value > 0xffffff)
+				return H2_PROTOCOL_ERROR;
+			max_frame = value;
+			break;
+		}
+	}
+
+	if(ack)
+		frame(FRAME_SETTINGS, FLAG_ACK, 0, {});
+	return H2_NO_ERROR;
+}
+
+uint32_t H2Connection::on_window_update(uint32_t stream, std::string_view payload) {
+	if(payload.size() != 4)
+		return H2_FRAME_SIZE_ERROR;
+	int64_t increment = get32(payload.data()) & 0x7fffffff;
+
+	if(stream == 0) {
+		if(increment == 0)
+			return H2_PROTOCOL_ERROR;
+		send_window += increment;
+		return send_window > max_window ? H2_FLOW_CONTROL_ERROR : H2_NO_ERROR;
+	}
+
+	auto it = streams.find(stream);
+	if(it == streams.end())
+		return stream > last_stream ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+	auto &s = *it->second;
+	if(increment == 0) {
+		reset(stream, H2_PROTOCOL_ERROR);
+		return H2_NO_ERROR;
+	}
+	s.send_window += increment;
+	if(s.send_window > max_window)
+		reset(stream, H2_FLOW_CONTROL_ERROR);
+	return H2_NO_ERROR;
+}
+
+// u=0..7 and i of a Priority field value, "u=1, i"
+static void parse_priority(std::string_view value, int &urgency, bool &incremental) {
+	while(!value.empty()) {
+		auto comma = value.find(',');
+		auto item = value.substr(0, comma);
+		value = comma == value.npos ? std::string_view() : value.substr(comma + 1);
+
+		while(!item.empty() && (item.front() == ' ' || item.front() == '\t'))
+			item.remove_prefix(1);
+		while(!item.empty() && (item.back() == ' ' || item.back() == '\t'))
+			item.remove_suffix(1);
+
+		if(item.size() == 3 && item.substr(0, 2) == "u=" && item[2] >= '0' && item[2] <= '7')
+			urgency = item[2] - '0';
+		else if(item == "i" || item == "i=?1")
+			incremental = true;
+		else if(item == "i=?0")
+			incremental = false;
+	}
+}
+
+uint32_t H2Connection::on_priority_update(std::string_view payload) {
+	if(payload.size() < 4)
+		return H2_FRAME_SIZE_ERROR;
+	auto it = streams.find(get32(payload.data()) & 0x7fffffff);
+	if(it != streams.end())
+		parse_priority(payload.substr(4), it->second->urgency, it->second->incremental);
+	return H2_NO_ERROR;
+}
+
+static bool valid_name(std::string_view name) {
+	if(name.empty())
+		return false;
+	for(unsigned char c : name) {
+		// token characters, and lower case only
+		if(c <= ' ' || c >= 0x7f || (c >= 'A' && c <= 'Z') || strchr("\"(),/:;<=>?@[\\]{}", c))
+			return false;
+	}
+	return true;
+}
+
+static bool valid_value(std::string_view value) {
+	return value.find_first_of(std::string_view("\0\r\n", 3)) == value.npos;
+}
+
+bool H2Connection::request_text(Stream &s, const std::vector<hpack::Field> &fields) {
+	std::string_view method, scheme, path, authority;
+	std::string header, cookie;
+	bool regular = false, host = false;
+
+	for(auto &field : fields) {
+		std::string_view name = field.name, value = field.value;
+		if(!valid_value(value))
+			return false;
+
+		if(name[0] == ':') {
+			// pseudo-header fields come first, once each
+			std::string_view *slot = name == ":method" ? &method : name == ":scheme" ? &scheme
+				: name == ":path" ? &path : name == ":authority" ? &authority : nullptr;
+			if(regular || !slot || !slot->empty() || value.empty())
+				return false;
+			*slot = value;
+			continue;
+		}
+		regular = true;
+
+		if(!valid_name(name))
+			return false;
+		// what HTTP/1 says about the connection has no place here
+		if(name == "connection" || name == "keep-alive" || name == "proxy-connection"
+				|| name == "transfer-encoding" || name == "upgrade")
+			return false;
+		if(name == "te" && value != "trailers")
+			return false;
+
+		if(name == "cookie") {
+			// may come split into one field per cookie
+			if(!cookie.empty())
+				cookie += "; ";
+			cookie += value;
+			continue;
+		}
+		if(name == "content-length") {
+			if(value.find_first_not_of("0123456789") != value.npos || value.size() > 15)
+				return false;
+			s.content_length = std::stoll(std::string(value));
+			continue;
+		}
+		// the whole body is there already
+		if(name == "expect")
+			continue;
+		if(name == "host")
+			host = true;
+		if(name == "priority")
+			parse_priority(value, s.urgency, s.incremental);
+
+		header.append(name).append(": ").append(value).append("\r\n");
+	}
+
+	// CONNECT has neither a scheme nor a path, and is not served anyway
+	if(method.empty() || scheme.empty() || path.empty()
+			|| path.find_first_of(" \t") != path.npos || method.find_first_of(" \t") != method.npos)
+		return false;
+	s.head = method == "HEAD";
+
+	s.text.reserve(method.size() + path.size() + authority.size() + header.size() + cookie.size() + 64);
+	s.text.append(method).append(" ").append(path).append(" HTTP/2.0\r\n");
+	if(!host && !authority.empty())
+		s.text.append("Host: ").append(authority).append("\r\n");
+	if(!cookie.empty())
+		s.text.append("Cookie: ").append(cookie).append("\r\n");
+	s.text += header;
+	s.header_size = s.text.size();
+	return true;
+}
+
+void H2Connection::end_of_request(Stream &s) {
+	s.end_received = true;
+	// answered already, with 413
+	if(s.responded) {
+		retire(s);
+		return;
+	}
+
+	// the body follows the header in text, which gets its length now
+	auto body_size = s.text.size() - s.header_size;
+	if(s.content_length >= 0 && size_t(s.content_length) != body_size) {
+		reset(s.id, H2_PROTOCOL_ERROR);
+		return;
+	}
+	std::string length;
+	if(body_size > 0 || s.content_length >= 0)
+		length = "Content-Length: " + std::to_string(body_size) + "\r\n";
+	length += "\r\n";
+	s.text.insert(s.header_size, length);
+	start_handler(s);
+}
+
+void H2Connection::start_handler(Stream &s) {
+	s.handling = true;
+	handlers++;
+	async::Executor::current().submit([this, &s] {
+		spawn(run_handler(s));
+	});
+}
+
+Task<void> H2Connection::run_handler(Stream &s) {
+	std::optional<HTTPResponse> response;
+	if(s.upgraded) {
+		response.emplace(co_await dispatch(*s.upgraded));
+	} else {
+		MemoryBuf buf(s.text);
+		std::istream is(&buf);
+		HTTPRequest request(is, limits, s.arena.get());
+		response.emplace(co_await dispatch(request));
+	}
+
+	std::coroutine_handle<> resume;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		s.handling = false;
+		handlers--;
+		respond(s, std::move(*response));
+		resume = take_waiter();
+	}
+	// run() may be gone with this connection as soon as it resumes
+	if(resume)
+		async::Executor::current().schedule(resume);
+}
+
+static void lowercase_into(std::string &out, std::string_view name) {
+	out.assign(name);
+	for(auto &ch : out) ch = std::tolower((unsigned char)ch);
+}
+
+static bool connection_specific(std::string_view name) {
+	return name == "connection" || name == "keep-alive" || name == "transfer-encoding"
+		|| name == "upgrade" || name == "proxy-connection";
+}
+
+void H2Connection::respond(Stream &s, HTTPResponse &&response) {
+	s.responded = true;
+	if(s.reset || broken) {
+		retire(s);
+		return;
+	}
+
+	std::string headers, name;
+	encoder.start_block(headers);
+	char status[4];
+	snprintf(status, sizeof(status), "%03d", response._return_code);
+	encoder.encode(":status", status, headers);
+
+	for(auto &kvpair : response._header) {
+		lowercase_into(name, kvpair.first);
+		if(!connection_specific(name))
+			encoder.encode(name, kvpair.second, headers);
+	}
+	// ready-made "Name: value\r\n" lines
+	std::string_view raw = response._raw_header;
+	while(!raw.empty()) {
+		auto end = raw.find("\r\n");
+		auto line = raw.substr(0, end);
+		raw = end == raw.npos ? std::string_view() : raw.substr(end + 2);
+
+		auto colon = line.find(':');
+		if(colon == line.npos)
+			continue;
+		lowercase_into(name, line.substr(0, colon));
+		auto value = line.substr(colon + 1);
+		while(!value.empty() && value.front() == ' ')
+			value.remove_prefix(1);
+		if(!connection_specific(name))
+			encoder.encode(name, value, headers);
+	}
+
+	int code = response._return_code;
+	bool empty = s.head || code == 204 || code == 304
+		|| (!response._generator && response.content().empty());
+
+	// HEADERS, then CONTINUATION for what does not fit one frame
+	std::string_view rest = headers;
+	uint8_t type = FRAME_HEADERS;
+	do {
+		auto piece = rest.substr(0, max_frame);
+		rest.remove_prefix(piece.size());
+		uint8_t flags = rest.empty() ? FLAG_END_HEADERS : 0;
+		if(type == FRAME_HEADERS && empty)
+			flags |= FLAG_END_STREAM;
+		frame(type, flags, s.id, piece);
+		type = FRAME_CONTINUATION;
+	} while(!rest.empty());
+
+	if(empty) {
+		s.body_done = true;
+		retire(s);
+	} else {
+		s.response.emplace(std::move(response));
+		s.pending = s.response->content();
+	}
+	wake_writer();
+}
+
+void H2Connection::retire(Stream &s) {
+	if(s.handling || !(s.reset || s.body_done))
+		return;
+	// a request still arriving is cut short, its body is of no use any more
+	if(!s.end_received && !s.reset)
+		reset(s.id, H2_NO_ERROR);
+	else
+		streams.erase(s.id);
+	check_done();
+}
+
+/* writing */
+
+H2Connection::Stream *H2Connection::next_stream() {
+	// the most urgent; of equal urgency, those not incremental one after
+	// the other by id, then the incremental ones in turn
+	Stream *best = nullptr;
+	for(auto &entry : streams) {
+		auto *s = entry.second.get();
+		if(!s->sending() || s->send_window <= 0)
+			continue;
+		if(!best || s->urgency < best->urgency) {
+			best = s;
+			continue;
+		}
+		if(s->urgency > best->urgency || !best->incremental)
+			continue;
+		if(!s->incremental || (s->id > last_sent && best->id <= last_sent))
+			best = s;
+	}
+	return best;
+}
+
+void H2Connection::collect(std::string &out) {
+	out.clear();
+	if(broken)
+		return;
+	std::swap(out, control);
+
+	while(out.size() < write_batch && send_window > 0) {
+		auto *s = next_stream();
+		if(!s)
+			break;
+		size_t n = std::min<int64_t>({int64_t(max_frame), send_window, s->send_window});
+
+		auto at = out.size();
+		bool end;
+		if(s->response->_generator) {
+			// pulled a frame at a time, 0 ends the body
+			out.resize(at + frame_header_size + n);
+			n = s->response->_generator(&out[at + frame_header_size], n);
+			out.resize(at + frame_header_size + n);
+			end = n == 0;
+		} else {
+			n = std::min(n, s->pending.size());
+			out.resize(at + frame_header_size);
+			out.append(s->pending.substr(0, n));
+			s->pending.remove_prefix(n);
+			end = s->pending.empty();
+		}
+		put_frame_header(&out[at], n, FRAME_DATA, end ? FLAG_END_STREAM : 0, s->id);
+
+		send_window -= n;
+		s->send_window -= n;
+		last_sent = s->id;
+		if(end) {
+			s->body_done = true;
+			s->response.reset();
+			retire(*s);
+		}
+	}
+	// retire() may have reset a stream
+	out += control;
+	control.clear();
+}
+
+void H2Connection::wake_writer() {
+	if(writing || broken)
+		return;
+	if(control.empty() && (send_window <= 0 || !next_stream()))
+		return;
+	writing = true;
+	async::Executor::current().submit([this] {
+		spawn(write_loop());
+	});
+}
+
+Task<void> H2Connection::write_loop() {
+	std::string out;
+	while(1) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			collect(out);
+			if(out.empty())
+				break;
+		}
+
+		deadline(limits.write_timeout);
+		if(co_await async::write_all(fd, out.data(), out.size()) < 0) {
+			std::lock_guard<std::mutex> lock(mutex);
+			// the reader sees the end as well
+			broken = true;
+			control.clear();
+			::shutdown(fd, SHUT_RDWR);
+			break;
+		}
+	}
+
+	std::coroutine_handle<> resume;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		writing = false;
+		check_done();
+		deadline(timeout());
+		resume = take_waiter();
+	}
+	// run() may be gone with this connection as soon as it resumes
+	if(resume)
+		async::Executor::current().schedule(resume);
+}
+
+int H2Connection::timeout() {
+	// a handler may take its time, as over HTTP/1
+	if(handlers > 0)
+		return -1;
+	if(writing)
+		return limits.write_timeout;
+	for(auto &entry : streams) {
+		if(!entry.second->end_received)
+			return limits.body_timeout;
+	}
+	// responses held back by the client's windows
+	if(!streams.empty())
+		return limits.write_timeout;
+	return limits.idle_timeout;
+}
+
+void H2Connection::check_done() {
+	// after GOAWAY the last stream ends the connection; the reader wakes up to EOF
+	if(closing && streams.empty() && !writing && !finished)
+		::shutdown(fd, SHUT_RDWR);
+}
+
+std::coroutine_handle<> H2Connection::take_waiter() {
+	if(!finished || !waiter || handlers > 0 || writing)
+		return nullptr;
+	return std::exchange(waiter, nullptr);
+}
+
+bool H2Connection::Drained::await_suspend(std::coroutine_handle<> h) {
+	std::lock_guard<std::mutex> lock(h2.mutex);
+	if(h2.handlers == 0 && !h2.writing)
+		return false;
+	h2.waiter = h;
+	return true;
+}
+
+/* the connection */
+
+Task<void> H2Connection::read_loop(std::string in, std::string_view expect) {
+	constexpr size_t read_size = default_frame_size + frame_header_size;
+	size_t start = 0;
+	uint32_t error = H2_NO_ERROR;
+
+	while(error == H2_NO_ERROR) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+
+			// the rest of the client preface, then frames
+			auto n = std::min(expect.size(), in.size());
+			if(in.compare(0, n, expect.substr(0, n)) != 0)
+				error = H2_PROTOCOL_ERROR;
+			expect.remove_prefix(n);
+			start = n;
+			// the response to an upgrade waits for the preface, some clients
+			// take nothing but the 101 until they have sent it
+			if(n > 0 && expect.empty() && error == H2_NO_ERROR) {
+				auto it = streams.find(1);
+				if(it != streams.end() && it->second->upgraded)
+					start_handler(*it->second);
+			}
+
+			while(error == H2_NO_ERROR && expect.empty() && in.size() - start >= frame_header_size) {
+				auto *p = (const unsigned char *)in.data() + start;
+				size_t length = p[0] << 16 | p[1] << 8 | p[2];
+				if(length > default_frame_size) {
+					error = H2_FRAME_SIZE_ERROR;
+					break;
+				}
+				if(in.size() - start < frame_header_size + length)
+					break;
+
+				uint8_t type = p[3], flags = p[4];
+				uint32_t stream = get32(in.data() + start + 5) & 0x7fffffff;
+				std::string_view payload(in.data() + start + frame_header_size, length);
+				start += frame_header_size + length;
+
+				error = on_frame(type, flags, stream, payload);
+			}
+
+			if(error != H2_NO_ERROR)
+				goaway(error);
+			wake_writer();
+			if(error == H2_NO_ERROR)
+				deadline(timeout());
+		}
+		if(error != H2_NO_ERROR)
+			break;
+
+		in.erase(0, start);
+		start = 0;
+		auto have = in.size();
+		in.resize(have + read_size);
+		auto n = co_await async::read_some(fd, &in[have], read_size);
+		in.resize(have + std::max<ssize_t>(n, 0));
+		if(n <= 0)
+			break;
+	}
+}
+
+Task<void> H2Connection::run(std::string received, std::string_view expect,
+		HTTPRequest *upgraded, std::string_view settings) {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		std::string ours;
+		for(auto [id, value] : { std::pair<uint16_t, uint32_t>
+				{ SETTINGS_MAX_CONCURRENT_STREAMS, max_streams },
+				{ SETTINGS_MAX_HEADER_LIST_SIZE, limits.max_header_size } }) {
+			ours.push_back(char(id >> 8));
+			ours.push_back(char(id));
+			put32(ours, value);
+		}
+		frame(FRAME_SETTINGS, 0, 0, ours);
+
+		if(upgraded) {
+			// HTTP2-Settings stand for the client's first SETTINGS, without an ACK
+			on_settings(settings, false);
+			last_stream = 1;
+			auto &s = *streams.emplace(1, std::make_unique<Stream>(1, initial_window)).first->second;
+			s.end_received = true;
+			s.upgraded = upgraded;
+			s.head = upgraded->method() == HEAD;
+		}
+		wake_writer();
+	}
+
+	co_await read_loop(std::move(received), expect);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		finished = true;
+	}
+	co_await Drained{*this};
+	deadline(-1);
+}
+
+// base64url, as in HTTP2-Settings, padding optional
+bool H2Connection::decode_settings(std::string_view base64url, std::string &settings) {
+	settings.clear();
+	uint32_t bits = 0;
+	int count = 0;
+	for(char c : base64url) {
+		int value;
+		if(c >= 'A' && c <= 'Z') value = c - 'A';
+		else if(c >= 'a' && c <= 'z') value = c - 'a' + 26;
+		else if(c >= '0' && c <= '9') value = c - '0' + 52;
+		else if(c == '-' || c == '+') value = 62;
+		else if(c == '_' || c == '/') value = 63;
+		else if(c == '=') break;
+		else return false;
+
+		bits = bits << 6 | value;
+		count += 6;
+		if(count >= 8) {
+			count -= 8;
+			settings.push_back(char(bits >> count));
+		}
+	}
+	return settings.size() % 6 == 0;
+}
@@ -0,0 +1,149 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <coroutine>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpack.h"
+#include "server.h"
+#include "task.h"
+
+
+/* One cleartext HTTP/2 connection (RFC 9113), reached with prior
+ * knowledge or through an Upgrade: h2c request. The connection is read by
+ * one coroutine; each request becomes a stream whose handler runs on the
+ * workers like an HTTP/1 request, through the same dispatch, and whose
+ * response is queued for a single writer. The writer sends control frames
+ * and headers first, then DATA of the most urgent streams (the priority
+ * header of RFC 9218) as far as the flow-control windows allow.
+ *
+ * Request bodies are collected in full before the handler runs, up to
+ * max_body_size, and handed to it as an ordinary HTTPRequest.
+ */
+class H2Connection {
+public:
+	// the response to one request, runs on a worker
+	using dispatch_t = std::function<Task<HTTPResponse> (HTTPRequest &request)>;
+	// re-arm the connection deadline to timeout_ms, or cancel it if negative
+	using deadline_t = std::function<void (int timeout_ms)>;
+
+	// the client preface, which prior knowledge starts with
+	static constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+private:
+	struct Stream;
+
+	int fd;
+	const HTTPLimits &limits;
+	dispatch_t dispatch;
+	deadline_t deadline;
+
+	// everything below is guarded by mutex, taken by the reader for each
+	// batch of frames, by handlers as they finish and by the writer
+	std::mutex mutex;
+	hpack::Decoder decoder;
+	hpack::Encoder encoder;
+	std::map<uint32_t, std::unique_ptr<Stream>> streams;
+	uint32_t last_stream;      // highest stream the client opened
+	uint32_t last_sent;        // last stream given DATA, for taking turns
+	size_t handlers;           // streams whose handler runs
+
+	// header block across CONTINUATION frames, for stream continued
+	std::string block;
+	uint32_t continued;
+	uint8_t continued_flags;
+
+	// the client's SETTINGS
+	int64_t initial_window;
+	size_t max_frame;
+
+	int64_t send_window;       // connection-wide, the client's window for us
+	int64_t recv_window;       // ours for the client
+	size_t recv_unacked;       // received since our last WINDOW_UPDATE
+
+	std::string control;       // frames that go ahead of any DATA
+	bool writing;              // a writer runs
+	bool broken;               // a write failed, nothing more is sent
+	bool closing;              // GOAWAY either way, no new streams
+	bool finished;             // the reader is done, nothing more comes in
+	std::coroutine_handle<> waiter;  // run(), until handlers and writer are done
+
+	// queue a frame in control
+	void frame(uint8_t type, uint8_t flags, uint32_t stream, std::string_view payload);
+	void reset(uint32_t stream, uint32_t code);
+	void goaway(uint32_t code);
+
+	// one frame from the client; 0, or the error code that ends the connection
+	uint32_t on_frame(uint8_t type, uint8_t flags, uint32_t stream, std::string_view payload);
+	uint32_t on_headers(uint32_t stream, uint8_t flags, std::string_view payload);
+	uint32_t on_header_block(uint32_t stream, uint8_t flags);
+	uint32_t on_data(uint32_t stream, uint8_t flags, std::string_view payload);
+	uint32_t on_settings(std::string_view payload, bool ack);
+	uint32_t on_window_update(uint32_t stream, std::string_view payload);
+	uint32_t on_priority_update(std::string_view payload);
+
+	// the request of s as HTTP/1 text, false if it is malformed
+	bool request_text(Stream &s, const std::vector<hpack::Field> &fields);
+	// END_STREAM from the client: the handler starts with the whole body
+	void end_of_request(Stream &s);
+	void start_handler(Stream &s);
+	Task<void> run_handler(Stream &s);
+	// queue the response headers, and the body for the writer
+	void respond(Stream &s, HTTPResponse &&response);
+	// forget s once nothing of it is pending any more
+	void retire(Stream &s);
+
+	// the stream to send DATA of next, nullptr if none can
+	Stream *next_stream();
+	// frames to send next, as much as the windows allow
+	void collect(std::string &out);
+	// start a writer if there is something it can send
+	void wake_writer();
+	Task<void> write_loop();
+	// deadline for the state of the connection, -1 for none
+	int timeout();
+	// shut the socket down after GOAWAY once the last stream is done
+	void check_done();
+	// run(), if it can go on now; resume it only after releasing mutex
+	std::coroutine_handle<> take_waiter();
+
+	Task<void> read_loop(std::string in, std::string_view expect);
+
+	struct Drained {
+		H2Connection &h2;
+		bool await_ready() const noexcept { return false; }
+		bool await_suspend(std::coroutine_handle<> h);
+		void await_resume() const noexcept {}
+	};
+
+public:
+	H2Connection(int fd, const HTTPLimits &limits, dispatch_t dispatch, deadline_t deadline);
+	~H2Connection();
+
+	H2Connection(const H2Connection &) = delete;
+	H2Connection& operator= (const H2Connection &) = delete;
+
+	/* Serve the connection until either side ends it. received: bytes
+	 * already read from the socket, which must go on with the rest of the
+	 * preface, expect. upgraded: the HTTP/1 request that asked for
+	 * Upgrade: h2c, answered on stream 1; settings from its HTTP2-Settings.
+	 */
+	Task<void> run(std::string received, std::string_view expect,
+			HTTPRequest *upgraded = nullptr, std::string_view settings = {});
+
+	// stop taking new streams and end once the open ones are done; any thread
+	void go_away();
+
+	// the decoded HTTP2-Settings header of an upgrade, false if malformed
+	static bool decode_settings(std::string_view base64url, std::string &settings);
+};
+
+
+#endif
@@ -0,0 +1,92 @@
+#include "httpnames.h"
+#include "perfect_hash.h"
+
+
+// in enum order, so a key's position is its value
+static constexpr std::array<std::string_view, UNKNOWN_METHOD> method_names = {
+	"GET", "POST", "PUT", "PATCH", "HEAD", "DELETE", "OPTIONS", "CONNECT", "TRACE",
+};
+
+static constexpr std::array<std::string_view, HEADER_COUNT> header_names = {
+	"Accept",
+	"Accept-Charset",
+	"Accept-Encoding",
+	"Accept-Language",
+	"Authorization",
+	"Cache-Control",
+	"Connection",
+	"Content-Encoding",
+	"Content-Length",
+	"Content-Type",
+	"Cookie",
+	"Date",
+	"DNT",
+	"Expect",
+	"Forwarded",
+	"From",
+	"Host",
+	"HTTP2-Settings",
+	"If-Match",
+	"If-Modified-Since",
+	"If-None-Match",
+	"If-Range",
+	"If-Unmodified-Since",
+	"Keep-Alive",
+	"Last-Event-ID",
+	"Origin",
+	"Pragma",
+	"Priority",
+	"Proxy-Authorization",
+	"Range",
+	"Referer",
+	"Sec-Fetch-Dest",
+	"Sec-Fetch-Mode",
+	"Sec-Fetch-Site",
+	"Sec-WebSocket-Extensions",
+	"Sec-WebSocket-Key",
+	"Sec-WebSocket-Protocol",
+	"Sec-WebSocket-Version",
+	"TE",
+	"Trailer",
+	"Transfer-Encoding",
+	"Upgrade",
+	"Upgrade-Insecure-Requests",
+	"User-Agent",
+	"Via",
+	"X-Forwarded-For",
+	"X-Forwarded-Host",
+	"X-Forwarded-Proto",
+	"X-Real-IP",
+	"X-Requested-With",
+};
+
+static constexpr PerfectHash<UNKNOWN_METHOD> methods(method_names);
+static constexpr PerfectHash<HEADER_COUNT, CaseInsensitiveKey> headers(header_names);
+
+static_assert([] {
+	for(size_t i = 0; i < method_names.size(); i++)
+		if(methods.find(method_names[i]) != int(i))
+			return false;
+	for(size_t i = 0; i < header_names.size(); i++)
+		if(headers.find(header_names[i]) != int(i))
+			return false;
+	return methods.find("get") < 0 && headers.find("content-LENGTH") == HEADER_CONTENT_LENGTH;
+}(), "name tables out of step with their enums");
+
+HTTPMethod find_method(StringRef name) {
+	int i = methods.find(name);
+	return i < 0 ? UNKNOWN_METHOD : HTTPMethod(i);
+}
+
+StringRef method_name(HTTPMethod method) {
+	return method < UNKNOWN_METHOD ? StringRef(method_names[method]) : StringRef();
+}
+
+HTTPHeader find_header(StringRef name) {
+	int i = headers.find(name);
+	return i < 0 ? HEADER_COUNT : HTTPHeader(i);
+}
+
+StringRef header_name(HTTPHeader header) {
+	return header < HEADER_COUNT ? StringRef(header_names[header]) : StringRef();
+}
@@ -0,0 +1,84 @@
+#ifndef HTTPNAMES_H
+#define HTTPNAMES_H
+
+#include <cstdint>
+#include <iostream>
+
+#include "StringRef.h"
+
+
+enum HTTPMethod { GET, POST, PUT, PATCH, HEAD, DELETE, OPTIONS, CONNECT, TRACE, UNKNOWN_METHOD };
+
+// request headers the server and its handlers look at; the rest are kept by name
+enum HTTPHeader : uint8_t {
+	HEADER_ACCEPT,
+	HEADER_ACCEPT_CHARSET,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_ACCEPT_LANGUAGE,
+	HEADER_AUTHORIZATION,
+	HEADER_CACHE_CONTROL,
+	HEADER_CONNECTION,
+	HEADER_CONTENT_ENCODING,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_TYPE,
+	HEADER_COOKIE,
+	HEADER_DATE,
+	HEADER_DNT,
+	HEADER_EXPECT,
+	HEADER_FORWARDED,
+	HEADER_FROM,
+	HEADER_HOST,
+	HEADER_HTTP2_SETTINGS,
+	HEADER_IF_MATCH,
+	HEADER_IF_MODIFIED_SINCE,
+	HEADER_IF_NONE_MATCH,
+	HEADER_IF_RANGE,
+	HEADER_IF_UNMODIFIED_SINCE,
+	HEADER_KEEP_ALIVE,
+	HEADER_LAST_EVENT_ID,
+	HEADER_ORIGIN,
+	HEADER_PRAGMA,
+	HEADER_PRIORITY,
+	HEADER_PROXY_AUTHORIZATION,
+	HEADER_RANGE,
+	HEADER_REFERER,
+	HEADER_SEC_FETCH_DEST,
+	HEADER_SEC_FETCH_MODE,
+	HEADER_SEC_FETCH_SITE,
+	HEADER_SEC_WEBSOCKET_EXTENSIONS,
+	HEADER_SEC_WEBSOCKET_KEY,
+	HEADER_SEC_WEBSOCKET_PROTOCOL,
+	HEADER_SEC_WEBSOCKET_VERSION,
+	HEADER_TE,
+	HEADER_TRAILER,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_UPGRADE,
+	HEADER_UPGRADE_INSECURE_REQUESTS,
+	HEADER_USER_AGENT,
+	HEADER_VIA,
+	HEADER_X_FORWARDED_FOR,
+	HEADER_X_FORWARDED_HOST,
+	HEADER_X_FORWARDED_PROTO,
+	HEADER_X_REAL_IP,
+	HEADER_X_REQUESTED_WITH,
+	HEADER_COUNT,
+};
+
+// methods are case-sensitive; UNKNOWN_METHOD for anything else
+HTTPMethod find_method(StringRef name);
+StringRef method_name(HTTPMethod method);
+
+// header names are not; HEADER_COUNT if the name is not a known one
+HTTPHeader find_header(StringRef name);
+// canonical spelling, "Content-Length"
+StringRef header_name(HTTPHeader header);
+
+inline std::ostream &operator<<(std::ostream &os, HTTPMethod method) {
+	auto name = method_name(method);
+	if(name.empty())
+		return os << "<BAD>";
+	return os.write(name.getData(), name.size());
+}
+
+
+#endif
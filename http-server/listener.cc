@@ -0,0 +1,209 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <string_view>
+
+#include "debug.h"
+#include "listener.h"
+
+std::set<int> Listener::opened;
+
+
+Listener::Listener(const std::string &address, const SocketOptions &options) :
+	_address(address),
+	options(options),
+	_tls(address.compare(0, 4, "tls:") == 0),
+	servfd(take_inherited())
+{
+	if(servfd >= 0)
+		wlog("use inherited listening socket fd % for %\n", servfd, _address);
+	else
+		servfd = bind_address();
+	start();
+}
+
+Listener::Listener(int fd, const SocketOptions &options) :
+	_address("fd " + std::to_string(fd)),
+	options(options),
+	_tls(false),
+	servfd(fd)
+{
+	start();
+}
+
+Listener::Listener(Listener &&that) :
+	_address(std::move(that._address)),
+	options(that.options),
+	_tls(that._tls),
+	servfd(that.servfd)
+{
+	that.servfd = -1;
+}
+
+Listener::~Listener() {
+	// close_all() may have been first
+	if(servfd >= 0 && opened.erase(servfd)) {
+		wlog("close server fd %\n", servfd);
+		close(servfd);
+	}
+}
+
+void Listener::start() {
+	if(!options.apply(servfd)) {
+		wloge("fail to listen on %: %\n", _address, strerror(errno));
+	}
+	wlog("listening on %: %\n", _address, options.describe(servfd));
+
+	opened.insert(servfd);
+}
+
+static bool parse_port(std::string_view s, in_port_t &port) {
+	if(s.empty() || s.size() > 5 || s.find_first_not_of("0123456789") != s.npos)
+		return false;
+	auto value = atoi(std::string(s).c_str());
+	if(value > 65535)
+		return false;
+	port = htons(value);
+	return true;
+}
+
+// a file left behind by a server that is gone refuses connections
+static bool stale_socket_file(const struct sockaddr_un &addr, socklen_t length) {
+	struct stat st;
+	if(lstat(addr.sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+		return false;
+
+	int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	bool stale = connect(probe, (const struct sockaddr *)&addr, length) < 0 && errno == ECONNREFUSED;
+	close(probe);
+	return stale;
+}
+
+int Listener::bind_address() {
+	std::string_view address = _address;
+	if(_tls)
+		address.remove_prefix(4);
+	struct sockaddr_storage storage;
+	memset(&storage, 0, sizeof(storage));
+	socklen_t length = 0;
+	bool dual_stack = false;
+
+	if(address.substr(0, 5) == "unix:") {
+		auto path = address.substr(5);
+		auto *un = (struct sockaddr_un *)&storage;
+		if(path.empty() || path.size() >= sizeof(un->sun_path))
+			wloge("bad unix socket path in %\n", _address);
+
+		un->sun_family = AF_UNIX;
+		memcpy(un->sun_path, path.data(), path.size());
+		if(path[0] == '@') {
+			// abstract: a leading NUL, and the name is exactly that long
+			un->sun_path[0] = '\0';
+			length = offsetof(struct sockaddr_un, sun_path) + path.size();
+		} else {
+			length = offsetof(struct sockaddr_un, sun_path) + path.size() + 1;
+			if(stale_socket_file(*un, length))
+				unlink(un->sun_path);
+		}
+	} else {
+		auto colon = address.rfind(':');
+		auto host = colon == address.npos ? std::string_view() : address.substr(0, colon);
+		auto port = colon == address.npos ? address : address.substr(colon + 1);
+
+		auto *in = (struct sockaddr_in *)&storage;
+		auto *in6 = (struct sockaddr_in6 *)&storage;
+		if(host.empty() || host == "*") {
+			in6->sin6_family = AF_INET6;
+			in6->sin6_addr = in6addr_any;
+			dual_stack = true;
+		} else if(host.size() > 2 && host.front() == '[' && host.back() == ']') {
+			in6->sin6_family = AF_INET6;
+			if(inet_pton(AF_INET6, std::string(host.substr(1, host.size() - 2)).c_str(), &in6->sin6_addr) != 1)
+				wloge("bad IPv6 address in %\n", _address);
+		} else {
+			in->sin_family = AF_INET;
+			if(inet_pton(AF_INET, std::string(host).c_str(), &in->sin_addr) != 1)
+				wloge("bad IPv4 address in %\n", _address);
+		}
+
+		// sin_port and sin6_port share their place
+		if(!parse_port(port, in->sin_port))
+			wloge("bad port in %\n", _address);
+		length = in->sin_family == AF_INET ? sizeof(*in) : sizeof(*in6);
+	}
+
+	int fd = socket(storage.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0 && dual_stack && errno == EAFNOSUPPORT) {
+		// a kernel without IPv6 still has every IPv4 address
+		auto port = ((struct sockaddr_in6 *)&storage)->sin6_port;
+		auto *in = (struct sockaddr_in *)&storage;
+		memset(&storage, 0, sizeof(storage));
+		in->sin_family = AF_INET;
+		in->sin_port = port;
+		in->sin_addr.s_addr = htonl(INADDR_ANY);
+		length = sizeof(*in);
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	}
+	if(fd < 0) {
+		wloge("Create Server Socket Failed!\n");
+	}
+
+	int flag = 1;
+	if(storage.ss_family != AF_UNIX)
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+	// [::] next to 0.0.0.0 must leave IPv4 to the other socket
+	flag = !dual_stack;
+	if(storage.ss_family == AF_INET6)
+		setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &flag, sizeof(flag));
+
+	if(bind(fd, (struct sockaddr *)&storage, length) == -1) {
+		wloge("Can not bind to %: %\n", _address, strerror(errno));
+	}
+	return fd;
+}
+
+// fd 3 onwards, as passed by upgrade() or a service manager (LISTEN_FDS)
+int Listener::take_inherited() {
+	static int next = -1, end = -1;
+	if(next < 0) {
+		auto *count = getenv("LISTEN_FDS");
+		auto *pid = getenv("LISTEN_PID");
+		next = end = 3;
+		if(count && atoi(count) > 0 && (!pid || atoi(pid) == getpid()))
+			end = 3 + atoi(count);
+
+		unsetenv("LISTEN_FDS");
+		unsetenv("LISTEN_PID");
+	}
+
+	while(next < end) {
+		int fd = next++;
+		int type = 0;
+		socklen_t length = sizeof(type);
+		if(getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &length) < 0 || type != SOCK_STREAM)
+			continue;
+
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		return fd;
+	}
+	return -1;
+}
+
+void Listener::close_all() {
+	for(auto fd : opened) {
+		wlog("close fd %\n", fd);
+		close(fd);
+	}
+
+	opened.clear();
+}
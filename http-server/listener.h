@@ -0,0 +1,61 @@
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <set>
+#include <string>
+
+#include "sockopt.h"
+
+
+/* One listening socket, TCP over IPv4 or IPv6 or a Unix domain socket,
+ * with socket options of its own. address is one of
+ *
+ *   8080, *:8080        every address, IPv6 and IPv4 on one socket
+ *   0.0.0.0:8080        every IPv4 address, or a single one
+ *   [::]:8080           every IPv6 address (IPv6 only), or a single one
+ *   unix:/run/web.sock  a socket file, a stale one is replaced
+ *   unix:@web           an abstract socket, which has no file
+ *
+ * and with tls: in front (tls:443, tls:[::1]:8443) the connections are
+ * TLS, see TLSContext.
+ *
+ * A socket passed down by upgrade() or a service manager (LISTEN_FDS) is
+ * taken instead of a new one while there are any, in the order listeners
+ * are created.
+ */
+class Listener {
+	std::string _address;
+	SocketOptions options;
+	bool _tls;
+	int servfd;
+
+	// listening fds of the process that close_all() has not closed yet
+	static std::set<int> opened;
+
+	// a new socket bound to _address, -1 if that fails
+	int bind_address();
+	// set the options, listen and log what took effect
+	void start();
+
+public:
+	Listener(const std::string &address, const SocketOptions &options = SocketOptions());
+	// adopt fd, already bound and listening
+	Listener(int fd, const SocketOptions &options = SocketOptions());
+	Listener(Listener &&that);
+	~Listener();
+
+	Listener(const Listener &) = delete;
+	Listener& operator= (const Listener &) = delete;
+
+	int fd() const { return servfd; }
+	const std::string &address() const { return _address; }
+	bool tls() const { return _tls; }
+
+	// the next socket passed down by the parent process, -1 when none is left
+	static int take_inherited();
+	// close every listening socket of the process
+	static void close_all();
+};
+
+
+#endif
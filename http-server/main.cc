@@ -1,13 +1,22 @@
 #include "server.h"
+#include "bundle.h"
+#include "embedded.h"
 #include "file.h"
 #include "debug.h"
+#include "eventstream.h"
+#include "websocket.h"
 
 #include "argv.h"
+#include "async.h"
 
 #include <string>
+#include <sstream>
 #include <cassert>
 
 std::string work_directory; // bad solution
+std::shared_ptr<LiveManifest> manifest;
+std::shared_ptr<const Bundle> bundle;
+std::shared_ptr<EventHub> events = std::make_shared<EventHub>();
 
 HTTPResponse add(Session &session, CallbackArgs &args) {
 	std::ostringstream oss;
@@ -16,23 +25,164 @@ HTTPResponse add(Session &session, CallbackArgs &args) {
 	return oss.str();
 }
 
-HTTPResponse file(Session &session, CallbackArgs &args) {
-	auto fp = File(work_directory + args[0]);
+// every message straight back, text as text and binary as binary
+static const WebSocketHandler echo {
+	nullptr,
+	[](const WebSocketPtr &ws, websocket::Opcode opcode, std::string_view message) {
+		ws->send(message, opcode);
+	},
+	nullptr,
+};
+
+/* POST publish/{topic} with the form data=...&event=...: one event to
+ * everyone on events/{topic}. Nothing checks who publishes, so the route
+ * only exists with --event-publish; POST keeps crawlers and prefetching off it.
+ */
+Task<HTTPResponse> publish(HTTPRequest &request, Session &session, CallbackArgs &args) {
+	if(request.method() != POST) {
+		HTTPResponse refused({{"Allow", "POST"}}, "<html> 405 </html>");
+		co_return std::move(refused.status(405));
+	}
+	auto id = events->publish(args[1], request.post("data"), request.post("event"));
+	co_return std::to_string(id) + "\n";
+}
+
+Task<HTTPResponse> file(Session &session, CallbackArgs &args) {
+	if(manifest) {
+		auto asset = manifest->get()->find(args[0]);
+		if(!asset) {
+			wlog("request file % didn't exist\n", work_directory + args[0].c_str());
+			co_return "<html> 404 </html>";
+		}
+		if(asset->directory)
+			co_return "";
+		// half written on disk, and no whole copy in memory
+		if(asset->pending && !asset->content) {
+			HTTPResponse busy({{"Retry-After", "1"}}, "<html> 503 </html>");
+			co_return std::move(busy.status(503));
+		}
+		if(asset->content)
+			co_return HTTPResponse(*asset);
+
+		auto load = [asset] {
+			return HTTPResponse(*asset);
+		};
+		auto response = co_await async::offload(std::move(load));
+		co_return response;
+	}
+
+	auto fp = File(work_directory + args[0].c_str());
 
 	if(!fp.is_exists()) {
 		wlog("request file % didn't exist\n", fp.fullpath());
-		return "<html> 404 </html>";
+		co_return "<html> 404 </html>";
 	}
 
 	if(fp.is_directory())
-		return "";
+		co_return "";
 
-	return fp;
+	// disk reads go to the blocking pool, the worker serves others meanwhile
+	auto load = [&fp] {
+		return HTTPResponse(fp);
+	};
+	auto response = co_await async::offload(std::move(load));
+	co_return response;
 }
 
+// gzip listed in Accept-Encoding, and not with q=0
+static bool accepts_gzip(const std::pmr::string &accept) {
+	for(size_t pos = 0; (pos = accept.find("gzip", pos)) != std::string::npos; pos += 4) {
+		// a view, the number after q= ends at the ',' or the end of accept
+		auto item = std::string_view(accept).substr(pos, accept.find(',', pos) - pos);
+		auto q = item.find("q=");
+		if(q == std::string::npos || atof(item.data() + q + 2) > 0)
+			return true;
+	}
+	return false;
+}
+
+// the client's copy, named in If-None-Match, is still current
+static bool not_modified(HTTPRequest &request, std::string_view etag) {
+	auto &match = request.header(HEADER_IF_NONE_MATCH);
+	return match == "*" || match.find(etag) != std::string::npos;
+}
+
+// everything from the mapped bundle, no file system access at all
+Task<HTTPResponse> bundled(HTTPRequest &request, Session &session, CallbackArgs &args) {
+	auto *entry = bundle->find(args[0]);
+	if(!entry) {
+		wlog("request file % isn't in the bundle\n", args[0]);
+		co_return "<html> 404 </html>";
+	}
+	if(entry->flags & BUNDLE_DIRECTORY)
+		co_return "";
+
+	bool gzip = entry->gzip_body.size && accepts_gzip(request.header(HEADER_ACCEPT_ENCODING));
+	auto &header = gzip ? entry->gzip_header : entry->header;
+	auto &body = gzip ? entry->gzip_body : entry->body;
+	auto *etag = gzip ? entry->gzip_etag : entry->etag;
+
+	if(not_modified(request, etag)) {
+		HTTPResponse response(bundle, bundle->view(header), {});
+		co_return std::move(response.status(304));
+	}
+	co_return HTTPResponse(bundle, bundle->view(header), bundle->view(body),
+		bundle->file(), body.offset);
+}
+
+#ifdef HTTP_EMBEDDED
+// the site built into the binary, see embedded.h
+Task<HTTPResponse> embedded_file(HTTPRequest &request, Session &session, CallbackArgs &args) {
+	auto *asset = embedded::find(args[0]);
+	if(!asset) {
+		wlog("request file % isn't embedded\n", args[0]);
+		co_return "<html> 404 </html>";
+	}
+	if(asset->directory)
+		co_return "";
+
+	if(not_modified(request, asset->etag)) {
+		HTTPResponse response(nullptr, asset->header, {});
+		co_return std::move(response.status(304));
+	}
+	co_return HTTPResponse(nullptr, asset->header, asset->body);
+}
+#endif
+
 
 static cl::opt<std::string> WorkDirectory(cl::BothOpt, "w", "work-directory");
 static cl::opt<int> Port(cl::BothOpt, "p", "port");
+static cl::opt<std::string> Listen(cl::LongOpt, "listen");
+static cl::opt<std::string> TLSCert(cl::LongOpt, "tls-cert");
+static cl::opt<std::string> TLSKey(cl::LongOpt, "tls-key");
+static cl::opt<std::string> TLSTicketKeys(cl::LongOpt, "tls-ticket-keys");
+static cl::opt<std::string> IOBackend(cl::LongOpt, "io-backend");
+static cl::opt<std::string> SocketProfile(cl::LongOpt, "socket-profile");
+static cl::opt<int> Backlog(cl::LongOpt, "backlog");
+static cl::opt<int> NoDelay(cl::LongOpt, "tcp-nodelay");
+static cl::opt<int> DeferAccept(cl::LongOpt, "defer-accept");
+static cl::opt<int> FastOpen(cl::LongOpt, "fastopen");
+static cl::opt<int> RecvBuffer(cl::LongOpt, "rcvbuf");
+static cl::opt<int> SendBuffer(cl::LongOpt, "sndbuf");
+static cl::opt<int> NotSentLowat(cl::LongOpt, "notsent-lowat");
+static cl::opt<int> BusyPoll(cl::LongOpt, "busy-poll");
+static cl::opt<int> KeepAlive(cl::LongOpt, "keepalive");
+static cl::opt<size_t> MaxHeaderSize(cl::LongOpt, "max-header-size");
+static cl::opt<size_t> MaxBodySize(cl::LongOpt, "max-body-size");
+static cl::opt<int> RequestTimeout(cl::LongOpt, "request-timeout");
+static cl::opt<int> IOTimeout(cl::LongOpt, "io-timeout");
+static cl::opt<int> IdleTimeout(cl::LongOpt, "idle-timeout");
+static cl::opt<int> QueueTarget(cl::LongOpt, "queue-target");
+static cl::opt<size_t> MaxInFlight(cl::LongOpt, "max-in-flight");
+static cl::opt<int> SessionTTL(cl::LongOpt, "session-ttl");
+static cl::opt<size_t> SessionMemory(cl::LongOpt, "session-memory");
+static cl::opt<std::string> BundleFile(cl::LongOpt, "bundle");
+static cl::opt<void> NoManifest(cl::LongOpt, "no-manifest");
+static cl::opt<size_t> Preload(cl::LongOpt, "preload");
+static cl::opt<std::string> WarmFrom(cl::LongOpt, "warm-from");
+static cl::opt<void> Mlock(cl::LongOpt, "mlock");
+static cl::opt<void> NoWatch(cl::LongOpt, "no-watch");
+static cl::opt<void> EventPublish(cl::LongOpt, "event-publish");
 static cl::opt<void> Help(cl::BothOpt, "h", "help");
 
 /* @param(1)
@@ -47,7 +197,22 @@ int main(int argc, const char **argv) {
 	if(Help) {
 		std::clog << "usage:\n";
 		std::clog << "<bin> -p {port}/--port={port}\n";
+		std::clog << "<bin> --listen={address}[={socket profile}],... address: 8080, 127.0.0.1:8080, [::1]:8080, unix:{path}, unix:@{name}, tls:{address}\n";
+		std::clog << "<bin> --tls-cert={PEM chain} --tls-key={PEM key} --tls-ticket-keys={file of 80 random bytes}\n";
 		std::clog << "<bin> -w {dir}/--work-directory={dir}\n";
+		std::clog << "<bin> --bundle={file, made by bundle-builder}\n";
+		std::clog << "<bin> --io-backend={epoll|uring}\n";
+		std::clog << "<bin> --socket-profile={default|latency|throughput} --backlog={connections}\n";
+		std::clog << "<bin> --tcp-nodelay={0|1} --defer-accept={seconds} --fastopen={queue}\n";
+		std::clog << "<bin> --rcvbuf={bytes} --sndbuf={bytes} --notsent-lowat={bytes}\n";
+		std::clog << "<bin> --busy-poll={us} --keepalive={idle seconds, 0 for off}\n";
+		std::clog << "<bin> --max-header-size={bytes} --max-body-size={bytes}\n";
+		std::clog << "<bin> --request-timeout={ms} --io-timeout={ms} --idle-timeout={ms}\n";
+		std::clog << "<bin> --queue-target={ms} --max-in-flight={requests}\n";
+		std::clog << "<bin> --session-ttl={seconds} --session-memory={bytes}\n";
+		std::clog << "<bin> --preload={bytes} --warm-from={access log} --mlock\n";
+		std::clog << "<bin> --no-manifest --no-watch\n";
+		std::clog << "<bin> --event-publish: anyone may POST events to publish/{topic}\n";
 		std::clog << "\n";
 		return 0;
 	}
@@ -56,10 +221,108 @@ int main(int argc, const char **argv) {
 	auto port = Port ? Port.value() : 8080;
 	work_directory = WorkDirectory ? WorkDirectory.value() + "/" : "./";
 
-	// run server
-	HTTPServer server(port);
-	server.register_callback({R"(.*)", file});
+	// a profile, then single options on top of it
+	auto socket_options = [](const std::string &profile, SocketOptions &options) {
+		if(!SocketOptions::preset(profile, options)) {
+			wlog("unknown socket profile %\n", profile);
+			return false;
+		}
+		if(Backlog) options.backlog = Backlog.value();
+		if(NoDelay) options.nodelay = NoDelay.value() != 0;
+		if(DeferAccept) options.defer_accept = DeferAccept.value();
+		if(FastOpen) options.fastopen = FastOpen.value();
+		if(RecvBuffer) options.rcvbuf = RecvBuffer.value();
+		if(SendBuffer) options.sndbuf = SendBuffer.value();
+		if(NotSentLowat) options.notsent_lowat = NotSentLowat.value();
+		if(BusyPoll) options.busy_poll = BusyPoll.value();
+		if(KeepAlive) options.keepalive_idle = KeepAlive.value();
+		return true;
+	};
+	auto default_profile = SocketProfile ? SocketProfile.value() : "default";
+
+	// every listener feeds the same server, -p is one on all addresses
+	HTTPServer server;
+	std::istringstream addresses(Listen ? Listen.value() : std::to_string(port));
+	for(std::string address; std::getline(addresses, address, ','); ) {
+		auto profile = default_profile;
+		auto eq = address.find('=');
+		if(eq != address.npos) {
+			profile = address.substr(eq + 1);
+			address.resize(eq);
+		}
+
+		SocketOptions options;
+		if(!socket_options(profile, options))
+			return 1;
+		server.add_listener(address, options);
+	}
+
+	if(TLSCert || TLSKey) {
+		auto cert = TLSCert ? TLSCert.value() : TLSKey.value();
+		auto key = TLSKey ? TLSKey.value() : cert;
+		if(!server.use_tls(cert, key, TLSTicketKeys ? TLSTicketKeys.value() : ""))
+			return 1;
+	}
+
+	if(IOBackend)
+		server.use_io_backend(IOBackend.value());
+
+	HTTPLimits limits;
+	if(MaxHeaderSize) limits.max_header_size = MaxHeaderSize.value();
+	if(MaxBodySize) limits.max_body_size = MaxBodySize.value();
+	if(RequestTimeout) limits.first_byte_timeout = limits.header_timeout = RequestTimeout.value();
+	if(IOTimeout) limits.body_timeout = limits.write_timeout = IOTimeout.value();
+	if(IdleTimeout) limits.idle_timeout = IdleTimeout.value();
+	server.set_limits(limits);
+
+	if(SessionTTL || SessionMemory) {
+		server.configure_sessions(
+			std::chrono::seconds(SessionTTL ? SessionTTL.value() : 1800),
+			SessionMemory ? SessionMemory.value() : 64 * 1024 * 1024);
+	}
+
+	if(QueueTarget || MaxInFlight) {
+		server.configure_overload(
+			std::chrono::milliseconds(QueueTarget ? QueueTarget.value() : 5),
+			MaxInFlight ? MaxInFlight.value() : 4096);
+	}
+
+#ifdef HTTP_EMBEDDED
+	// a binary that carries its site serves it, unless pointed elsewhere
+	if(!WorkDirectory && !BundleFile) {
+		wlog("serving % embedded files\n", embedded::size());
+		server.use_directory_lookup([](std::string_view path) {
+			return embedded::is_directory(path);
+		});
+		server.register_callback({R"(.*)", embedded_file});
+	} else
+#endif
+	if(BundleFile) {
+		bundle = Bundle::open(BundleFile.value());
+		if(!bundle)
+			return 1;
+		server.use_directory_lookup([](std::string_view path) {
+			return bundle->is_directory(path);
+		});
+		server.register_callback({R"(.*)", bundled});
+	} else {
+		if(!NoManifest) {
+			ManifestOptions options;
+			if(Preload) options.preload_bytes = Preload.value();
+			if(WarmFrom) options.access_log = WarmFrom.value();
+			options.lock = Mlock;
+			manifest = std::make_shared<LiveManifest>(work_directory, options, !NoWatch);
+			server.use_directory_lookup([](std::string_view path) {
+				return manifest->get()->is_directory(path);
+			});
+		}
+		server.register_callback({R"(.*)", file});
+	}
 	server.register_callback({R"(add/(\d+)/(\d+))", add});
+	server.register_websocket({R"(ws/echo)", echo});
+	server.register_event_stream({R"(events/(\w+))", events});
+	if(EventPublish)
+		server.register_callback({R"(publish/(\w+))", publish});
 	server.run();
 	return 0;
 }
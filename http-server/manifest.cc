@@ -0,0 +1,688 @@
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "manifest.h"
+#include "mime.h"
+#include "debug.h"
+
+
+using AssetMap = std::unordered_map<std::string, std::shared_ptr<Asset>>;
+
+std::string normalize_path(std::string_view path) {
+	std::string result;
+	result.reserve(path.size());
+	for(char c : path) {
+		if(c == '/' && (result.empty() || result.back() == '/'))
+			continue;
+		result += c;
+	}
+	if(!result.empty() && result.back() == '/')
+		result.pop_back();
+	return result;
+}
+
+static std::string join(const std::string &dir, const std::string &name) {
+	return dir.empty() ? name : dir + "/" + name;
+}
+
+static std::string trim_root(const std::string &root) {
+	auto dir = root;
+	while(dir.size() > 1 && dir.back() == '/')
+		dir.pop_back();
+	return dir;
+}
+
+/* a preloaded body, mlock()ed if lock; munlock()ed again once the last
+ * snapshot or response holding it lets go. failed is set if mlock() refused
+ */
+static std::shared_ptr<const std::string> keep_content(std::string content, bool lock, bool &failed) {
+	if(!lock || content.empty())
+		return std::make_shared<const std::string>(std::move(content));
+
+	auto *body = new std::string(std::move(content));
+	if(mlock(body->data(), body->size()) < 0) {
+		failed = true;
+		return std::shared_ptr<const std::string>(body);
+	}
+	return std::shared_ptr<const std::string>(body, [](const std::string *body) {
+		munlock(body->data(), body->size());
+		delete body;
+	});
+}
+
+static unsigned crawler_threads(const ManifestOptions &options) {
+	if(options.threads)
+		return options.threads;
+	return std::max(1u, std::min(8u, std::thread::hardware_concurrency()));
+}
+
+// path of dir's index.html, empty if there is none
+template<typename Map>
+static std::string index_of(const Map &assets, const std::string &dir) {
+	auto index = join(dir, "index.html");
+	auto it = assets.find(index);
+	return it != assets.end() && !it->second->directory ? index : std::string();
+}
+
+// some ancestor of path is in paths as well
+static bool covered(const std::set<std::string> &paths, const std::string &path) {
+	if(path.empty())
+		return false;
+	if(paths.count(""))
+		return true;
+	for(auto pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1))
+		if(paths.count(path.substr(0, pos)))
+			return true;
+	return false;
+}
+
+static std::shared_ptr<Asset> make_asset(const std::string &root, const std::string &path,
+		const struct stat &st) {
+	auto asset = std::make_shared<Asset>();
+	asset->path = path;
+	asset->fullpath = path.empty() ? root : root + "/" + path;
+	asset->directory = S_ISDIR(st.st_mode);
+	asset->size = asset->directory ? 0 : st.st_size;
+	asset->mtime = st.st_mtim;
+	asset->pending = false;
+
+	if(!asset->directory) {
+		auto type = mime_type_of(path);
+		if(!type.empty())
+			asset->header["Content-Type"] = type.str();
+		asset->header["Content-Length"] = std::to_string(asset->size);
+	}
+	return asset;
+}
+
+// entries of one directory; subdirectories are queued for another pass
+static void scan(const std::string &root, const std::string &dir,
+		std::vector<std::shared_ptr<Asset>> &found, std::vector<std::string> &subdirs) {
+	auto fullpath = dir.empty() ? root : root + "/" + dir;
+	int dirfd = open(fullpath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if(dirfd < 0)
+		return;
+
+	DIR *dp = fdopendir(dirfd);
+	if(!dp) {
+		close(dirfd);
+		return;
+	}
+
+	while(auto *entry = readdir(dp)) {
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		// symlinks are left out, like File does with lstat()
+		struct stat st;
+		if(fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+			continue;
+		if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+			continue;
+
+		auto path = join(dir, entry->d_name);
+		found.push_back(make_asset(root, path, st));
+		if(S_ISDIR(st.st_mode))
+			subdirs.push_back(std::move(path));
+	}
+	closedir(dp);
+}
+
+// everything below start; directories go to whichever thread is free,
+// so wide and deep trees both spread out
+static void crawl(const std::string &root, const std::string &start, AssetMap &assets,
+		unsigned nthreads) {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::vector<std::string> pending { start };
+	size_t busy = 0;
+
+	auto worker = [&] {
+		std::vector<std::shared_ptr<Asset>> found;
+		std::vector<std::string> subdirs;
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while(1) {
+			cv.wait(lock, [&] { return !pending.empty() || busy == 0; });
+			if(pending.empty())
+				break;
+
+			auto dir = std::move(pending.back());
+			pending.pop_back();
+			busy++;
+			lock.unlock();
+
+			subdirs.clear();
+			scan(root, dir, found, subdirs);
+
+			lock.lock();
+			busy--;
+			for(auto &subdir : subdirs)
+				pending.push_back(std::move(subdir));
+			cv.notify_all();
+		}
+
+		for(auto &asset : found)
+			assets.emplace(asset->path, std::move(asset));
+	};
+
+	std::vector<std::thread> threads;
+	for(unsigned i = 1; i < nthreads; i++)
+		threads.emplace_back(worker);
+	worker();
+	for(auto &thread : threads)
+		thread.join();
+}
+
+// "GET /path?query HTTP/1.1" in common/combined log lines, or a bare path per line
+static std::unordered_map<std::string, size_t> read_access_log(const std::string &filename) {
+	std::unordered_map<std::string, size_t> hits;
+	std::ifstream ifs(filename);
+	if(!ifs) {
+		wlog("cannot open access log %\n", filename);
+		return hits;
+	}
+
+	std::string line;
+	while(std::getline(ifs, line)) {
+		size_t begin;
+		auto quote = line.find('"');
+		if(quote != std::string::npos) {
+			begin = line.find(' ', quote);
+			if(begin == std::string::npos) continue;
+			begin++;
+		} else {
+			begin = line.find('/');
+			if(begin == std::string::npos) continue;
+		}
+
+		auto end = line.find_first_of(" ?\"", begin);
+		if(end == std::string::npos) end = line.size();
+		while(begin < end && line[begin] == '/') begin++;
+		hits[line.substr(begin, end - begin)]++;
+	}
+	return hits;
+}
+
+static bool read_file(const std::string &filename, size_t size, std::string &content) {
+	int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if(fd < 0)
+		return false;
+
+	content.resize(size);
+	size_t done = 0;
+	while(done < size) {
+		auto num = read(fd, &content[done], size - done);
+		if(num <= 0) break;
+		done += num;
+	}
+	close(fd);
+	content.resize(done);
+	return done == size;
+}
+
+static size_t preload(AssetMap &assets, const ManifestOptions &options, unsigned nthreads) {
+	std::unordered_map<std::string, size_t> hits;
+	if(!options.access_log.empty())
+		hits = read_access_log(options.access_log);
+
+	// a request for a directory is a request for its index
+	for(auto &kv : assets) {
+		auto &asset = *kv.second;
+		auto it = hits.find(asset.path);
+		if(asset.directory && !asset.index.empty() && it != hits.end())
+			hits[asset.index] += it->second;
+	}
+
+	auto hits_of = [&hits](const Asset &asset) -> size_t {
+		auto it = hits.find(asset.path);
+		return it == hits.end() ? 0 : it->second;
+	};
+
+	std::vector<Asset *> candidates;
+	for(auto &kv : assets) {
+		auto &asset = *kv.second;
+		if(!asset.directory && asset.size <= options.preload_max_file)
+			candidates.push_back(&asset);
+	}
+
+	// hottest first, then the small files that make up most requests
+	std::sort(candidates.begin(), candidates.end(), [&](Asset *a, Asset *b) {
+		auto ha = hits_of(*a), hb = hits_of(*b);
+		return ha != hb ? ha > hb : a->size < b->size;
+	});
+
+	std::vector<Asset *> chosen;
+	size_t budget = options.preload_bytes;
+	for(auto *asset : candidates) {
+		if(asset->size > budget) continue;
+		budget -= asset->size;
+		chosen.push_back(asset);
+	}
+
+	std::atomic<size_t> next(0), loaded(0);
+	std::atomic<bool> lock_failed(false);
+	auto worker = [&] {
+		for(size_t i; (i = next++) < chosen.size(); ) {
+			auto *asset = chosen[i];
+			std::string content;
+			if(!read_file(asset->fullpath, asset->size, content))
+				continue;
+
+			bool failed = false;
+			loaded += content.size();
+			asset->content = keep_content(std::move(content), options.lock, failed);
+			if(failed)
+				lock_failed = true;
+		}
+	};
+
+	std::vector<std::thread> threads;
+	for(unsigned i = 1; i < nthreads; i++)
+		threads.emplace_back(worker);
+	worker();
+	for(auto &thread : threads)
+		thread.join();
+
+	if(lock_failed)
+		wlog("mlock failed for some preloaded files, check RLIMIT_MEMLOCK\n");
+	return loaded;
+}
+
+
+Manifest::Manifest(const std::string &root) :
+	root(root),
+	assets(),
+	preloaded(0)
+{
+}
+
+std::shared_ptr<const Manifest> Manifest::build(const std::string &root,
+		const ManifestOptions &options) {
+	auto start = std::chrono::steady_clock::now();
+
+	auto dir = trim_root(root);
+	std::shared_ptr<Manifest> manifest(new Manifest(dir));
+
+	struct stat st;
+	if(stat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode)) {
+		wlog("work directory % is not a directory\n", dir);
+		return manifest;
+	}
+
+	unsigned nthreads = crawler_threads(options);
+
+	AssetMap assets;
+	assets.emplace("", make_asset(dir, "", st));
+	crawl(dir, "", assets, nthreads);
+
+	for(auto &kv : assets) {
+		if(kv.second->directory)
+			kv.second->index = index_of(assets, kv.first);
+	}
+
+	if(options.preload_bytes)
+		manifest->preloaded = preload(assets, options, nthreads);
+
+	manifest->assets.reserve(assets.size());
+	for(auto &kv : assets)
+		manifest->assets.emplace(kv.first, std::move(kv.second));
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+			std::chrono::steady_clock::now() - start).count();
+	wlog("manifest of %: % entries in % ms, % bytes preloaded\n",
+		dir, manifest->assets.size(), elapsed, manifest->preloaded);
+	return manifest;
+}
+
+AssetPtr Manifest::find(std::string_view path) const {
+	auto it = assets.find(normalize_path(path));
+	if(it == assets.end())
+		return nullptr;
+
+	auto &asset = it->second;
+	if(asset->directory && !asset->index.empty()) {
+		auto index = assets.find(asset->index);
+		if(index != assets.end())
+			return index->second;
+	}
+	return asset;
+}
+
+bool Manifest::is_directory(std::string_view path) const {
+	auto it = assets.find(normalize_path(path));
+	return it != assets.end() && it->second->directory;
+}
+
+std::shared_ptr<const Manifest> Manifest::update(const std::vector<std::string> &changed,
+		const std::vector<std::string> &writing, const ManifestOptions &options) const {
+	std::set<std::string> rescan;
+	for(auto &path : changed)
+		rescan.insert(normalize_path(path));
+	for(auto it = rescan.begin(); it != rescan.end(); )
+		it = covered(rescan, *it) ? rescan.erase(it) : std::next(it);
+
+	std::shared_ptr<Manifest> manifest(new Manifest(root));
+	manifest->assets.reserve(assets.size());
+	for(auto &kv : assets) {
+		if(rescan.count(kv.first) || covered(rescan, kv.first))
+			continue;
+		manifest->assets.insert(kv);
+		if(kv.second->content)
+			manifest->preloaded += kv.second->content->size();
+	}
+
+	AssetMap found;
+	for(auto &path : rescan) {
+		auto fullpath = path.empty() ? root : root + "/" + path;
+		struct stat st;
+		if(lstat(fullpath.c_str(), &st) < 0)
+			continue;
+		if(!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode))
+			continue;
+		found.emplace(path, make_asset(root, path, st));
+		if(S_ISDIR(st.st_mode))
+			crawl(root, path, found, crawler_threads(options));
+	}
+
+	for(auto &kv : found) {
+		auto &asset = *kv.second;
+		if(asset.directory)
+			continue;
+
+		// bodies of untouched files stay, changed ones are read again while the budget lasts
+		auto old = assets.find(kv.first);
+		if(old != assets.end() && old->second->content && old->second->size == asset.size
+				&& old->second->mtime.tv_sec == asset.mtime.tv_sec
+				&& old->second->mtime.tv_nsec == asset.mtime.tv_nsec) {
+			asset.content = old->second->content;
+		} else if(options.preload_bytes && asset.size <= options.preload_max_file
+				&& manifest->preloaded + asset.size <= options.preload_bytes) {
+			std::string content;
+			bool failed = false;
+			if(read_file(asset.fullpath, asset.size, content))
+				asset.content = keep_content(std::move(content), options.lock, failed);
+		}
+		if(asset.content)
+			manifest->preloaded += asset.content->size();
+	}
+
+	for(auto &kv : found)
+		manifest->assets[kv.first] = std::move(kv.second);
+
+	// a preloaded body is whole even while the file is rewritten
+	for(auto &path : writing) {
+		auto it = manifest->assets.find(normalize_path(path));
+		if(it == manifest->assets.end() || it->second->directory || it->second->content
+				|| it->second->pending)
+			continue;
+		auto asset = std::make_shared<Asset>(*it->second);
+		asset->pending = true;
+		it->second = std::move(asset);
+	}
+
+	for(auto &kv : manifest->assets) {
+		if(!kv.second->directory)
+			continue;
+		auto index = index_of(manifest->assets, kv.first);
+		if(index == kv.second->index)
+			continue;
+		auto asset = std::make_shared<Asset>(*kv.second);
+		asset->index = std::move(index);
+		kv.second = std::move(asset);
+	}
+	return manifest;
+}
+
+
+// what changes an entry; IN_MODIFY only tells that a write has begun
+static constexpr uint32_t watch_mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO
+	| IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF
+	| IN_ONLYDIR | IN_DONT_FOLLOW;
+
+// how long events are collected before a new snapshot is published
+static constexpr int settle_ms = 20;
+// a file written to but never closed (mmap, a writer that keeps it open) is
+// published as it is once it has been quiet this long
+static constexpr int write_quiet_ms = 3000;
+
+LiveManifest::LiveManifest(const std::string &root, const ManifestOptions &options, bool watch) :
+	root(trim_root(root)),
+	options(options),
+	current(),
+	inotifyfd(-1),
+	stopfd(-1),
+	watches(),
+	watcher()
+{
+	if(watch) {
+		inotifyfd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+		stopfd = eventfd(0, EFD_CLOEXEC);
+		if(inotifyfd < 0 || stopfd < 0) {
+			wlog("inotify unavailable (%), the manifest will not follow changes\n", strerror(errno));
+			if(inotifyfd >= 0) close(inotifyfd);
+			if(stopfd >= 0) close(stopfd);
+			inotifyfd = stopfd = -1;
+		} else {
+			// watches first, so nothing created during the crawl goes unseen
+			watch_tree("");
+		}
+	}
+
+	current = Manifest::build(this->root, options);
+
+	if(inotifyfd >= 0)
+		watcher = std::thread([this] { run(); });
+}
+
+LiveManifest::~LiveManifest() {
+	if(watcher.joinable()) {
+		uint64_t one = 1;
+		if(write(stopfd, &one, sizeof one) < 0)
+			wlog("fail to stop the manifest watcher\n");
+		watcher.join();
+	}
+	if(inotifyfd >= 0) close(inotifyfd);
+	if(stopfd >= 0) close(stopfd);
+}
+
+void LiveManifest::watch_tree(const std::string &dir) {
+	auto fullpath = dir.empty() ? root : root + "/" + dir;
+	int wd = inotify_add_watch(inotifyfd, fullpath.c_str(), watch_mask);
+	if(wd < 0) {
+		if(errno == ENOSPC)
+			wlog("out of inotify watches, changes below % are not followed\n", fullpath);
+		return;
+	}
+	watches[wd] = dir;
+
+	DIR *dp = opendir(fullpath.c_str());
+	if(!dp)
+		return;
+	while(auto *entry = readdir(dp)) {
+		if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+			continue;
+		bool is_dir = entry->d_type == DT_DIR;
+		if(entry->d_type == DT_UNKNOWN) {
+			struct stat st;
+			is_dir = fstatat(dirfd(dp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+				&& S_ISDIR(st.st_mode);
+		}
+		if(is_dir)
+			watch_tree(join(dir, entry->d_name));
+	}
+	closedir(dp);
+}
+
+// the directory moved or went away; its new place, if any, is watched anew
+void LiveManifest::unwatch_tree(const std::string &dir) {
+	for(auto it = watches.begin(); it != watches.end(); ) {
+		auto &path = it->second;
+		if(path == dir || (path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0
+				&& path[dir.size()] == '/')) {
+			inotify_rm_watch(inotifyfd, it->first);
+			it = watches.erase(it);
+		} else {
+			++it;
+		}
+	}
+}
+
+void LiveManifest::run() {
+	using clock = std::chrono::steady_clock;
+
+	std::set<std::string> changed;   // to rescan with the next snapshot
+	// open for writing, not to be published yet; by the last IN_MODIFY
+	std::map<std::string, clock::time_point> writing;
+	bool dirty = false;
+	clock::time_point publish_at;
+
+	alignas(struct inotify_event) char buf[64 * 1024];
+
+	while(1) {
+		auto wake_at = clock::time_point::max();
+		if(dirty)
+			wake_at = publish_at;
+		for(auto &kv : writing)
+			wake_at = std::min(wake_at, kv.second + std::chrono::milliseconds(write_quiet_ms));
+
+		int timeout = -1;
+		if(wake_at != clock::time_point::max()) {
+			auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+					wake_at - clock::now()).count();
+			timeout = std::max<long>(0, left);
+		}
+
+		struct pollfd fds[2] = { { inotifyfd, POLLIN, 0 }, { stopfd, POLLIN, 0 } };
+		if(poll(fds, 2, timeout) < 0 && errno != EINTR) {
+			wlog("manifest watcher: poll failed (%)\n", strerror(errno));
+			return;
+		}
+		if(fds[1].revents)
+			return;
+
+		bool touched = false;
+		for(ssize_t len; (len = read(inotifyfd, buf, sizeof buf)) > 0; ) {
+			for(char *ptr = buf; ptr < buf + len; ) {
+				auto *event = reinterpret_cast<struct inotify_event *>(ptr);
+				ptr += sizeof(struct inotify_event) + event->len;
+
+				if(event->mask & IN_Q_OVERFLOW) {
+					wlog("inotify queue overflow, rescanning %\n", root);
+					changed.insert("");
+					touched = true;
+					continue;
+				}
+
+				auto wit = watches.find(event->wd);
+				if(event->mask & IN_IGNORED) {
+					if(wit != watches.end())
+						watches.erase(wit);
+					continue;
+				}
+				if(wit == watches.end())
+					continue;
+
+				if(event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+					// the parent reports the others
+					if(wit->second.empty()) {
+						wlog("work directory % moved or removed\n", root);
+						changed.insert("");
+						touched = true;
+					}
+					continue;
+				}
+
+				auto path = event->len ? join(wit->second, event->name) : wit->second;
+				bool is_dir = event->mask & IN_ISDIR;
+
+				if(event->mask & IN_MODIFY) {
+					auto result = writing.emplace(path, clock::now());
+					result.first->second = clock::now();
+					touched |= result.second;
+				} else if(event->mask & IN_CREATE) {
+					// files appear once written, see IN_CLOSE_WRITE
+					if(is_dir) {
+						changed.insert(path);
+						touched = true;
+					}
+				} else if(event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+					if(is_dir)
+						unwatch_tree(path);
+					writing.erase(path);
+					changed.insert(path);
+					touched = true;
+				} else if(event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+					writing.erase(path);
+					changed.insert(path);
+					touched = true;
+				} else if(event->mask & IN_ATTRIB) {
+					changed.insert(path);
+					touched = true;
+				}
+			}
+		}
+
+		// no IN_CLOSE_WRITE is coming, take the file as it is now
+		auto quiet_since = clock::now() - std::chrono::milliseconds(write_quiet_ms);
+		for(auto it = writing.begin(); it != writing.end(); ) {
+			if(it->second > quiet_since) {
+				++it;
+				continue;
+			}
+			changed.insert(it->first);
+			it = writing.erase(it);
+			touched = true;
+		}
+
+		if(touched && !dirty) {
+			dirty = true;
+			publish_at = clock::now() + std::chrono::milliseconds(settle_ms);
+		}
+		if(!dirty || clock::now() < publish_at)
+			continue;
+
+		std::vector<std::string> rescan, unsettled;
+		for(auto &kv : writing)
+			unsettled.push_back(kv.first);
+		for(auto &path : changed) {
+			if(writing.count(path))
+				continue;
+			// new or moved directories are watched before they are scanned
+			struct stat st;
+			auto fullpath = path.empty() ? root : root + "/" + path;
+			if(lstat(fullpath.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+				unwatch_tree(path);
+				watch_tree(path);
+			}
+			rescan.push_back(path);
+		}
+
+		auto manifest = current.load()->update(rescan, unsettled, options);
+		wlog("manifest of % updated: % paths rescanned, % entries\n",
+			root, rescan.size(), manifest->size());
+		current = std::move(manifest);
+
+		changed.clear();
+		dirty = false;
+	}
+}
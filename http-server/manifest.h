@@ -0,0 +1,114 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <sys/types.h>
+#include <time.h>
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+
+// what the manifest knows about one file or directory below its root
+struct Asset {
+	std::string path;        // relative to the root, no leading '/'
+	std::string fullpath;
+	bool directory;
+	size_t size;
+	struct timespec mtime;
+	bool pending;            // a write is in progress, only the preloaded copy is whole
+
+	std::string index;       // directories: path of their index.html, empty if none
+	std::map<std::string, std::string> header;      // Content-Type, Content-Length
+	std::shared_ptr<const std::string> content;     // preloaded body, or null
+};
+
+using AssetPtr = std::shared_ptr<const Asset>;
+
+// "/a//b/" -> "a/b", the form paths are looked up in
+std::string normalize_path(std::string_view path);
+
+struct ManifestOptions {
+	unsigned threads = 0;                  // crawler threads, 0 for one per core (at most 8)
+	size_t preload_bytes = 0;              // file contents kept in memory, in total
+	size_t preload_max_file = 1024 * 1024; // larger files are always read from disk
+	bool lock = false;                     // mlock preloaded contents
+	std::string access_log;                // paths hit most in it are preloaded first
+};
+
+/* Immutable snapshot of a directory tree. Requests look their path up in a
+ * hash map instead of stat()ing the disk, and find the content type, header
+ * and possibly the body itself ready to use. Changes produce a new snapshot
+ * with update(), see LiveManifest.
+ */
+class Manifest {
+	std::string root;
+	std::unordered_map<std::string, AssetPtr> assets;
+	size_t preloaded;
+
+	Manifest(const std::string &root);
+
+public:
+	static std::shared_ptr<const Manifest> build(const std::string &root,
+			const ManifestOptions &options = ManifestOptions());
+
+	// path relative to the root; a directory resolves to its index file
+	AssetPtr find(std::string_view path) const;
+	bool is_directory(std::string_view path) const;
+
+	/* a copy with `changed` (and everything below them) read again from
+	 * disk and the files in `writing` marked pending; unchanged entries and
+	 * their preloaded bodies are shared with this snapshot
+	 */
+	std::shared_ptr<const Manifest> update(const std::vector<std::string> &changed,
+			const std::vector<std::string> &writing, const ManifestOptions &options) const;
+
+	const std::string &directory() const { return root; }
+	const std::unordered_map<std::string, AssetPtr> &entries() const { return assets; }
+	size_t size() const { return assets.size(); }
+	size_t preloaded_bytes() const { return preloaded; }
+};
+
+/* The current manifest of a directory, kept in step with the disk by an
+ * inotify watch on every directory below it. A background thread collects
+ * events for a moment and publishes a new snapshot with only the affected
+ * entries rescanned, so readers never stat() and never block.
+ *
+ * A file shows up (or changes) once it is closed after writing or renamed
+ * into place; while it is open for writing the old entry stays, marked
+ * pending, or until no write has come for a few seconds. Directories that
+ * move get their watches moved with them.
+ */
+class LiveManifest {
+	std::string root;
+	ManifestOptions options;
+	std::atomic<std::shared_ptr<const Manifest>> current;
+
+	int inotifyfd;
+	int stopfd;
+	// watch descriptor -> directory relative to root, watcher thread only
+	std::unordered_map<int, std::string> watches;
+	std::thread watcher;
+
+	void watch_tree(const std::string &dir);
+	void unwatch_tree(const std::string &dir);
+	void run();
+
+public:
+	// watch=false gives a snapshot that never changes
+	LiveManifest(const std::string &root, const ManifestOptions &options, bool watch = true);
+	~LiveManifest();
+
+	LiveManifest(const LiveManifest &) = delete;
+	LiveManifest& operator= (const LiveManifest &) = delete;
+
+	std::shared_ptr<const Manifest> get() const { return current.load(); }
+};
+
+
+#endif
@@ -0,0 +1,149 @@
+#include "mime.h"
+#include "perfect_hash.h"
+
+
+// suffixes are matched ignoring case, "JPG" is a jpeg as well
+static constexpr auto mime_types = make_perfect_map<std::string_view, CaseInsensitiveKey>({
+	// text
+	{ "html",  "text/html" },
+	{ "htm",   "text/html" },
+	{ "shtml", "text/html" },
+	{ "css",   "text/css" },
+	{ "js",    "text/javascript" },
+	{ "mjs",   "text/javascript" },
+	{ "txt",   "text/plain" },
+	{ "text",  "text/plain" },
+	{ "log",   "text/plain" },
+	{ "md",    "text/markdown" },
+	{ "markdown", "text/markdown" },
+	{ "csv",   "text/csv" },
+	{ "tsv",   "text/tab-separated-values" },
+	{ "xml",   "text/xml" },
+	{ "ics",   "text/calendar" },
+	{ "vtt",   "text/vtt" },
+	{ "jad",   "text/vnd.sun.j2me.app-descriptor" },
+	{ "wml",   "text/vnd.wap.wml" },
+	{ "htc",   "text/x-component" },
+	{ "mml",   "text/mathml" },
+
+	// images
+	{ "png",   "image/png" },
+	{ "jpg",   "image/jpeg" },
+	{ "jpeg",  "image/jpeg" },
+	{ "jfif",  "image/jpeg" },
+	{ "gif",   "image/gif" },
+	{ "ico",   "image/x-icon" },
+	{ "cur",   "image/x-icon" },
+	{ "svg",   "image/svg+xml" },
+	{ "svgz",  "image/svg+xml" },
+	{ "webp",  "image/webp" },
+	{ "avif",  "image/avif" },
+	{ "apng",  "image/apng" },
+	{ "bmp",   "image/bmp" },
+	{ "tif",   "image/tiff" },
+	{ "tiff",  "image/tiff" },
+	{ "heic",  "image/heic" },
+	{ "heif",  "image/heif" },
+	{ "jxl",   "image/jxl" },
+	{ "wbmp",  "image/vnd.wap.wbmp" },
+	{ "jng",   "image/x-jng" },
+
+	// fonts
+	{ "woff",  "font/woff" },
+	{ "woff2", "font/woff2" },
+	{ "ttf",   "font/ttf" },
+	{ "otf",   "font/otf" },
+	{ "eot",   "application/vnd.ms-fontobject" },
+
+	// audio
+	{ "mp3",   "audio/mpeg" },
+	{ "ogg",   "audio/ogg" },
+	{ "oga",   "audio/ogg" },
+	{ "opus",  "audio/ogg" },
+	{ "wav",   "audio/wav" },
+	{ "flac",  "audio/flac" },
+	{ "aac",   "audio/aac" },
+	{ "m4a",   "audio/mp4" },
+	{ "mid",   "audio/midi" },
+	{ "midi",  "audio/midi" },
+	{ "weba",  "audio/webm" },
+
+	// video
+	{ "mp4",   "video/mp4" },
+	{ "m4v",   "video/mp4" },
+	{ "webm",  "video/webm" },
+	{ "ogv",   "video/ogg" },
+	{ "mov",   "video/quicktime" },
+	{ "avi",   "video/x-msvideo" },
+	{ "wmv",   "video/x-ms-wmv" },
+	{ "flv",   "video/x-flv" },
+	{ "mkv",   "video/x-matroska" },
+	{ "mpeg",  "video/mpeg" },
+	{ "mpg",   "video/mpeg" },
+	{ "ts",    "video/mp2t" },
+	{ "3gp",   "video/3gpp" },
+	{ "m3u8",  "application/vnd.apple.mpegurl" },
+
+	// documents and data
+	{ "json",  "application/json" },
+	{ "map",   "application/json" },
+	{ "jsonld", "application/ld+json" },
+	{ "webmanifest", "application/manifest+json" },
+	{ "wasm",  "application/wasm" },
+	{ "pdf",   "application/pdf" },
+	{ "rtf",   "application/rtf" },
+	{ "atom",  "application/atom+xml" },
+	{ "rss",   "application/rss+xml" },
+	{ "xhtml", "application/xhtml+xml" },
+	{ "xslt",  "application/xslt+xml" },
+	{ "doc",   "application/msword" },
+	{ "docx",  "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+	{ "xls",   "application/vnd.ms-excel" },
+	{ "xlsx",  "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+	{ "ppt",   "application/vnd.ms-powerpoint" },
+	{ "pptx",  "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+	{ "odt",   "application/vnd.oasis.opendocument.text" },
+	{ "ods",   "application/vnd.oasis.opendocument.spreadsheet" },
+	{ "odp",   "application/vnd.oasis.opendocument.presentation" },
+	{ "epub",  "application/epub+zip" },
+	{ "kml",   "application/vnd.google-earth.kml+xml" },
+	{ "kmz",   "application/vnd.google-earth.kmz" },
+
+	// archives and binaries
+	{ "zip",   "application/zip" },
+	{ "gz",    "application/gzip" },
+	{ "tgz",   "application/gzip" },
+	{ "bz2",   "application/x-bzip2" },
+	{ "xz",    "application/x-xz" },
+	{ "zst",   "application/zstd" },
+	{ "7z",    "application/x-7z-compressed" },
+	{ "rar",   "application/vnd.rar" },
+	{ "tar",   "application/x-tar" },
+	{ "jar",   "application/java-archive" },
+	{ "apk",   "application/vnd.android.package-archive" },
+	{ "deb",   "application/vnd.debian.binary-package" },
+	{ "rpm",   "application/x-redhat-package-manager" },
+	{ "iso",   "application/x-iso9660-image" },
+	{ "dmg",   "application/x-apple-diskimage" },
+	{ "exe",   "application/octet-stream" },
+	{ "dll",   "application/octet-stream" },
+	{ "bin",   "application/octet-stream" },
+	{ "swf",   "application/x-shockwave-flash" },
+	{ "crt",   "application/x-x509-ca-cert" },
+	{ "pem",   "application/x-x509-ca-cert" },
+});
+
+StringRef mime_type(StringRef suffix) {
+	auto *type = mime_types.find(suffix);
+	return type ? StringRef(*type) : StringRef();
+}
+
+StringRef mime_type_of(StringRef path) {
+	for(auto i = path.size(); i > 0; i--) {
+		if(path[i - 1] == '/')
+			break;
+		if(path[i - 1] == '.')
+			return mime_type(path.substr(i));
+	}
+	return StringRef();
+}
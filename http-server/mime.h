@@ -0,0 +1,13 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include "StringRef.h"
+
+
+// MIME type for a file suffix ("html", any case), empty if unknown
+StringRef mime_type(StringRef suffix);
+// MIME type for the suffix of a path, looked up in place
+StringRef mime_type_of(StringRef path);
+
+
+#endif
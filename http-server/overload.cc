@@ -0,0 +1,62 @@
+#include <algorithm>
+
+#include "overload.h"
+#include "debug.h"
+
+
+OverloadController::OverloadController(std::chrono::milliseconds target,
+		std::chrono::milliseconds interval, size_t max_in_flight) :
+	mutex(),
+	target(target),
+	interval(interval),
+	max_in_flight(max_in_flight),
+	interval_end(clock::now() + interval),
+	min_delay(clock::duration::max()),
+	overloaded(false),
+	in_flight(0),
+	refused(0)
+{
+}
+
+void OverloadController::configure(std::chrono::milliseconds target, size_t max_in_flight) {
+	std::lock_guard<std::mutex> lock(mutex);
+	this->target = target;
+	this->max_in_flight = max_in_flight;
+}
+
+bool OverloadController::admit(clock::duration delay, bool measured) {
+	auto now = clock::now();
+	bool accept;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(now >= interval_end) {
+			// an interval without requests has no queue either
+			bool standing = min_delay != clock::duration::max() && min_delay > target;
+			if(standing != overloaded) {
+				if(standing)
+					wlog("overloaded, queueing delay % ms\n",
+						std::chrono::duration_cast<std::chrono::milliseconds>(min_delay).count());
+				else
+					wlog("overload over, % requests refused so far\n", refused.load());
+			}
+			overloaded = standing;
+			min_delay = clock::duration::max();
+			interval_end = now + interval;
+		}
+		if(measured)
+			min_delay = std::min(min_delay, delay);
+
+		// counted in the same step as the check, so admits racing each other stay under the cap
+		accept = delay <= (overloaded ? target : interval) && in_flight < max_in_flight;
+		if(accept)
+			in_flight++;
+	}
+
+	if(!accept)
+		refused++;
+	return accept;
+}
+
+void OverloadController::finished() {
+	in_flight--;
+}
@@ -0,0 +1,65 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+
+/* Admission control for new requests, after CoDel: what matters is how long
+ * a request sat in the worker queue before anyone looked at it. While the
+ * smallest delay seen in an interval stays below target the queue drains
+ * on its own, and only requests that waited a whole interval are refused.
+ * Once even the best case of an interval exceeds target the queue is
+ * standing, and anything that waited longer than target is refused until
+ * it drains again. Refusing early keeps the latency of admitted requests
+ * bounded instead of letting every request slow down together.
+ *
+ * A cap on requests in flight (admitted and not yet finished, including
+ * suspended handlers) bounds the work the server has taken on.
+ */
+class OverloadController {
+public:
+	using clock = std::chrono::steady_clock;
+
+private:
+	std::mutex mutex;
+	clock::duration target;
+	clock::duration interval;
+	size_t max_in_flight;
+
+	clock::time_point interval_end;
+	clock::duration min_delay;      // lowest queueing delay seen in this interval
+	std::atomic<bool> overloaded;
+
+	std::atomic<size_t> in_flight;
+	std::atomic<size_t> refused;
+
+public:
+	OverloadController(std::chrono::milliseconds target = std::chrono::milliseconds(5),
+			std::chrono::milliseconds interval = std::chrono::milliseconds(100),
+			size_t max_in_flight = 4096);
+
+	OverloadController(const OverloadController &) = delete;
+	OverloadController& operator= (const OverloadController &) = delete;
+
+	void configure(std::chrono::milliseconds target, size_t max_in_flight);
+
+	/* a worker picked up a new request that waited `delay` in the queue;
+	 * true admits it and counts it in flight until finished(). A request
+	 * that never went through the queue (pipelined, an HTTP/2 stream) is
+	 * not measured: it is held to the limits without counting as a delay
+	 * of zero, which would hide a standing queue.
+	 */
+	bool admit(clock::duration delay, bool measured = true);
+	void finished();
+
+	// the last interval ended with a standing queue
+	bool is_overloaded() const { return overloaded; }
+	size_t requests_in_flight() const { return in_flight; }
+	size_t requests_refused() const { return refused; }
+};
+
+
+#endif
@@ -0,0 +1,189 @@
+#ifndef PERFECT_HASH_H
+#define PERFECT_HASH_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
+
+
+// key comparison as given
+struct ExactKey {
+	static constexpr char fold(char c) { return c; }
+};
+
+// ASCII case-insensitive, as HTTP wants for header names, methods aside
+struct CaseInsensitiveKey {
+	static constexpr char fold(char c) { return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c; }
+};
+
+/* Perfect hash over a fixed set of N keys, built by the compiler when the
+ * table is declared constexpr (hash and displace): keys are split into
+ * buckets by one hash, then every bucket, largest first, searches for a
+ * seed that sends all of its keys to free slots. A lookup costs two
+ * hashes and one key comparison, and never allocates.
+ */
+template<size_t N, class Key = ExactKey>
+class PerfectHash {
+public:
+	static constexpr size_t bucket_count = N / 2 + 1;
+	static constexpr size_t table_size = [] {
+		size_t size = 4;
+		while(size < N + N / 4)
+			size *= 2;
+		return size;
+	}();
+
+private:
+	std::array<std::string_view, N> keys;
+	std::array<uint32_t, bucket_count> seeds;
+	std::array<uint32_t, table_size> slots;   // key + 1, 0 empty
+
+public:
+	static constexpr uint64_t hash(std::string_view key, uint64_t seed) {
+		uint64_t h = 14695981039346656037ull ^ (seed * 0x9e3779b97f4a7c15ull);
+		for(char c : key) {
+			h ^= (unsigned char)Key::fold(c);
+			h *= 1099511628211ull;
+		}
+		// FNV alone mixes the high bits poorly
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdull;
+		h ^= h >> 33;
+		return h;
+	}
+
+	static constexpr bool equal(std::string_view a, std::string_view b) {
+		if(a.size() != b.size())
+			return false;
+		for(size_t i = 0; i < a.size(); i++)
+			if(Key::fold(a[i]) != Key::fold(b[i]))
+				return false;
+		return true;
+	}
+
+	constexpr PerfectHash(const std::array<std::string_view, N> &keys) :
+		keys(keys),
+		seeds(),
+		slots()
+	{
+		// keys grouped by bucket, with a counting sort
+		std::array<uint32_t, bucket_count + 1> start {};
+		std::array<uint32_t, N> bucket_of {}, order {};
+		for(size_t i = 0; i < N; i++) {
+			bucket_of[i] = hash(keys[i], 0) % bucket_count;
+			start[bucket_of[i] + 1]++;
+		}
+		for(size_t b = 0; b < bucket_count; b++)
+			start[b + 1] += start[b];
+		auto fill = start;
+		for(size_t i = 0; i < N; i++)
+			order[fill[bucket_of[i]]++] = i;
+
+		// by size, largest first; sizes are small, so counting sort again
+		constexpr size_t max_bucket = 64;
+		std::array<uint32_t, max_bucket + 2> by_size {};
+		for(size_t b = 0; b < bucket_count; b++) {
+			auto size = start[b + 1] - start[b];
+			if(size > max_bucket)
+				throw std::logic_error("perfect hash bucket overflow");
+			by_size[max_bucket - size + 1]++;
+		}
+		for(size_t i = 0; i <= max_bucket; i++)
+			by_size[i + 1] += by_size[i];
+		std::array<uint32_t, bucket_count> buckets {};
+		for(size_t b = 0; b < bucket_count; b++)
+			buckets[by_size[max_bucket - (start[b + 1] - start[b])]++] = b;
+
+		for(auto b : buckets) {
+			if(start[b] == start[b + 1])
+				break;
+			for(uint32_t seed = 1; ; seed++) {
+				// a bucket that never fits holds the same key twice
+				if(seed == (1u << 20))
+					throw std::logic_error("duplicate key in perfect hash");
+
+				std::array<size_t, max_bucket> taken {};
+				size_t count = 0;
+				for(auto k = start[b]; k < start[b + 1]; k++) {
+					auto slot = hash(keys[order[k]], seed) & (table_size - 1);
+					bool clash = slots[slot] != 0;
+					for(size_t t = 0; t < count; t++)
+						clash |= taken[t] == slot;
+					if(clash)
+						break;
+					taken[count++] = slot;
+				}
+				if(count != start[b + 1] - start[b])
+					continue;
+
+				for(size_t t = 0; t < count; t++)
+					slots[taken[t]] = order[start[b] + t] + 1;
+				seeds[b] = seed;
+				break;
+			}
+		}
+	}
+
+	// position of key among those the table was built from, -1 if absent
+	constexpr int find(std::string_view key) const {
+		if constexpr (N == 0)
+			return -1;
+		auto seed = seeds[hash(key, 0) % bucket_count];
+		auto slot = slots[hash(key, seed) & (table_size - 1)];
+		if(slot == 0 || !equal(keys[slot - 1], key))
+			return -1;
+		return slot - 1;
+	}
+
+	static constexpr size_t size() { return N; }
+};
+
+// key -> value over a PerfectHash, see make_perfect_map
+template<class Value, size_t N, class Key = ExactKey>
+class PerfectMap {
+public:
+	using entry_t = std::pair<std::string_view, Value>;
+
+private:
+	std::array<entry_t, N> entries;
+	PerfectHash<N, Key> index;
+
+	static constexpr std::array<std::string_view, N> keys_of(const std::array<entry_t, N> &entries) {
+		std::array<std::string_view, N> keys {};
+		for(size_t i = 0; i < N; i++)
+			keys[i] = entries[i].first;
+		return keys;
+	}
+
+public:
+	constexpr PerfectMap(const std::array<entry_t, N> &entries) :
+		entries(entries),
+		index(keys_of(entries))
+	{
+	}
+
+	// nullptr if absent
+	constexpr const Value *find(std::string_view key) const {
+		int i = index.find(key);
+		return i < 0 ? nullptr : &entries[i].second;
+	}
+
+	constexpr const std::array<entry_t, N> &items() const { return entries; }
+	static constexpr size_t size() { return N; }
+};
+
+// constexpr auto map = make_perfect_map<int>({ { "one", 1 }, { "two", 2 } });
+template<class Value, class Key = ExactKey, size_t N>
+constexpr PerfectMap<Value, N, Key> make_perfect_map(
+		const std::pair<std::string_view, Value> (&entries)[N]) {
+	std::array<std::pair<std::string_view, Value>, N> array {};
+	for(size_t i = 0; i < N; i++)
+		array[i] = entries[i];
+	return PerfectMap<Value, N, Key>(array);
+}
+
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+/* Fixed-size blocks carved out of slabs, for objects that come and go by
+ * the thousand. A freed block goes on a free list and is the next one
+ * handed out, so a steady number of objects settles on the same slabs
+ * instead of scattering small allocations over the heap. Slabs stay until
+ * the pool goes.
+ */
+class SlabPool {
+	struct FreeBlock {
+		FreeBlock *next;
+	};
+
+	std::mutex mutex;
+	size_t block_size;
+	size_t blocks_per_slab;
+	FreeBlock *free_list;
+	std::vector<std::unique_ptr<std::byte[]>> slabs;
+	size_t in_use;
+
+	void grow() {
+		slabs.emplace_back(new std::byte[block_size * blocks_per_slab]);
+		auto *slab = slabs.back().get();
+		// in address order, so consecutive objects share cache lines and pages
+		for(size_t i = blocks_per_slab; i-- > 0; ) {
+			auto *block = reinterpret_cast<FreeBlock *>(slab + i * block_size);
+			block->next = free_list;
+			free_list = block;
+		}
+	}
+
+public:
+	SlabPool(size_t size, size_t blocks_per_slab = 256) :
+		mutex(),
+		// whole max_align_t units, so every block is aligned like new would
+		block_size((std::max(size, sizeof(FreeBlock)) + alignof(std::max_align_t) - 1)
+			/ alignof(std::max_align_t) * alignof(std::max_align_t)),
+		blocks_per_slab(blocks_per_slab),
+		free_list(nullptr),
+		slabs(),
+		in_use(0)
+	{
+	}
+
+	SlabPool(const SlabPool &) = delete;
+	SlabPool& operator= (const SlabPool &) = delete;
+
+	void *allocate() {
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!free_list)
+			grow();
+		auto *block = free_list;
+		free_list = block->next;
+		in_use++;
+		return block;
+	}
+
+	void deallocate(void *p) {
+		std::lock_guard<std::mutex> lock(mutex);
+		auto *block = static_cast<FreeBlock *>(p);
+		block->next = free_list;
+		free_list = block;
+		in_use--;
+	}
+
+	size_t block() const { return block_size; }
+	size_t used() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return in_use;
+	}
+	// bytes held in slabs, used or not
+	size_t reserved() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return slabs.size() * blocks_per_slab * block_size;
+	}
+};
+
+/* I/O buffers in three size classes, shared by every connection: a stream
+ * borrows one while it has data in flight and gives it back when drained,
+ * so idle connections hold none.
+ */
+class BufferPool {
+public:
+	static constexpr size_t small = 4 * 1024;
+	static constexpr size_t medium = 16 * 1024;
+	static constexpr size_t large = 64 * 1024;
+
+	// a buffer of the smallest class holding size bytes (large at most); size becomes its capacity
+	static char *take(size_t &size) {
+		size = size <= small ? small : size <= medium ? medium : large;
+		return static_cast<char *>(pool_for(size).allocate());
+	}
+	static void give(char *buf, size_t size) {
+		pool_for(size).deallocate(buf);
+	}
+
+private:
+	static SlabPool &pool_for(size_t size) {
+		// 64KB or 128KB per slab
+		static SlabPool pools[] = { SlabPool(small, 16), SlabPool(medium, 8), SlabPool(large, 2) };
+		return pools[size == small ? 0 : size == medium ? 1 : 2];
+	}
+};
+
+
+#endif
@@ -1,125 +1,100 @@
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
 #include <string.h>
 #include <time.h>
 #include <signal.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <map>
 #include <cctype>
 #include <algorithm>
 #include <memory>
+#include <fstream>
+#include <cstdio>
 
 #include "debug.h"
 #include "server.h"
 #include "helper.h"
 #include "threadpool.h"
-
-std::set<int> TCPServer::opened_servfds;
-
-const std::map<std::string, std::string> HTTPResponse::filetype = {
-	{"html","text/html"},
-	{"css" ,"text/css"},
-	{"js"  ,"application/js"},
-	{"json","application/json"},
-	{"jpg" ,"image/jpg"},
-	{"jpeg","image/jpeg"},
-	{"png" ,"image/png"},
-	{"ico" ,"image/ico"},
-	{"gif" ,"image/gif"},
-};
-
-
-TCPServer::TCPServer(int port) :
-	port(port),
-	servfd(-1)
+#include "eventloop.h"
+#include "async.h"
+#include "http2.h"
+#include "websocket.h"
+#include "eventstream.h"
+#include "tls.h"
+#include "mime.h"
+
+TCPServer::TCPServer() :
+	listeners()
 {
-	init_servfd();
 }
 
-
-TCPServer::~TCPServer() {
-	if(servfd > 0) {
-		wlog("close server fd %\n", servfd);
-		opened_servfds.erase(servfd);
-		close(servfd);
-	}
+TCPServer::TCPServer(int port, const SocketOptions &options) :
+	listeners()
+{
+	add_listener(std::to_string(port), options);
 }
 
-void TCPServer::init_servfd() {
-	servfd = socket(AF_INET, SOCK_STREAM, 0);
-	if(servfd < 0) {
-		wloge("Create Server Socket Failed!\n");
-	}
-
-	// set REUSEADDR
-	int flag = 1;
-	setsockopt(servfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-
-	// create sockaddr
-	struct sockaddr_in servaddr;
-	memset(&servaddr, 0, sizeof(servaddr));
-	servaddr.sin_family = AF_INET;
-	servaddr.sin_port = htons(port);
-	servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-
-	if(bind(servfd, (struct sockaddr *)&servaddr, sizeof(servaddr)) == -1) {
-		wloge("Can not bind to port %!\n", port);
-	}
-
-	// FIXME:
-	if(listen(servfd, 50) == -1) {
-		wloge("fail to listen on socket.\n");
-	}
-
-	opened_servfds.insert(servfd);
+HTTPServer::~HTTPServer() {
 }
 
+void TCPServer::add_listener(const std::string &address, const SocketOptions &options) {
+	listeners.emplace_back(address, options);
+}
 
-void TCPServer::init_servfd(int port) {
-	// re-init
-	this->~TCPServer();
-	this->port = port;
-	init_servfd();
+void TCPServer::adopt_inherited() {
+	for(int fd; (fd = Listener::take_inherited()) >= 0; )
+		listeners.emplace_back(fd);
 }
 
 void TCPServer::shutdown() {
-	for(auto fd : opened_servfds) {
-		wlog("close fd %\n", fd);
-		close(fd);
-	}
-
-	opened_servfds.clear();
+	Listener::close_all();
 }
 
 TCPStream TCPServer::accept_client() {
-	struct sockaddr_in client_addr;
-	socklen_t length = sizeof(client_addr);
-	int conn = accept(servfd, (struct sockaddr*)&client_addr, &length);
-	wlog("connected by %:%, conn:%\n", inet_ntoa(client_addr.sin_addr), client_addr.sin_port, conn);
+	int servfd = listeners.empty() ? -1 : listeners.front().fd();
+	int conn = accept4(servfd, nullptr, nullptr, SOCK_CLOEXEC);
 	if(conn < 0) {
-		wloge("fail to accept client.\n");
+		// an empty stream, false in a condition
+		wlog("fail to accept client: %\n", strerror(errno));
+		return TCPStream(conn);
 	}
+	wlog("connected, conn:%\n", conn);
 
 	return TCPStream(conn);
 }
 
-HTTPRequest::HTTPRequest(std::istream &iss) :
+const HTTPLimits HTTPRequest::default_limits;
+
+HTTPRequest::HTTPRequest(std::istream &iss, const HTTPLimits &limits,
+		std::pmr::memory_resource *arena) :
+	arena(arena),
 	_method(GET),
-	_path(),
-	_get(),
-	_post(),
-	_header(),
-	_cookie(),
-	_body(),
-	novalue(),
-	iss(iss)
+	_path(arena),
+	_version(arena),
+	_complete(false),
+	_get(arena),
+	_post(arena),
+	_post_parsed(false),
+	_known_header(HEADER_COUNT, arena),
+	_header(arena),
+	_cookie(arena),
+	novalue(arena),
+	iss(iss),
+	_body(iss),
+	limits(limits)
 {
 	parse_firstline();
 	parse_header();
+	parse_cookie();
 	parse_body();
 
 	/* output some debug info */
@@ -130,6 +105,10 @@ HTTPRequest::HTTPRequest(std::istream &iss) :
 	}
 	oss << "\n";
 
+	for(int i = 0; i < HEADER_COUNT; i++) {
+		if(!_known_header[i].empty())
+			oss << header_name(HTTPHeader(i)).str() << ": " << _known_header[i] << "\n";
+	}
 	for(auto &kvpair : _header) {
 		oss << kvpair.first << ": " << kvpair.second << "\n";
 	}
@@ -138,16 +117,9 @@ HTTPRequest::HTTPRequest(std::istream &iss) :
 }
 
 void HTTPRequest::parse_method() {
-	std::string method_s;
+	std::pmr::string method_s(arena);
 	peek_word(iss, method_s);
-	for(auto &ch : method_s) ch = std::toupper(ch);
-
-	static std::map<std::string, HTTPMethod> conversion {
-		{"GET", GET},
-		{"POST", POST},
-	};
-	_method = conversion[method_s];
-
+	_method = find_method(method_s);
 }
 
 void HTTPRequest::parse_path() {
@@ -162,33 +134,34 @@ void HTTPRequest::parse_get_arguments() {
 	if(iss.peek() != '?') return;
 	iss.ignore();
 
-	while(iss.good()) {
-		std::string key, value;
-		peek_until(iss, key, "=& \t\r\n"_n);
-		if(std::isspace(iss.peek()))
-			break;
-
-		if(iss.peek() == '=') {
-			iss.ignore();
-			peek_until(iss, value, "& \t\r\n"_n);
-		}
+	std::pmr::string query(arena);
+	peek_until(iss, query, " \t\r\n"_n);
+	_get.parse(StringRef(query.data(), query.size()));
+}
 
-		if(iss.peek() == '&')
-			iss.ignore();
+void HTTPRequest::parse_post_arguments() {
+	_post_parsed = true;
 
-		_get[std::move(key)] = value;
+	std::pmr::string type(header(HEADER_CONTENT_TYPE), arena);
+	for(auto &ch : type) ch = std::tolower(ch);
+	if(type.compare(0, 33, "application/x-www-form-urlencoded") != 0)
+		return;
 
-		if(std::isspace(iss.peek()))
-			break;
-	}
+	// bounded by max_body_size, an oversized form reads as empty
+	auto body = _body.readall();
+	_post.parse(StringRef(body.data(), body.size()));
 }
 
+// the line end is left for parse_header, it may be followed by an empty line
 void HTTPRequest::parse_version() {
-	ignore_until(iss, "\r\n"_n);
-	ignore_while(iss, "\r\n"_n);
+	ignore_blank(iss);
+	peek_until(iss, _version, " \t\r\n"_n);
+	ignore_blank(iss);
 }
 
 void HTTPRequest::parse_firstline() {
+	// a client may send empty lines between keep-alive requests
+	ignore_space(iss);
 	parse_method();
 	parse_path();
 	parse_get_arguments();
@@ -197,7 +170,7 @@ void HTTPRequest::parse_firstline() {
 
 void HTTPRequest::parse_header_oneline() {
 	while(iss.good()) {
-		std::string key, value;
+		std::pmr::string key(arena), value(arena);
 		peek_until(iss, key, ":\r\n"_n);
 
 		strip(key); // erase spaces
@@ -211,7 +184,13 @@ void HTTPRequest::parse_header_oneline() {
 			peek_until(iss, value, "\r\n"_n);
 		}
 
-		_header[std::move(key)] = value;
+		auto known = find_header(key);
+		if(known != HEADER_COUNT) {
+			_known_header[known] = std::move(value);
+		} else {
+			for(auto &ch : key) ch = std::tolower(ch);
+			_header.insert_or_assign(std::move(key), std::move(value));
+		}
 
 		if(isspace(iss.peek()))
 			break;
@@ -281,106 +260,422 @@ bool HTTPRequest::check_if_end_of_header() {
 }
 
 void HTTPRequest::parse_header() {
-	ignore_while(iss, "\r\n"_n);
 	while(iss.good()) {
-		parse_header_oneline();
-		if(!check_if_end_of_header()) {
-			ignore_while(iss, "\r\n"_n);
-		} else {
+		if(check_if_end_of_header()) {
+			_complete = true;
 			break;
 		}
+		ignore_while(iss, "\r\n"_n);
+		parse_header_oneline();
 	}
 }
 
+// Cookie: name1=value1; name2=value2
 void HTTPRequest::parse_cookie() {
+	StringRef line = header(HEADER_COOKIE);
+
+	while(!line.empty()) {
+		auto end = line.find_first_of(';');
+		auto pair = line.substr(0, end);
+		line = end == StringRef::npos ? StringRef() : line.substr(end + 1);
+
+		auto eq = pair.find_first_of('=');
+		if(eq == StringRef::npos)
+			continue;
+
+		auto name = pair.substr(0, eq), content = pair.substr(eq + 1);
+		std::pmr::string key(name.begin(), name.end(), arena);
+		std::pmr::string value(content.begin(), content.end(), arena);
+		strip(key);
+		strip(value);
+		if(value.size() >= 2 && value.front() == '"' && value.back() == '"')
+			value.assign(value, 1, value.size() - 2);
+
+		// the first occurrence is the most specific one
+		if(!key.empty())
+			_cookie.emplace(std::move(key), std::move(value));
+	}
 }
 
 void HTTPRequest::parse_body() {
 	size_t length = 0;
-	auto key = get("Content-Length");
-	if(key == "") return;
+	auto &value = header(HEADER_CONTENT_LENGTH);
+	if(value != "")
+		std::istringstream(value) >> length;
 
-	std::istringstream(key) >> length;
-	while(length && iss.good()) {
-		_body.push_back(iss.get());
-		length --;
-	}
+	std::pmr::string encoding(header(HEADER_TRANSFER_ENCODING), arena);
+	for(auto &ch : encoding) ch = std::tolower(ch);
+	bool chunked = encoding.find("chunked") != std::string::npos;
+
+	std::pmr::string expect(header(HEADER_EXPECT), arena);
+	for(auto &ch : expect) ch = std::tolower(ch);
+	bool expect_continue = expect == "100-continue";
+
+	_body.init(length, chunked, expect_continue, limits.max_body_size);
+}
+
+bool HTTPRequest::complete() const {
+	return _complete;
+}
+
+bool HTTPRequest::keep_alive() {
+	std::pmr::string connection(header(HEADER_CONNECTION), arena);
+	for(auto &ch : connection) ch = std::tolower(ch);
+	if(_version == "HTTP/1.1")
+		return connection.find("close") == std::string::npos;
+	return connection.find("keep-alive") != std::string::npos;
 }
 
 HTTPMethod HTTPRequest::method() {
 	return _method;
 }
 
-const std::string &HTTPRequest::path() {
+const std::pmr::string &HTTPRequest::path() {
 	return _path;
 }
 
-const std::string &HTTPRequest::get(const std::string &key) {
-	auto it = _get.find(key);
-	return it == _get.end() ? novalue : it->second;
+const std::pmr::string &HTTPRequest::version() {
+	return _version;
 }
 
-const std::string &HTTPRequest::post(const std::string &key) {
-	auto it = _post.find(key);
-	return it == _post.end() ? novalue : it->second;
+const std::pmr::string &HTTPRequest::get(std::string_view key) {
+	auto value = _get.find(key);
+	return value ? *value : novalue;
 }
 
-const std::string &HTTPRequest::header(const std::string &key) {
-	auto it = _header.find(key);
+// the form body is only read once a handler asks for it
+const std::pmr::string &HTTPRequest::post(std::string_view key) {
+	if(!_post_parsed)
+		parse_post_arguments();
+
+	auto value = _post.find(key);
+	return value ? *value : novalue;
+}
+
+const std::pmr::string &HTTPRequest::header(std::string_view key) {
+	auto known = find_header(key);
+	if(known != HEADER_COUNT)
+		return _known_header[known];
+
+	std::pmr::string name(key, arena);
+	for(auto &ch : name) ch = std::tolower(ch);
+	auto it = _header.find(name);
 	return it == _header.end() ? novalue : it->second;
 }
 
+const std::pmr::string &HTTPRequest::cookie(std::string_view key) {
+	auto it = _cookie.find(key);
+	return it == _cookie.end() ? novalue : it->second;
+}
+
+BodyReader &HTTPRequest::body() {
+	return _body;
+}
+
+
+static const char *reason_phrase(int code) {
+	switch(code) {
+		case 200: return "OK";
+		case 204: return "No Content";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 100: return "Continue";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 413: return "Content Too Large";
+		case 426: return "Upgrade Required";
+		case 431: return "Request Header Fields Too Large";
+		case 500: return "Internal Server Error";
+		case 501: return "Not Implemented";
+		case 503: return "Service Unavailable";
+		default:  return "Unknown";
+	}
+}
+
+std::pmr::string HTTPResponse::head(std::pmr::memory_resource *memory, size_t room) const {
+	auto *reason = reason_phrase(_return_code);
+
+	// sized up front, a monotonic arena never gets back what a regrowth drops
+	size_t length = sizeof("HTTP/1.1 000 \r\n") + strlen(reason) + _raw_header.size() + 2;
+	for(auto &kvpair : _header)
+		length += kvpair.first.size() + kvpair.second.size() + 4;
+
+	std::pmr::string s(memory);
+	s.reserve(length + room);
+	char status[16];
+	snprintf(status, sizeof(status), "HTTP/1.1 %03d ", _return_code);
+	s += status;
+	s += reason;
+	s += "\r\n";
+
+	for(auto &kvpair : _header) {
+		s += kvpair.first;
+		s += ": ";
+		s += kvpair.second;
+		s += "\r\n";
+	}
+	s += _raw_header;
+
+	s += "\r\n";
+	return s;
+}
 
 std::ostream &operator<<(std::ostream &os, const HTTPResponse &response) {
-	os << "HTTP/1.1 200 OK\r\n";
+	os << response.head();
 
-	for(auto &kvpair : response._header)
-		os << kvpair.first << ": " << kvpair.second << "\r\n";
+	if(!response._generator) {
+		os << response.content();
+		return os;
+	}
 
-	os << "\r\n";
-	os << response._body;
+	bool chunked = response._header.count("Transfer-Encoding");
+	std::unique_ptr<char[]> buf(new char[HTTPResponse::stream_bufsize]);
+	while(1) {
+		auto n = response._generator(buf.get(), HTTPResponse::stream_bufsize);
+		if(chunked) os << std::hex << n << std::dec << "\r\n";
+		os.write(buf.get(), n);
+		if(chunked) os << "\r\n";
+		if(n == 0) break;
+	}
 	return os;
 }
 
+Task<bool> HTTPResponse::write_to(int conn, std::function<void ()> on_progress,
+		std::pmr::memory_resource *memory, bool head_only) {
+	auto body = _generator || head_only ? std::string_view() : content();
+	// small bodies leave with the header in one send
+	bool together = !_generator && !head_only && body.size() < stream_bufsize;
+	auto s = head(memory, together ? body.size() : 0);
+	auto write = [conn, &on_progress](const char *data, size_t size) -> Task<bool> {
+		if(co_await async::write_all(conn, data, size) < 0)
+			co_return false;
+		if(on_progress)
+			on_progress();
+		co_return true;
+	};
+
+	// the header a GET would get, Content-Length included, and nothing after it
+	if(head_only)
+		co_return co_await write(s.data(), s.size());
+
+	if(!_generator) {
+		if(together) {
+			s += body;
+			co_return co_await write(s.data(), s.size());
+		}
+
+		if(!co_await write(s.data(), s.size()))
+			co_return false;
+		if(_file_fd < 0)
+			co_return co_await write(body.data(), body.size());
+
+		// straight from the page cache, never through user space; in
+		// slices, so a slow but moving client keeps re-arming its deadline
+		constexpr size_t slice = 256 * 1024;
+		for(size_t done = 0; done < body.size(); ) {
+			auto size = std::min(slice, body.size() - done);
+			if(co_await async::send_file(conn, _file_fd, _file_offset + done, size) < 0)
+				co_return false;
+			done += size;
+			if(on_progress)
+				on_progress();
+		}
+		co_return true;
+	}
+
+	if(!co_await write(s.data(), s.size()))
+		co_return false;
+
+	// room for "<hex size>\r\n" in front of the data and "\r\n" after it
+	constexpr size_t prefix = 10;
+	bool chunked = _header.count("Transfer-Encoding");
+	std::unique_ptr<char[]> buf(new char[prefix + stream_bufsize + 2]);
+	char *data = buf.get() + prefix;
+
+	while(1) {
+		auto n = _generator(data, stream_bufsize);
+		char *start = data;
+		size_t length = n;
+
+		if(chunked) {
+			char size_line[prefix + 1];
+			int len = snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+			start -= len;
+			memcpy(start, size_line, len);
+			memcpy(data + n, "\r\n", 2);
+			length += len + 2;
+		}
+
+		if(length && !co_await write(start, length))
+			co_return false;
+		if(n == 0) break;
+	}
+	co_return true;
+}
+
 Callback::Callback(const std::string &key, const callback_t &callback) :
 	group_pattern(key),
-	callback(callback),
-	args()
+	callback([callback](HTTPRequest &, Session &session, CallbackArgs &args) {
+		return adapt(callback, session, args);
+	})
 {
 }
 
-bool Callback::init(const std::string &path) {
-	std::smatch match_results;
-	std::regex_match(path, match_results, group_pattern);
+Callback::Callback(const std::string &key, const async_callback_t &callback) :
+	group_pattern(key),
+	callback([callback](HTTPRequest &, Session &session, CallbackArgs &args) {
+		return callback(session, args);
+	})
+{
+}
+
+Callback::Callback(const std::string &key, const request_callback_t &callback) :
+	group_pattern(key),
+	callback(callback)
+{
+}
+
+// plain callbacks run to completion without suspending
+Task<HTTPResponse> Callback::adapt(callback_t callback, Session &session, CallbackArgs &args) {
+	co_return callback(session, args);
+}
+
+bool Callback::match(std::string_view path, CallbackArgs &args) const {
+	std::pmr::cmatch match_results(args.get_allocator());
+	std::regex_match(path.data(), path.data() + path.size(), match_results, group_pattern);
 	if(match_results.empty()) return false;
 
 	args.clear();
 	for(auto &sub : match_results)
-		args.push_back(sub);
+		args.emplace_back(sub.first, sub.second);
 	return true;
 }
 
-HTTPResponse Callback::operator()(Session &session) {
-	return callback(session, args);
+Task<HTTPResponse> Callback::operator()(HTTPRequest &request, Session &session, CallbackArgs &args) const {
+	return callback(request, session, args);
 }
 
 
 ///   signal handler
-void SignalHandler::sigint_handler(int signum) {
-	wlog("receive keyboard interrupt\n");
-	HTTPServer::shutdown();
-	exit(0);
+SignalHandler::SignalHandler(std::initializer_list<int> signals) :
+	sigfd(-1)
+{
+	// a peer that went away is reported by write(), not by a signal
+	signal(SIGPIPE, SIG_IGN);
+
+	sigset_t mask;
+	sigemptyset(&mask);
+	for(auto signo : signals)
+		sigaddset(&mask, signo);
+
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+	sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if(sigfd < 0) {
+		wloge("fail to create signalfd.\n");
+	}
+}
+
+SignalHandler::~SignalHandler() {
+	close(sigfd);
+}
+
+int SignalHandler::next() {
+	struct signalfd_siginfo info;
+	if(read(sigfd, &info, sizeof(info)) != sizeof(info))
+		return 0;
+	return info.ssi_signo;
+}
+
+
+SlabPool Connection::pool(sizeof(Connection));
+
+Connection::Connection(int conn, ConnectionSet &owner) :
+	ConnectionLink(),
+	fd(conn),
+	requests(0),
+	deadline(),
+	owner(owner),
+	refs(1)
+{
+	std::lock_guard<std::mutex> lock(owner.mutex);
+	prev = &owner.head;
+	next = owner.head.next;
+	next->prev = this;
+	owner.head.next = this;
+	owner.count++;
+}
+
+// leaves the set and disarms its deadline before the fd is closed, so
+// neither shutdown_all nor a late expiry hits the fd's next owner
+Connection::~Connection() {
+	deadline.cancel();
+	{
+		std::lock_guard<std::mutex> lock(owner.mutex);
+		prev->next = next;
+		next->prev = prev;
+		owner.count--;
+	}
+	wlog("close connection from %\n", fd);
+	close(fd);
+}
+
+ConnectionPtr Connection::create(int conn, ConnectionSet &owner) {
+	return ConnectionPtr(new (pool.allocate()) Connection(conn, owner));
+}
+
+ConnectionPtr Connection::share() {
+	refs.fetch_add(1, std::memory_order_relaxed);
+	return ConnectionPtr(this);
 }
 
-void SignalHandler::register_sighandler() {
-	signal(SIGINT, sigint_handler);
+void ConnectionPtr::release() {
+	if(c && c->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+		c->~Connection();
+		Connection::pool.deallocate(c);
+	}
+	c = nullptr;
 }
 
+ConnectionSet::ConnectionSet() :
+	mutex(),
+	head { &head, &head },
+	count(0)
+{
+}
+
+size_t ConnectionSet::size() {
+	std::lock_guard<std::mutex> lock(mutex);
+	return count;
+}
 
-HTTPServer::HTTPServer(int port) :
-	TCPServer(port),
+void ConnectionSet::shutdown_all() {
+	std::lock_guard<std::mutex> lock(mutex);
+	for(auto *link = head.next; link != &head; link = link->next)
+		::shutdown(static_cast<Connection *>(link)->fd, SHUT_RDWR);
+}
+
+
+HTTPServer::HTTPServer() :
+	TCPServer(),
+	signals({SIGINT, SIGTERM, SIGUSR1, SIGUSR2}),
 	sessions(),
-	callbacks()
+	callbacks(),
+	websocket_routes(),
+	event_routes(),
+	directory_lookup(),
+	tls(),
+	io_backend("epoll"),
+	limits(),
+	overload(),
+	loop(nullptr),
+	connections(),
+	parked(),
+	nparked(0),
+	starting(0),
+	draining(false),
+	multiplexed_mutex(),
+	multiplexed(),
+	websockets()
 {
 	auto default_callback = [](Session &session, CallbackArgs &args) -> HTTPResponse {
 		return "<html> 404 </html>";
@@ -389,6 +684,12 @@ HTTPServer::HTTPServer(int port) :
 	register_callback({R"((|.*))", default_callback});
 }
 
+HTTPServer::HTTPServer(int port, const SocketOptions &options) :
+	HTTPServer()
+{
+	add_listener(std::to_string(port), options);
+}
+
 void HTTPServer::shutdown() {
 	TCPServer::shutdown();
 }
@@ -402,17 +703,27 @@ void HTTPServer::register_callbacks(const std::vector<Callback> &cbs) {
 		callbacks.push_back(cb);
 }
 
-Callback &HTTPServer::find_callback(const std::string &path) {
-	auto real_path = path;
+void HTTPServer::register_websocket(const WebSocketRoute &route) {
+	websocket_routes.push_back(route);
+}
+
+void HTTPServer::register_event_stream(const EventStreamRoute &route) {
+	event_routes.push_back(route);
+}
 
-	if(real_path.size() == 0 || File(real_path).is_directory()) {
+const Callback &HTTPServer::find_callback(std::string_view path, CallbackArgs &args) {
+	std::pmr::string real_path(path, args.get_allocator());
+
+	bool directory = directory_lookup ? directory_lookup(real_path)
+		: File(std::string(real_path)).is_directory();
+	if(real_path.size() == 0 || directory) {
 		real_path += "/index.html";
 	}
 
 	for(auto it = callbacks.rbegin();
 			it != callbacks.rend();
 			++it) {
-		if(it->init(real_path)) {
+		if(it->match(real_path, args)) {
 			return *it;
 		}
 	}
@@ -422,29 +733,99 @@ Callback &HTTPServer::find_callback(const std::string &path) {
 HTTPResponse::HTTPResponse() :
 	_return_code(200),
 	_header(),
-	_body()
+	_body(),
+	_owner(),
+	_view(),
+	_raw_header(),
+	_file_fd(-1),
+	_file_offset(0),
+	_generator()
 {
 }
 
 HTTPResponse::HTTPResponse(File &fp) :
 	_return_code(200),
 	_header(),
-	_body()
+	_body(),
+	_owner(),
+	_view(),
+	_raw_header(),
+	_file_fd(-1),
+	_file_offset(0),
+	_generator()
 {
-	auto suffix = fp.file_suffix();
+	auto type = mime_type_of(fp.fullpath());
+	if(!type.empty())
+		_header["Content-Type"] = type.str();
+
+	if(fp.is_file() && fp.size() > stream_threshold) {
+		std::shared_ptr<std::ifstream> ifs(new std::ifstream(fp.fullpath(), std::ios::binary));
+		_generator = [ifs](char *buf, size_t size) -> size_t {
+			ifs->read(buf, size);
+			return ifs->gcount();
+		};
+		_header["Content-Length"] = std::to_string(fp.size());
+		return;
+	}
+
 	_body = fp.readall();
+	_header["Content-Length"] = std::to_string(_body.size());
+}
 
-	auto it = filetype.find(suffix);
-	if(it != filetype.end())
-		_header["Content-Type"] = it->second;
-	
+HTTPResponse::HTTPResponse(const Asset &asset) :
+	_return_code(200),
+	_header(asset.header),
+	_body(),
+	_owner(asset.content),
+	_view(asset.content ? std::string_view(*asset.content) : std::string_view()),
+	_raw_header(),
+	_file_fd(-1),
+	_file_offset(0),
+	_generator()
+{
+	if(_owner || asset.directory)
+		return;
+
+	// the manifest may lag behind a rename; the open file decides the length
+	std::shared_ptr<FILE> fp(fopen(asset.fullpath.c_str(), "rbe"), [](FILE *fp) {
+		if(fp) fclose(fp);
+	});
+	struct stat st;
+	if(!fp || fstat(fileno(fp.get()), &st) < 0) {
+		_return_code = 404;
+		_header.clear();
+		_body = "<html> 404 </html>";
+		_header["Content-Length"] = std::to_string(_body.size());
+		return;
+	}
+
+	size_t size = st.st_size;
+	_header["Content-Length"] = std::to_string(size);
+	if(size > stream_threshold) {
+		// never more than announced, even if the file grows meanwhile
+		_generator = [fp, left = size](char *buf, size_t bufsize) mutable -> size_t {
+			auto num = fread(buf, 1, std::min(bufsize, left), fp.get());
+			left -= num;
+			return num;
+		};
+		return;
+	}
+
+	_body.resize(size);
+	_body.resize(fread(&_body[0], 1, size, fp.get()));
 	_header["Content-Length"] = std::to_string(_body.size());
 }
 
 HTTPResponse::HTTPResponse(const char *body) :
 	_return_code(200),
 	_header(),
-	_body(body)
+	_body(body),
+	_owner(),
+	_view(),
+	_raw_header(),
+	_file_fd(-1),
+	_file_offset(0),
+	_generator()
 {
 	_header["Content-Length"] = std::to_string(_body.size());
 }
@@ -452,7 +833,13 @@ HTTPResponse::HTTPResponse(const char *body) :
 HTTPResponse::HTTPResponse(std::string &&body) :
 	_return_code(200),
 	_header(),
-	_body(std::move(body))
+	_body(std::move(body)),
+	_owner(),
+	_view(),
+	_raw_header(),
+	_file_fd(-1),
+	_file_offset(0),
+	_generator()
 {
 	_header["Content-Length"] = std::to_string(_body.size());
 }
@@ -460,32 +847,728 @@ HTTPResponse::HTTPResponse(std::string &&body) :
 HTTPResponse::HTTPResponse(std::map<std::string, std::string> &&header, std::string &&body) :
 	_return_code(200),
 	_header(),
-	_body(std::move(body))
+	_body(std::move(body)),
+	_owner(),
+	_view(),
+	_raw_header(),
+	_file_fd(-1),
+	_file_offset(0),
+	_generator()
 {
 	for(auto &kvpair : header)
 		_header[std::move(kvpair.first)] = std::move(kvpair.second);
 	_header["Content-Length"] = std::to_string(_body.size());
 }
 
+HTTPResponse::HTTPResponse(std::shared_ptr<const void> owner, std::string_view header,
+		std::string_view body, int fd, off_t offset) :
+	_return_code(200),
+	_header(),
+	_body(),
+	_owner(std::move(owner)),
+	_view(body),
+	_raw_header(header),
+	_file_fd(fd),
+	_file_offset(offset),
+	_generator()
+{
+}
+
+HTTPResponse &HTTPResponse::status(int code) {
+	_return_code = code;
+	return *this;
+}
+
+HTTPResponse::HTTPResponse(generator_t generator) :
+	HTTPResponse({}, std::move(generator))
+{
+}
+
+HTTPResponse::HTTPResponse(std::map<std::string, std::string> &&header, generator_t generator) :
+	_return_code(200),
+	_header(std::move(header)),
+	_body(),
+	_owner(),
+	_view(),
+	_raw_header(),
+	_file_fd(-1),
+	_file_offset(0),
+	_generator(std::move(generator))
+{
+	if(!_header.count("Content-Length"))
+		_header["Transfer-Encoding"] = "chunked";
+}
+
 void HTTPServer::config(const std::string &filename) {
 }
 
-void HTTPServer::run() {
-	SignalHandler::register_sighandler();
-	ThreadPool<10> pool;
+void HTTPServer::use_io_backend(const std::string &backend) {
+	io_backend = backend;
+}
 
-	auto processor = [this](std::shared_ptr<TCPStream> client) {
-		HTTPRequest request(*client);
-		auto &callback = find_callback(request.path());
-		auto response = callback(sessions[""]);
-		(*client) << response;
-	};
+void HTTPServer::set_limits(const HTTPLimits &limits) {
+	this->limits = limits;
+}
+
+void HTTPServer::configure_sessions(std::chrono::seconds ttl, size_t max_bytes) {
+	sessions.configure(ttl, max_bytes);
+}
+
+void HTTPServer::configure_overload(std::chrono::milliseconds target, size_t max_in_flight) {
+	overload.configure(target, max_in_flight);
+}
 
+bool HTTPServer::use_tls(const std::string &cert, const std::string &key, const std::string &ticket_keys) {
+	auto context = std::make_unique<TLSContext>();
+	if(!context->load(cert, key, ticket_keys))
+		return false;
+	tls = std::move(context);
+	return true;
+}
+
+void HTTPServer::use_directory_lookup(std::function<bool (std::string_view path)> lookup) {
+	directory_lookup = std::move(lookup);
+}
+
+// preserialized, refusing a request must cost less than serving it
+static const char overload_response[] =
+	"HTTP/1.1 503 Service Unavailable\r\n"
+	"Retry-After: 1\r\n"
+	"Content-Length: 0\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+void HTTPServer::shed(int conn) {
+	send(conn, overload_response, sizeof(overload_response) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+	// swallow the request that already arrived, so close() sends FIN, not RST
+	char buf[4096];
+	for(int i = 0; i < 4; i++) {
+		if(recv(conn, buf, sizeof(buf), MSG_DONTWAIT) <= 0)
+			break;
+	}
+	::shutdown(conn, SHUT_WR);
+}
+
+void HTTPServer::expire_after(Connection &c, int timeout_ms) {
+	// a worker blocked on the socket sees EOF, a suspended write an error
+	int conn = c.fd;
+	loop->schedule(c.deadline, timeout_ms, [conn] {
+		::shutdown(conn, SHUT_RDWR);
+	});
+}
+
+void HTTPServer::wait_for_request(ConnectionPtr c, int timeout_ms) {
+	int conn = c->fd;
+	expire_after(*c, timeout_ms);
+	if(parked.size() <= size_t(conn))
+		parked.resize(std::max(size_t(conn) + 1, parked.size() * 2));
+	parked[conn] = std::move(c);
+	nparked++;
+
+	// a connection only takes a worker once its request starts arriving
+	loop->watch(conn, IO_READ, [this, conn](uint32_t events) {
+		auto c = std::move(parked[conn]);
+		nparked--;
+
+		loop->cancel(c->deadline);
+		auto queued = OverloadController::clock::now();
+		starting++;
+		async::Executor::current().submit([this, c = std::move(c), queued]() mutable {
+			spawn(handle(std::move(c), queued));
+		});
+	});
+}
+
+Task<void> HTTPServer::handle(ConnectionPtr c, OverloadController::clock::time_point queued) {
+	auto delay = OverloadController::clock::now() - queued;
+	bool measured = true;
+	starting--;
+	// kept only while served, idle connections have neither
+	TCPStream stream(c->fd, false);
+	Arena arena;
 	while(1) {
-		std::shared_ptr<TCPStream> client {
-			new TCPStream { accept_client() }
-		};
-		pool.submitTask(processor, std::move(client));
+		// only new requests are refused, those already running go on
+		if(!overload.admit(delay, measured)) {
+			shed(c->fd);
+			co_return;
+		}
+
+		struct InFlight {
+			OverloadController &controller;
+			~InFlight() { controller.finished(); }
+		} in_flight { overload };
+
+		bool reuse = co_await serve(*c, stream, arena);
+		c->requests++;
+		if(!reuse)
+			co_return;
+
+		// pipelined requests are already buffered, go on with them
+		if(stream.rdbuf()->in_avail() > 0) {
+			// never queued, so nothing to tell about the queue either
+			delay = OverloadController::clock::duration::zero();
+			measured = false;
+			continue;
+		}
+
+		// while draining, dropping c closes it
+		loop->post([this, c = std::move(c)]() mutable {
+			if(!draining)
+				wait_for_request(std::move(c), limits.idle_timeout);
+		});
+		co_return;
 	}
 }
 
+Task<bool> HTTPServer::serve(Connection &c, TCPStream &client, Arena &memory) {
+	int conn = c.fd;
+	// the previous request on this connection is done with, and so is its memory
+	memory.reset();
+	auto *arena = memory.get();
+
+	expire_after(c, limits.header_timeout);
+	client.clear();
+	client.set_read_limit(limits.max_header_size);
+	HTTPRequest request(client, limits, arena);
+	if(client.limit_reached()) {
+		auto response = HTTPResponse("<html> 431 </html>").status(431);
+		response._header["Connection"] = "close";
+		co_await response.write_to(conn);
+		co_return false;
+	}
+	// closed, timed out or not HTTP at all
+	if(!request.complete())
+		co_return false;
+	client.set_read_limit(TCPBuf::unlimited);
+	client.clear();
+
+	// "PRI * HTTP/2.0", the start of the HTTP/2 client preface
+	if(request.method() == UNKNOWN_METHOD && request.path() == "*" && request.version() == "HTTP/2.0")
+		co_return co_await serve_h2(c, client, H2Connection::preface.substr(sizeof("PRI * HTTP/2.0\r\n\r\n") - 1));
+
+	auto &body = request.body();
+	body.attach(conn);
+	body.on_progress([this, &c, &body] {
+		if(body.eof())
+			loop->cancel(c.deadline);
+		else
+			expire_after(c, limits.body_timeout);
+	});
+	if(body.eof() || body.awaiting_continue())
+		loop->cancel(c.deadline);
+	else
+		expire_after(c, limits.body_timeout);
+
+	if(body.too_large()) {
+		// with Expect: 100-continue the client never sends the body
+		auto response = HTTPResponse("<html> 413 </html>").status(413);
+		response._header["Connection"] = "close";
+		co_await response.write_to(conn);
+		// as below, unread input left at the close would reset the response
+		if(!body.drain(limits.max_drain_size))
+			::shutdown(conn, SHUT_WR);
+		co_return false;
+	}
+
+	if(request.method() == UNKNOWN_METHOD) {
+		auto response = HTTPResponse("<html> 501 </html>").status(501);
+		response._header["Connection"] = "close";
+		co_await response.write_to(conn);
+		// as below, unread input left at the close would reset the response
+		if(!body.drain(limits.max_drain_size))
+			::shutdown(conn, SHUT_WR);
+		co_return false;
+	}
+
+	std::pmr::string upgrade(request.header(HEADER_UPGRADE), arena);
+	for(auto &ch : upgrade) ch = std::tolower(ch);
+
+	// Upgrade: websocket, for a path with a WebSocket route
+	if(upgrade.find("websocket") != upgrade.npos) {
+		for(auto &route : websocket_routes) {
+			if(route.match(request.path()))
+				co_return co_await serve_websocket(c, client, request, route);
+		}
+	}
+
+	// a GET on an event stream route subscribes the connection to its topic
+	if(request.method() == GET) {
+		std::string topic;
+		for(auto &route : event_routes) {
+			if(route.match(request.path(), topic))
+				co_return co_await serve_events(c, request, route, std::move(topic));
+		}
+	}
+
+	// Upgrade: h2c, for a request without a body; the answer goes out as HTTP/2
+	auto &http2_settings = request.header(HEADER_HTTP2_SETTINGS);
+	std::string settings;
+	if(upgrade.find("h2c") != upgrade.npos && body.eof() && !draining && !http2_settings.empty()
+			&& H2Connection::decode_settings(http2_settings, settings)) {
+		static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\n"
+			"Connection: Upgrade\r\n"
+			"Upgrade: h2c\r\n"
+			"\r\n";
+		if(co_await async::write_all(conn, switching, sizeof(switching) - 1) < 0)
+			co_return false;
+		co_return co_await serve_h2(c, client, H2Connection::preface, &request, settings);
+	}
+
+	// a handler may take long, and without a body in flight the buffer can go
+	client.release_buffer();
+	auto response = co_await respond(request);
+
+	// HTTP/1.0 knows no chunked coding: the body runs until the connection closes
+	bool close_delimited = request.version() != "HTTP/1.1" && response._header.erase("Transfer-Encoding");
+
+	// under overload, connections are given back instead of kept for later
+	auto connection = response._header.find("Connection");
+	bool keep_alive = !close_delimited && request.keep_alive()
+		&& (connection == response._header.end() || connection->second != "close")
+		&& !overload.is_overloaded() && !draining;
+	if(!keep_alive)
+		response._header["Connection"] = "close";
+	else if(request.version() != "HTTP/1.1")
+		response._header["Connection"] = "keep-alive";
+	else
+		response._header.erase("Connection");
+
+	expire_after(c, limits.write_timeout);
+	bool written = co_await response.write_to(conn, [this, &c] {
+		expire_after(c, limits.write_timeout);
+	}, arena, request.method() == HEAD);
+	loop->cancel(c.deadline);
+	if(!written)
+		co_return false;
+
+	// closing with unread input makes the kernel answer with RST, which
+	// can destroy the response before the client reads it
+	bool drained = body.drain(limits.max_drain_size);
+	loop->cancel(c.deadline);
+	if(!drained) {
+		::shutdown(conn, SHUT_WR);
+		co_return false;
+	}
+	co_return keep_alive;
+}
+
+Task<HTTPResponse> HTTPServer::respond(HTTPRequest &request) {
+	CallbackArgs args(request.memory());
+	auto &callback = find_callback(request.path(), args);
+	// unknown clients get a blank session, stored only once it holds data
+	auto &cookie = request.cookie(SessionStore::cookie_name);
+	auto session = cookie.empty() ? nullptr : sessions.find(std::string(cookie));
+	bool fresh = !session;
+	if(fresh)
+		session = sessions.create();
+
+	auto response = co_await callback(request, *session, args);
+
+	if(fresh && session->is_modified()) {
+		sessions.insert(session);
+		response._header["Set-Cookie"] = std::string(SessionStore::cookie_name)
+			+ "=" + session->id() + "; Path=/; HttpOnly";
+	} else if(!fresh) {
+		sessions.update(session);
+	}
+	co_return response;
+}
+
+Task<bool> HTTPServer::serve_h2(Connection &c, TCPStream &client, std::string_view expect,
+		HTTPRequest *upgraded, std::string_view settings) {
+	// what the client sent after the HTTP/1 request is already frames
+	std::string received;
+	auto buffered = client.rdbuf()->in_avail();
+	if(buffered > 0) {
+		received.resize(buffered);
+		client.read(&received[0], buffered);
+	}
+	client.release_buffer();
+
+	auto on_request = [this](HTTPRequest &request) {
+		return dispatch(request);
+	};
+	auto on_deadline = [this, &c](int timeout_ms) {
+		if(timeout_ms < 0)
+			loop->cancel(c.deadline);
+		else
+			expire_after(c, timeout_ms);
+	};
+	H2Connection h2(c.fd, limits, on_request, on_deadline);
+	{
+		std::lock_guard<std::mutex> lock(multiplexed_mutex);
+		multiplexed.insert(&h2);
+	}
+	// a drain that came first has missed it
+	if(draining)
+		h2.go_away();
+
+	co_await h2.run(std::move(received), expect, upgraded, settings);
+
+	{
+		std::lock_guard<std::mutex> lock(multiplexed_mutex);
+		multiplexed.erase(&h2);
+	}
+	co_return false;
+}
+
+Task<bool> HTTPServer::serve_websocket(Connection &c, TCPStream &client, HTTPRequest &request,
+		const WebSocketRoute &route) {
+	int conn = c.fd;
+	std::pmr::string connection(request.header(HEADER_CONNECTION), request.memory());
+	for(auto &ch : connection) ch = std::tolower(ch);
+	auto &key = request.header(HEADER_SEC_WEBSOCKET_KEY);
+
+	int refused = 0;
+	if(request.method() != GET || request.version() != "HTTP/1.1" || !request.body().eof()
+			|| connection.find("upgrade") == connection.npos || key.size() != 24)
+		refused = 400;
+	else if(request.header(HEADER_SEC_WEBSOCKET_VERSION) != "13")
+		refused = 426;
+	else if(draining)
+		refused = 503;
+	if(refused) {
+		auto response = HTTPResponse("<html> " + std::to_string(refused) + " </html>").status(refused);
+		if(refused == 426)
+			response._header["Sec-WebSocket-Version"] = "13";
+		response._header["Connection"] = "close";
+		co_await response.write_to(conn);
+		co_return false;
+	}
+
+	auto answer = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: " + websocket::accept_key(key) + "\r\n"
+		"\r\n";
+	expire_after(c, limits.write_timeout);
+	bool written = co_await async::write_all(conn, answer.data(), answer.size()) >= 0;
+	loop->cancel(c.deadline);
+	if(!written)
+		co_return false;
+
+	// frames the client sent right behind the handshake
+	std::string received;
+	auto buffered = client.rdbuf()->in_avail();
+	if(buffered > 0) {
+		received.resize(buffered);
+		client.read(&received[0], buffered);
+	}
+	client.release_buffer();
+
+	auto ws = std::make_shared<WebSocket>(c.share(), *loop, route.handler,
+		std::string(request.path()), limits, std::move(received));
+	loop->post([this, ws] {
+		websockets.insert(ws);
+		ws->start([this](const WebSocketPtr &ws) {
+			websockets.erase(ws);
+		});
+		// a drain that came first has missed it
+		if(draining)
+			ws->close(websocket::GOING_AWAY);
+	});
+	co_return false;
+}
+
+Task<bool> HTTPServer::serve_events(Connection &c, HTTPRequest &request, const EventStreamRoute &route,
+		std::string topic) {
+	int conn = c.fd;
+	if(draining) {
+		auto response = HTTPResponse("<html> 503 </html>").status(503);
+		response._header["Retry-After"] = "1";
+		response._header["Connection"] = "close";
+		co_await response.write_to(conn);
+		co_return false;
+	}
+
+	// no length: the stream ends with the connection
+	static const char head[] = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: close\r\n"
+		"\r\n";
+	expire_after(c, limits.write_timeout);
+	bool written = co_await async::write_all(conn, head, sizeof(head) - 1) >= 0;
+	loop->cancel(c.deadline);
+	if(!written)
+		co_return false;
+
+	std::string last_event_id(request.header(HEADER_LAST_EVENT_ID));
+	loop->post([hub = route.hub, c = c.share(), topic = std::move(topic),
+			last_event_id = std::move(last_event_id)]() mutable {
+		hub->subscribe(std::move(c), topic, last_event_id);
+	});
+	co_return false;
+}
+
+Task<HTTPResponse> HTTPServer::dispatch(HTTPRequest &request) {
+	// streams come without a queue of their own to measure
+	if(!overload.admit(OverloadController::clock::duration::zero(), false))
+		co_return HTTPResponse("<html> 503 </html>").status(503);
+
+	struct InFlight {
+		OverloadController &controller;
+		~InFlight() { controller.finished(); }
+	} in_flight { overload };
+
+	if(request.method() == UNKNOWN_METHOD)
+		co_return HTTPResponse("<html> 501 </html>").status(501);
+	co_return co_await respond(request);
+}
+
+void HTTPServer::watch_signals() {
+	loop->watch(signals.fd(), IO_READ, [this](uint32_t events) {
+		for(int signo; (signo = signals.next()) != 0; )
+			on_signal(signo);
+		watch_signals();
+	});
+}
+
+void HTTPServer::on_signal(int signo) {
+	switch(signo) {
+	case SIGINT:
+	case SIGTERM:
+		wlog("receive %, shutting down\n", strsignal(signo));
+		drain();
+		break;
+	case SIGUSR2:
+		// the old process only steps back once the new one runs
+		if(!draining && upgrade())
+			drain();
+		break;
+	case SIGUSR1:
+		report_connections();
+		break;
+	}
+}
+
+void HTTPServer::report_connections() {
+	wlog("% connections, % idle, % websockets; % bytes each while idle, % bytes in connection slabs\n",
+		connections.size(), nparked, websockets.size(), idle_connection_footprint(), Connection::reserved());
+}
+
+size_t HTTPServer::idle_connection_footprint() {
+	// the kernel's socket buffers and the loop's watch come on top
+	return Connection::footprint() + sizeof(ConnectionPtr);
+}
+
+void HTTPServer::drain() {
+	if(draining)
+		return;
+	draining = true;
+
+	// the sockets live on in the upgraded process, if there is one
+	for(auto &listener : listeners)
+		loop->unlisten(listener.fd());
+	TCPServer::shutdown();
+
+	// HTTP/2 connections finish their open streams, then close
+	{
+		std::lock_guard<std::mutex> lock(multiplexed_mutex);
+		for(auto *h2 : multiplexed)
+			h2->go_away();
+	}
+
+	// event streams end now, their clients come back with Last-Event-ID
+	for(auto &route : event_routes)
+		route.hub->detach();
+
+	// WebSockets are told to close, and go once the client agrees
+	for(auto &ws : websockets)
+		ws->close(websocket::GOING_AWAY);
+
+	// idle keep-alive connections go now; fresh ones still get their request
+	for(int conn = 0; conn < int(parked.size()); conn++) {
+		auto &c = parked[conn];
+		if(!c || c->requests == 0)
+			continue;
+		loop->unwatch(conn);
+		loop->cancel(c->deadline);
+		c = ConnectionPtr();
+		nparked--;
+	}
+
+	wlog("draining % connections, % requests in flight\n",
+		connections.size(), overload.requests_in_flight());
+	wait_drained(std::chrono::steady_clock::now()
+		+ std::chrono::milliseconds(limits.drain_timeout), false);
+}
+
+void HTTPServer::wait_drained(std::chrono::steady_clock::time_point deadline, bool forced) {
+	if(overload.requests_in_flight() == 0 && starting == 0 && nparked == 0 && websockets.empty()) {
+		loop->stop();
+		return;
+	}
+
+	if(std::chrono::steady_clock::now() >= deadline) {
+		if(forced) {
+			wlog("% requests did not finish, giving up\n", overload.requests_in_flight());
+			loop->stop();
+			return;
+		}
+		// out of time: fail their I/O and give them a last second to unwind
+		wlog("drain timeout, closing % connections\n", connections.size());
+		connections.shutdown_all();
+		deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+		forced = true;
+	}
+
+	loop->run_after(50, [this, deadline, forced] { wait_drained(deadline, forced); });
+}
+
+// the path of this binary; after a deploy replaced it the link reads "... (deleted)"
+static std::string executable_path() {
+	char path[4096];
+	auto n = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	if(n < 0) return "";
+
+	std::string s(path, n);
+	static const std::string deleted = " (deleted)";
+	if(s.size() > deleted.size() && s.compare(s.size() - deleted.size(), deleted.size(), deleted) == 0)
+		s.resize(s.size() - deleted.size());
+	return s;
+}
+
+bool HTTPServer::upgrade() {
+	// everything the child needs is built before fork(), after it only
+	// async-signal-safe calls are allowed
+	auto path = executable_path();
+	std::ifstream cmdline("/proc/self/cmdline", std::ios::binary);
+	std::vector<std::string> args;
+	for(std::string arg; std::getline(cmdline, arg, '\0'); )
+		args.push_back(arg);
+	if(path.empty() || args.empty()) {
+		wlog("upgrade failed: cannot find own binary\n");
+		return false;
+	}
+
+	// the listening sockets, in the order the new process creates its listeners
+	std::vector<int> servfds;
+	for(auto &listener : listeners)
+		servfds.push_back(listener.fd());
+	int nfds = servfds.size();
+
+	std::vector<std::string> env;
+	for(char **e = environ; *e; e++) {
+		if(strncmp(*e, "LISTEN_FDS=", 11) && strncmp(*e, "LISTEN_PID=", 11))
+			env.push_back(*e);
+	}
+	env.push_back("LISTEN_FDS=" + std::to_string(nfds));
+
+	std::vector<char *> argv, envp;
+	for(auto &arg : args) argv.push_back(&arg[0]);
+	for(auto &var : env) envp.push_back(&var[0]);
+	argv.push_back(nullptr);
+	envp.push_back(nullptr);
+
+	// exec closes the write end; anything read from it is the child's errno
+	int report[2];
+	if(pipe2(report, O_CLOEXEC) < 0) {
+		wlog("upgrade failed: %\n", strerror(errno));
+		return false;
+	}
+
+	long max_fd = sysconf(_SC_OPEN_MAX);
+	pid_t pid = fork();
+	if(pid == 0) {
+		// listening sockets from 3 on (LISTEN_FDS), the report pipe right
+		// after them, nothing else. Everything moves above that range
+		// first, so no dup2() lands on a socket still to be placed.
+		int err = 3 + nfds;
+		for(auto &fd : servfds)
+			fd = fcntl(fd, F_DUPFD_CLOEXEC, err + 1);
+		int report_fd = fcntl(report[1], F_DUPFD_CLOEXEC, err + 1);
+		for(int i = 0; i < nfds; i++)
+			dup2(servfds[i], 3 + i);
+		dup3(report_fd, err, O_CLOEXEC);
+		if(syscall(SYS_close_range, err + 1, ~0U, 0) < 0) {
+			for(long fd = err + 1; fd < max_fd; fd++)
+				close(fd);
+		}
+
+		sigset_t none;
+		sigemptyset(&none);
+		sigprocmask(SIG_SETMASK, &none, nullptr);
+
+		execve(path.c_str(), argv.data(), envp.data());
+		int code = errno;
+		if(write(err, &code, sizeof(code))) {}
+		_exit(127);
+	}
+
+	close(report[1]);
+	if(pid < 0) {
+		close(report[0]);
+		wlog("upgrade failed: %\n", strerror(errno));
+		return false;
+	}
+
+	int code = 0;
+	auto n = read(report[0], &code, sizeof(code));
+	close(report[0]);
+	if(n > 0) {
+		waitpid(pid, nullptr, 0);
+		wlog("upgrade failed: exec %: %\n", path, strerror(code));
+		return false;
+	}
+
+	wlog("upgraded to % (pid %), draining the old process\n", path, pid);
+	return true;
+}
+
+void HTTPServer::run() {
+	ThreadPool<10> pool;
+	ThreadPool<4> blocking_pool;
+
+	auto event_loop = EventLoop::create(io_backend);
+	loop = event_loop.get();
+	wlog("io backend: %, % bytes per idle connection\n", loop->name(), idle_connection_footprint());
+
+	async::Executor executor(*loop,
+		[&pool](async::Executor::task_t task) { pool.submitTask(std::move(task)); },
+		[&pool](async::Executor::task_t task) { pool.submitUrgentTask(std::move(task)); },
+		[&blocking_pool](async::Executor::task_t task) { blocking_pool.submitTask(std::move(task)); });
+
+	adopt_inherited();
+	if(listeners.empty())
+		wloge("no address to listen on\n");
+	for(auto &listener : listeners) {
+		if(!listener.tls()) {
+			loop->listen(listener.fd(), [this](int conn) {
+				wait_for_request(Connection::create(conn, connections), limits.first_byte_timeout);
+			});
+			continue;
+		}
+		if(!tls)
+			wloge("no certificate for %\n", listener.address());
+		// the handshake first, then the connection is like any other
+		loop->listen(listener.fd(), [this](int conn) {
+			tls->accept(*loop, conn, limits.first_byte_timeout, [this](int fd) {
+				// done after the drain started
+				if(draining) {
+					close(fd);
+					return;
+				}
+				wait_for_request(Connection::create(fd, connections), limits.first_byte_timeout);
+			});
+		});
+	}
+	for(auto &route : event_routes)
+		route.hub->attach(*loop);
+	watch_signals();
+
+	loop->run();
+
+	// workers finish what is queued, then nothing touches the loop any more
+	pool.shutdown();
+	blocking_pool.shutdown();
+	// any left over after a forced drain are closed with the loop
+	websockets.clear();
+	if(tls)
+		tls->close_all();
+	for(auto &route : event_routes)
+		route.hub->detach();
+	loop = nullptr;
+	wlog("server stopped\n");
+}
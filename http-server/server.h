@@ -1,79 +1,163 @@
 #ifndef SERVER_H
 #define SERVER_H
 
+#include <sys/types.h>
+
+#include <array>
+#include <atomic>
 #include <functional>
+#include <initializer_list>
 #include <map>
+#include <memory_resource>
+#include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
 #include <regex>
 #include <iostream>
 #include <streambuf>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "arena.h"
+#include "body.h"
 #include "file.h"
+#include "form.h"
+#include "httpnames.h"
+#include "listener.h"
+#include "manifest.h"
+#include "overload.h"
+#include "pool.h"
+#include "session.h"
+#include "task.h"
 #include "tcpstream.h"
+#include "timerwheel.h"
 
 
 class TCPServer {
-	int port;
-	int servfd;
-
-	static std::set<int> opened_servfds;
-private:
-	void init_servfd();
+protected:
+	// all feed the same connections, each tuned on its own
+	std::vector<Listener> listeners;
 
 public:
-	TCPServer(int port=80); // default to be 80 port
-	~TCPServer();
+	TCPServer();
+	TCPServer(int port, const SocketOptions &options=SocketOptions());
+
+	// bind address (see Listener) and listen on it
+	void add_listener(const std::string &address, const SocketOptions &options=SocketOptions());
+	// sockets passed down by the parent that no add_listener() has taken
+	void adopt_inherited();
 
-	void init_servfd(int port);
+	// one blocking accept on the first listener
 	TCPStream accept_client();
 
 	static void shutdown();
 };
 
-enum HTTPMethod { GET, POST, PUT, PATCH };
-
-inline std::ostream &operator<<(std::ostream &os, HTTPMethod method) {
-	switch(method) {
-		case GET:   os << "GET";   break;
-		case POST:  os << "POST";  break;
-		case PUT:   os << "PUT";   break;
-		case PATCH: os << "PATCH"; break;
-		default:    os << "<BAD>"; break;
-	}
-	return os;
-}
-
 class HTTPResponse {
+public:
+	// fill at most `size` bytes of the body into buf, 0 means the end
+	using generator_t = std::function<size_t (char *buf, size_t size)>;
+
+private:
 	int _return_code;
 	std::map<std::string, std::string> _header;
 	std::string _body;
-
-	static const std::map<std::string, std::string> filetype;
+	// body (and header lines) kept alive by _owner, or static; used in place of _body
+	std::shared_ptr<const void> _owner;
+	std::string_view _view;
+	std::string_view _raw_header;
+	// the same bytes as _view at _file_offset in _file_fd, for sendfile()
+	int _file_fd;
+	off_t _file_offset;
+	generator_t _generator;
+
+	// files larger than this are streamed instead of read into _body
+	static constexpr size_t stream_threshold = 64 * 1024;
+	// one chunk, the most a streamed body keeps in memory at a time
+	static constexpr size_t stream_bufsize = 16 * 1024;
+
+	// room: bytes that will be appended to it
+	std::pmr::string head(std::pmr::memory_resource *memory = std::pmr::get_default_resource(),
+			size_t room = 0) const;
+	std::string_view content() const { return _view.data() ? _view : std::string_view(_body); }
 
 	friend class HTTPServer;
+	friend class H2Connection;
 public:
 	HTTPResponse();
 	HTTPResponse(File &fp);
+	/* type from the manifest; the body is the preloaded copy if there is
+	 * one, else whatever file is at the path now, sent whole
+	 */
+	HTTPResponse(const Asset &asset);
 	HTTPResponse(std::string &&body);
 	HTTPResponse(const char *body);
 	HTTPResponse(std::map<std::string, std::string> &&header, std::string &&body);
 
+	/* Body borrowed from memory that owner keeps alive (a cache, a mapped
+	 * file; null for static data), behind ready-made "Name: value\r\n"
+	 * header lines. If fd is
+	 * given the body is also found at offset in it, and large ones leave
+	 * with sendfile().
+	 */
+	HTTPResponse(std::shared_ptr<const void> owner, std::string_view header,
+			std::string_view body, int fd = -1, off_t offset = 0);
+
+	/* Streamed body, pulled from the generator while the socket accepts
+	 * data. Sent with Transfer-Encoding: chunked unless the header
+	 * already carries a Content-Length.
+	 */
+	HTTPResponse(generator_t generator);
+	HTTPResponse(std::map<std::string, std::string> &&header, generator_t generator);
+
+	HTTPResponse &status(int code);
+
+	// send the whole response, suspending while the socket is full;
+	// on_progress runs after every completed write, the head is built in memory;
+	// head_only (a HEAD request) sends the header alone
+	Task<bool> write_to(int conn, std::function<void ()> on_progress = {},
+			std::pmr::memory_resource *memory = std::pmr::get_default_resource(),
+			bool head_only = false);
+
 	friend std::ostream &operator<<(std::ostream &os, const HTTPResponse &response);
 };
 
+struct HTTPLimits {
+	size_t max_header_size = 16 * 1024;        // answered with 431
+	size_t max_body_size   = 1024 * 1024;      // answered with 413
+	size_t max_drain_size  = 256 * 1024;       // unread body skipped before close
+
+	// milliseconds, a connection that runs over is shut down
+	int first_byte_timeout = 10 * 1000;        // accept until the request starts
+	int header_timeout     = 10 * 1000;        // the rest of the header
+	int body_timeout       = 30 * 1000;        // between two reads of the body
+	int write_timeout      = 30 * 1000;        // between two writes of the response
+	int idle_timeout       = 60 * 1000;        // keep-alive wait for the next request
+	int drain_timeout      = 30 * 1000;        // SIGTERM until requests are cut off
+};
+
 class HTTPRequest {
+	// everything parsed out of the request lives here
+	std::pmr::memory_resource *arena;
 	HTTPMethod _method;
-	std::string _path;
-	std::map<std::string, std::string> _get;
-	std::map<std::string, std::string> _post;
-	std::map<std::string, std::string> _header;
-	std::map<std::string, std::string> _cookie;
-	std::string _body;
-
-	const std::string novalue;
+	std::pmr::string _path;
+	std::pmr::string _version;
+	bool _complete;
+	FormData _get;
+	FormData _post;
+	bool _post_parsed;
+	// well-known headers by HTTPHeader, the others by lower-case name
+	std::pmr::vector<std::pmr::string> _known_header;
+	std::pmr::map<std::pmr::string, std::pmr::string, std::less<>> _header;
+	std::pmr::map<std::pmr::string, std::pmr::string, std::less<>> _cookie;
+
+	const std::pmr::string novalue;
 
 	std::istream &iss;
+	BodyReader _body;
+	const HTTPLimits &limits;
 private:
 
 	void parse_method();
@@ -87,62 +171,285 @@ private:
 	void parse_body();
 
 	void parse_cookie();
+	void parse_post_arguments();
 
 public:
-	HTTPRequest(std::istream &iss);
+	static const HTTPLimits default_limits;
+
+	/* parses the request line and header, the body is left in the stream;
+	 * arena must outlast the request, see Arena
+	 */
+	HTTPRequest(std::istream &iss, const HTTPLimits &limits = default_limits,
+			std::pmr::memory_resource *arena = std::pmr::get_default_resource());
+
+	// false if the connection ended before the blank line closing the header
+	bool complete() const;
+	// whether the client lets the connection be reused afterwards
+	bool keep_alive();
 
 	HTTPMethod method();
-	const std::string &path();
-	const std::string &get(const std::string &key);
-	const std::string &post(const std::string &key);
-	const std::string &header(const std::string &key);
-	const std::string &cookie(const std::string &key);
+	const std::pmr::string &path();
+	const std::pmr::string &version();
+	const std::pmr::string &get(std::string_view key);
+	const std::pmr::string &post(std::string_view key);
+	// any case, as header names are
+	const std::pmr::string &header(std::string_view key);
+	const std::pmr::string &header(HTTPHeader key) const { return _known_header[key]; }
+	const std::pmr::string &cookie(std::string_view key);
+	BodyReader &body();
+	// where the request lives, and whatever else belongs to it
+	std::pmr::memory_resource *memory() const { return arena; }
 };
 
-using Session = decltype(0); // hasn't been implemented
-
-using CallbackArgs = std::vector<std::string>;
+// route captures, in the request arena like the request itself
+using CallbackArgs = std::pmr::vector<std::pmr::string>;
 class Callback {
 	using callback_t = std::function<HTTPResponse (Session &, CallbackArgs &)>;
+	using async_callback_t = std::function<Task<HTTPResponse> (Session &, CallbackArgs &)>;
+	// full form, for handlers that need the request itself (header, body)
+	using request_callback_t = std::function<Task<HTTPResponse> (HTTPRequest &, Session &, CallbackArgs &)>;
 
 	std::regex group_pattern;
-	callback_t callback;
-	std::vector<std::string> args;
+	request_callback_t callback;
+
+	static Task<HTTPResponse> adapt(callback_t callback, Session &session, CallbackArgs &args);
 public:
 	Callback(const std::string &key, const callback_t &callback);
+	Callback(const std::string &key, const async_callback_t &callback);
+	Callback(const std::string &key, const request_callback_t &callback);
 
-	bool init(const std::string &path);
-	HTTPResponse operator()(Session &session);
+	// fill args with the regex groups if path matches
+	bool match(std::string_view path, CallbackArgs &args) const;
+	Task<HTTPResponse> operator()(HTTPRequest &request, Session &session, CallbackArgs &args) const;
 };
 
 
+/* Blocks the given signals and delivers them through a signalfd, so the
+ * event loop handles them like any other event instead of running code in
+ * signal context. Threads inherit the blocked mask, so this has to exist
+ * before any thread is started.
+ */
 class SignalHandler {
-	static bool _int_bit;
+	int sigfd;
+public:
+	SignalHandler(std::initializer_list<int> signals);
+	~SignalHandler();
+
+	SignalHandler(const SignalHandler &) = delete;
+	SignalHandler& operator= (const SignalHandler &) = delete;
+
+	int fd() const { return sigfd; }
+	// next pending signal, 0 if there is none
+	int next();
+};
+
+class EventLoop;
+class ConnectionSet;
+class H2Connection;
+class WebSocket;
+struct WebSocketRoute;
+struct EventStreamRoute;
+class TLSContext;
+
+class ConnectionPtr;
+
+struct ConnectionLink {
+	ConnectionLink *prev;
+	ConnectionLink *next;
+};
+
+/* An accepted client, passed between the loop (while idle) and the
+ * workers. Only what an idle connection needs lives here, in one block of
+ * a slab pool; the stream, its buffer and the request arena exist while a
+ * worker serves it (see HTTPServer::handle). Closes the socket when the
+ * last ConnectionPtr goes.
+ */
+struct Connection : private ConnectionLink {
+	int fd;
+	unsigned requests;   // served so far
+	TimerNode deadline;  // whichever timeout applies at the moment
+	ConnectionSet &owner;
+
+private:
+	std::atomic<unsigned> refs;
+	static SlabPool pool;
+
+	Connection(int conn, ConnectionSet &owner);
+	~Connection();
+
+	friend class ConnectionPtr;
+	friend class ConnectionSet;
 public:
-	static void sigint_handler(int);
-	static void register_sighandler();
+	Connection(const Connection &) = delete;
+	Connection& operator= (const Connection &) = delete;
+
+	static ConnectionPtr create(int conn, ConnectionSet &owner);
+	// one more owner, for whatever takes the connection over from its worker
+	ConnectionPtr share();
+	// bytes one connection takes from the pool
+	static size_t footprint() { return pool.block(); }
+	// bytes in pool slabs, connections or free blocks
+	static size_t reserved() { return pool.reserved(); }
+};
+
+// shared ownership of a Connection, an intrusive count instead of a control block
+class ConnectionPtr {
+	Connection *c;
+
+	void release();
+public:
+	ConnectionPtr() : c(nullptr) {}
+	explicit ConnectionPtr(Connection *c) : c(c) {}
+	ConnectionPtr(const ConnectionPtr &that) : c(that.c) {
+		if(c) c->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+	ConnectionPtr(ConnectionPtr &&that) noexcept : c(that.c) { that.c = nullptr; }
+	~ConnectionPtr() { release(); }
+
+	ConnectionPtr& operator= (ConnectionPtr that) {
+		std::swap(c, that.c);
+		return *this;
+	}
+
+	Connection *operator->() const { return c; }
+	Connection &operator*() const { return *c; }
+	explicit operator bool() const { return c != nullptr; }
+};
+
+// every open connection, so a drain can reach the busy ones as well
+class ConnectionSet {
+	std::mutex mutex;
+	ConnectionLink head;  // of a circular list, through every Connection
+	size_t count;
+
+	friend struct Connection;
+public:
+	ConnectionSet();
+
+	ConnectionSet(const ConnectionSet &) = delete;
+	ConnectionSet& operator= (const ConnectionSet &) = delete;
+
+	size_t size();
+	// blocked reads and writes on every connection fail right away
+	void shutdown_all();
 };
 
 class HTTPServer : private TCPServer {
-	// session ID
-	std::map<std::string, Session> sessions;
+	// first, so every thread started by later members inherits the mask
+	SignalHandler signals;
+	// session ID -> Session, looked up through the SESSIONID cookie
+	SessionStore sessions;
 	std::vector<Callback> callbacks;
-
+	std::vector<WebSocketRoute> websocket_routes;
+	std::vector<EventStreamRoute> event_routes;
+	// which request paths are directories; empty: ask the disk
+	std::function<bool (std::string_view path)> directory_lookup;
+	// for the tls: listeners
+	std::unique_ptr<TLSContext> tls;
+
+	std::string io_backend;
+	HTTPLimits limits;
+	OverloadController overload;
+	EventLoop *loop;  // while run() is active
+
+	ConnectionSet connections;
+	// loop thread only: connections waiting for their next request, by fd
+	std::vector<ConnectionPtr> parked;
+	size_t nparked;
+	std::atomic<size_t> starting;  // handed to the workers, not yet admitted
+	std::atomic<bool> draining;
+	// HTTP/2 connections, told to go away by a drain
+	std::mutex multiplexed_mutex;
+	std::set<H2Connection *> multiplexed;
+	// loop thread only: accepted WebSockets, until they finish
+	std::unordered_set<std::shared_ptr<WebSocket>> websockets;
 
 private:
-	Callback &find_callback(const std::string &path);
+	// the captures are allocated with the allocator of args
+	const Callback &find_callback(std::string_view path, CallbackArgs &args);
+
+	// shut the connection down unless re-armed or cancelled within timeout_ms
+	void expire_after(Connection &c, int timeout_ms);
+	// loop thread: park c until its next request starts arriving
+	void wait_for_request(ConnectionPtr c, int timeout_ms);
+	// queued: when the loop handed c to the workers
+	Task<void> handle(ConnectionPtr c, OverloadController::clock::time_point queued);
+	// refuse the request on conn with a canned 503, then close
+	static void shed(int conn);
+
+	void watch_signals();
+	void on_signal(int signo);
+	// SIGUSR1: connection count and memory, to the log
+	void report_connections();
+	// stop accepting, close idle connections and let busy ones finish
+	void drain();
+	void wait_drained(std::chrono::steady_clock::time_point deadline, bool forced);
+	// exec a new copy of the binary that inherits the listening sockets
+	bool upgrade();
+	// one request, true if the connection can carry another
+	Task<bool> serve(Connection &c, TCPStream &client, Arena &memory);
+	// the handler's response to request, with its session
+	Task<HTTPResponse> respond(HTTPRequest &request);
+	/* the rest of the connection as HTTP/2, once expect (the rest of the
+	 * client preface) arrives; see H2Connection::run
+	 */
+	Task<bool> serve_h2(Connection &c, TCPStream &client, std::string_view expect,
+			HTTPRequest *upgraded = nullptr, std::string_view settings = {});
+	// one HTTP/2 stream, admitted like a request of its own
+	Task<HTTPResponse> dispatch(HTTPRequest &request);
+	/* answer the handshake of request and hand the connection to a
+	 * WebSocket in the loop; false, as the worker is done with it either way
+	 */
+	Task<bool> serve_websocket(Connection &c, TCPStream &client, HTTPRequest &request,
+			const WebSocketRoute &route);
+	// send the head of an event stream and subscribe the connection to topic
+	Task<bool> serve_events(Connection &c, HTTPRequest &request, const EventStreamRoute &route,
+			std::string topic);
 
 public:
-	HTTPServer(int port=80);
+	// listens nowhere until add_listener()
+	HTTPServer();
+	HTTPServer(int port, const SocketOptions &options=SocketOptions());
+	~HTTPServer();
+
+	// any number, before run()
+	using TCPServer::add_listener;
 
 	static void shutdown();
 
 	void config(const std::string &filename);
 	// void config(Json _config);
 
+	// "epoll" (default) or "uring", see EventLoop::create
+	void use_io_backend(const std::string &backend);
+	void set_limits(const HTTPLimits &limits);
+	void configure_sessions(std::chrono::seconds ttl, size_t max_bytes);
+	// queueing delay that counts as overload, and the cap on requests in flight
+	void configure_overload(std::chrono::milliseconds target, size_t max_in_flight);
+
+	/* certificate, key and optional ticket keys for the tls: listeners
+	 * (see TLSContext::load); before run(), false if they do not load
+	 */
+	bool use_tls(const std::string &cert, const std::string &key, const std::string &ticket_keys = "");
+
+	// answer directory checks from a manifest or bundle instead of stat()
+	void use_directory_lookup(std::function<bool (std::string_view path)> lookup);
+
 	void register_callback(const Callback &cb);
 	void register_callbacks(const std::vector<Callback> &cbs);
+	// Upgrade: websocket requests for a path the route matches; before run()
+	void register_websocket(const WebSocketRoute &route);
+	// GET requests for a path the route matches subscribe to its hub; before run()
+	void register_event_stream(const EventStreamRoute &route);
+
+	/* serve until SIGINT/SIGTERM, then drain and return. SIGUSR2 starts
+	 * the new binary on the same sockets first (zero-downtime upgrade),
+	 * SIGUSR1 logs the connections and their memory.
+	 */
 	void run();
+
+	// what the server itself keeps for an idle keep-alive connection
+	static size_t idle_connection_footprint();
 };
 
 
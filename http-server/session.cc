@@ -0,0 +1,231 @@
+#include <sys/random.h>
+
+#include <algorithm>
+#include <functional>
+
+#include "session.h"
+#include "debug.h"
+
+
+// bookkeeping per stored session and per value: map nodes, list node, id
+static constexpr size_t session_overhead = 256;
+static constexpr size_t value_overhead = 64;
+
+Session::Session(std::string id) :
+	_id(std::move(id)),
+	mutex(),
+	values(),
+	bytes(session_overhead + _id.size()),
+	modified(false)
+{
+}
+
+std::string Session::get(const std::string &key) const {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = values.find(key);
+	return it == values.end() ? std::string() : it->second;
+}
+
+void Session::set(const std::string &key, std::string value) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = values.find(key);
+	if(it == values.end()) {
+		bytes += value_overhead + key.size() + value.size();
+		values.emplace(key, std::move(value));
+	} else {
+		bytes = bytes - it->second.size() + value.size();
+		it->second = std::move(value);
+	}
+	modified = true;
+}
+
+void Session::erase(const std::string &key) {
+	std::lock_guard<std::mutex> lock(mutex);
+	auto it = values.find(key);
+	if(it == values.end()) return;
+
+	bytes -= value_overhead + it->first.size() + it->second.size();
+	values.erase(it);
+	modified = true;
+}
+
+size_t Session::memory() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return bytes;
+}
+
+bool Session::is_modified() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return modified;
+}
+
+
+SessionStore::SessionStore(std::chrono::seconds ttl, size_t max_bytes) :
+	shards(),
+	ttl(ttl),
+	max_bytes(max_bytes),
+	sweeper_mutex(),
+	sweeper_cv(),
+	stopping(false),
+	sweeper()
+{
+	sweeper = std::thread([this] { sweep(); });
+}
+
+SessionStore::~SessionStore() {
+	{
+		std::lock_guard<std::mutex> lock(sweeper_mutex);
+		stopping = true;
+	}
+	sweeper_cv.notify_one();
+	sweeper.join();
+}
+
+void SessionStore::configure(std::chrono::seconds ttl, size_t max_bytes) {
+	this->ttl = ttl;
+	this->max_bytes = max_bytes;
+	// the sweeper picks up the new interval
+	std::lock_guard<std::mutex> lock(sweeper_mutex);
+	sweeper_cv.notify_one();
+}
+
+SessionStore::Shard &SessionStore::shard_of(const std::string &id) {
+	return shards[std::hash<std::string>()(id) % nshards];
+}
+
+SessionPtr SessionStore::find(const std::string &id) {
+	if(id.empty())
+		return nullptr;
+
+	auto &shard = shard_of(id);
+	auto now = clock::now();
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find(id);
+	if(it == shard.entries.end())
+		return nullptr;
+
+	auto &entry = it->second;
+	if(entry.expires <= now) {
+		shard.bytes -= entry.bytes;
+		shard.lru.erase(entry.lru);
+		shard.entries.erase(it);
+		return nullptr;
+	}
+
+	entry.expires = now + ttl.load();
+	shard.lru.splice(shard.lru.begin(), shard.lru, entry.lru);
+	return entry.session;
+}
+
+SessionPtr SessionStore::create() {
+	unsigned char raw[16];
+	size_t got = 0;
+	while(got < sizeof(raw)) {
+		auto num = getrandom(raw + got, sizeof(raw) - got, 0);
+		if(num < 0) wloge("getrandom failed\n");
+		got += num;
+	}
+
+	static const char digits[] = "0123456789abcdef";
+	std::string id;
+	id.reserve(sizeof(raw) * 2);
+	for(auto byte : raw) {
+		id.push_back(digits[byte >> 4]);
+		id.push_back(digits[byte & 0xf]);
+	}
+
+	return std::make_shared<Session>(std::move(id));
+}
+
+void SessionStore::insert(const SessionPtr &session) {
+	auto &shard = shard_of(session->id());
+	auto bytes = session->memory();
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find(session->id());
+	if(it != shard.entries.end()) {
+		shard.bytes -= it->second.bytes;
+		shard.lru.erase(it->second.lru);
+		shard.entries.erase(it);
+	}
+
+	shard.lru.push_front(session->id());
+	shard.entries[session->id()] = Entry { session, clock::now() + ttl.load(), bytes, shard.lru.begin() };
+	shard.bytes += bytes;
+	evict(shard);
+}
+
+void SessionStore::update(const SessionPtr &session) {
+	auto &shard = shard_of(session->id());
+	auto bytes = session->memory();
+
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find(session->id());
+	if(it == shard.entries.end())
+		return;
+
+	shard.bytes = shard.bytes - it->second.bytes + bytes;
+	it->second.bytes = bytes;
+	evict(shard);
+}
+
+void SessionStore::erase(const std::string &id) {
+	auto &shard = shard_of(id);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.entries.find(id);
+	if(it == shard.entries.end())
+		return;
+
+	shard.bytes -= it->second.bytes;
+	shard.lru.erase(it->second.lru);
+	shard.entries.erase(it);
+}
+
+size_t SessionStore::size() {
+	size_t total = 0;
+	for(auto &shard : shards) {
+		std::lock_guard<std::mutex> lock(shard.mutex);
+		total += shard.entries.size();
+	}
+	return total;
+}
+
+// caller holds shard.mutex
+void SessionStore::evict(Shard &shard) {
+	auto budget = max_bytes / nshards;
+	while(shard.bytes > budget && shard.lru.size() > 1) {
+		auto it = shard.entries.find(shard.lru.back());
+		shard.bytes -= it->second.bytes;
+		shard.entries.erase(it);
+		shard.lru.pop_back();
+	}
+}
+
+void SessionStore::sweep() {
+	std::unique_lock<std::mutex> lock(sweeper_mutex);
+	while(!stopping) {
+		auto interval = std::max<std::chrono::seconds>(std::chrono::seconds(1),
+				std::min<std::chrono::seconds>(ttl.load() / 4, std::chrono::seconds(60)));
+		sweeper_cv.wait_for(lock, interval);
+		if(stopping) break;
+
+		// expired entries collect at the tail of each LRU list
+		auto now = clock::now();
+		size_t removed = 0;
+		for(auto &shard : shards) {
+			std::lock_guard<std::mutex> shard_lock(shard.mutex);
+			while(!shard.lru.empty()) {
+				auto it = shard.entries.find(shard.lru.back());
+				if(it->second.expires > now) break;
+				shard.bytes -= it->second.bytes;
+				shard.entries.erase(it);
+				shard.lru.pop_back();
+				removed++;
+			}
+		}
+
+		if(removed)
+			wlog("session sweeper removed % expired sessions\n", removed);
+	}
+}
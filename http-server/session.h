@@ -0,0 +1,109 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+
+// per-client key/value state, shared by every request carrying its cookie
+class Session {
+	const std::string _id;
+
+	mutable std::mutex mutex;
+	std::unordered_map<std::string, std::string> values;
+	size_t bytes;
+	bool modified;
+
+public:
+	explicit Session(std::string id);
+
+	Session(const Session &) = delete;
+	Session& operator= (const Session &) = delete;
+
+	const std::string &id() const { return _id; }
+
+	std::string get(const std::string &key) const;
+	void set(const std::string &key, std::string value);
+	void erase(const std::string &key);
+
+	// rough footprint, charged against the store's memory cap
+	size_t memory() const;
+	bool is_modified() const;
+};
+
+using SessionPtr = std::shared_ptr<Session>;
+
+
+/* Sessions sharded by the hash of their id. Each shard has its own lock,
+ * hash map and LRU list, so lookups from different workers rarely meet on
+ * the same mutex. Idle sessions expire after ttl (a background sweeper
+ * removes them), and each shard evicts least recently used sessions once
+ * its part of the memory cap is used up.
+ */
+class SessionStore {
+	using clock = std::chrono::steady_clock;
+
+	struct Entry {
+		SessionPtr session;
+		clock::time_point expires;
+		size_t bytes;
+		std::list<std::string>::iterator lru;
+	};
+
+	struct Shard {
+		std::mutex mutex;
+		std::unordered_map<std::string, Entry> entries;
+		std::list<std::string> lru;  // most recent first
+		size_t bytes = 0;
+	};
+
+	static constexpr size_t nshards = 64;
+	std::array<Shard, nshards> shards;
+
+	// configure() may change them while workers read them under shard locks
+	std::atomic<std::chrono::seconds> ttl;
+	std::atomic<size_t> max_bytes;
+
+	std::mutex sweeper_mutex;
+	std::condition_variable sweeper_cv;
+	bool stopping;
+	std::thread sweeper;
+
+	Shard &shard_of(const std::string &id);
+	void evict(Shard &shard);
+	void sweep();
+
+public:
+	static constexpr const char *cookie_name = "SESSIONID";
+
+	SessionStore(std::chrono::seconds ttl = std::chrono::minutes(30),
+			size_t max_bytes = 64 * 1024 * 1024);
+	~SessionStore();
+
+	SessionStore(const SessionStore &) = delete;
+	SessionStore& operator= (const SessionStore &) = delete;
+
+	void configure(std::chrono::seconds ttl, size_t max_bytes);
+
+	// live session for id, refreshing its ttl; nullptr if unknown/expired
+	SessionPtr find(const std::string &id);
+	// new session with a random id, not stored until insert()
+	SessionPtr create();
+	void insert(const SessionPtr &session);
+	// re-charge a session whose content changed
+	void update(const SessionPtr &session);
+	void erase(const std::string &id);
+
+	size_t size();
+};
+
+
+#endif
@@ -0,0 +1,107 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sstream>
+
+#include "debug.h"
+#include "sockopt.h"
+
+
+bool SocketOptions::preset(std::string_view name, SocketOptions &options) {
+	options = SocketOptions();
+	if(name == "default")
+		return true;
+
+	if(name == "latency") {
+		// no round trip for returning clients, a short send queue so fresh
+		// data is not stuck behind stale, and no interrupt wait on reads
+		options.fastopen = 256;
+		options.notsent_lowat = 16 * 1024;
+		options.busy_poll = 50;
+		return true;
+	}
+
+	if(name == "throughput") {
+		// ride out bursts of connections, wake up only for ones that have
+		// sent something, and reap dead peers among many long-lived ones
+		options.backlog = 4096;
+		options.defer_accept = 5;
+		options.fastopen = 1024;
+		options.keepalive_idle = 60;
+		return true;
+	}
+	return false;
+}
+
+static void set_option(int fd, int level, int name, int value, const char *what) {
+	if(setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+		wlog("cannot set % to % on fd %: %\n", what, value, fd, strerror(errno));
+}
+
+static int get_option(int fd, int level, int name) {
+	int value = 0;
+	socklen_t length = sizeof(value);
+	if(getsockopt(fd, level, name, &value, &length) < 0)
+		return -1;
+	return value;
+}
+
+bool SocketOptions::apply(int fd) const {
+	// before listen, so the window scale offered in the SYN-ACK fits
+	if(rcvbuf)
+		set_option(fd, SOL_SOCKET, SO_RCVBUF, rcvbuf, "SO_RCVBUF");
+	if(sndbuf)
+		set_option(fd, SOL_SOCKET, SO_SNDBUF, sndbuf, "SO_SNDBUF");
+
+	// a Unix domain socket has the buffers and the backlog, no more
+	if(get_option(fd, SOL_SOCKET, SO_DOMAIN) == AF_UNIX)
+		return listen(fd, backlog) == 0;
+
+	set_option(fd, IPPROTO_TCP, TCP_NODELAY, nodelay, "TCP_NODELAY");
+	// an inherited socket may carry values of its own, so zeros are set too
+	set_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, defer_accept, "TCP_DEFER_ACCEPT");
+	if(fastopen)
+		set_option(fd, IPPROTO_TCP, TCP_FASTOPEN, fastopen, "TCP_FASTOPEN");
+	if(notsent_lowat)
+		set_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, notsent_lowat, "TCP_NOTSENT_LOWAT");
+	set_option(fd, SOL_SOCKET, SO_BUSY_POLL, busy_poll, "SO_BUSY_POLL");
+
+	set_option(fd, SOL_SOCKET, SO_KEEPALIVE, keepalive_idle > 0, "SO_KEEPALIVE");
+	if(keepalive_idle > 0) {
+		set_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, keepalive_idle, "TCP_KEEPIDLE");
+		set_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, keepalive_interval, "TCP_KEEPINTVL");
+		set_option(fd, IPPROTO_TCP, TCP_KEEPCNT, keepalive_count, "TCP_KEEPCNT");
+	}
+
+	// on a socket already listening this only changes the backlog
+	return listen(fd, backlog) == 0;
+}
+
+std::string SocketOptions::describe(int fd) const {
+	std::ostringstream os;
+	os << "backlog " << backlog;
+	if(get_option(fd, SOL_SOCKET, SO_DOMAIN) == AF_UNIX) {
+		os << ", rcvbuf " << get_option(fd, SOL_SOCKET, SO_RCVBUF)
+		   << ", sndbuf " << get_option(fd, SOL_SOCKET, SO_SNDBUF);
+		return os.str();
+	}
+
+	os << ", nodelay " << (get_option(fd, IPPROTO_TCP, TCP_NODELAY) > 0 ? "on" : "off")
+	   << ", defer-accept " << get_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT) << "s"
+	   << ", fastopen " << get_option(fd, IPPROTO_TCP, TCP_FASTOPEN)
+	   << ", rcvbuf " << get_option(fd, SOL_SOCKET, SO_RCVBUF)
+	   << ", sndbuf " << get_option(fd, SOL_SOCKET, SO_SNDBUF)
+	   << ", notsent-lowat " << get_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT)
+	   << ", busy-poll " << get_option(fd, SOL_SOCKET, SO_BUSY_POLL) << "us";
+	if(get_option(fd, SOL_SOCKET, SO_KEEPALIVE) > 0) {
+		os << ", keepalive " << get_option(fd, IPPROTO_TCP, TCP_KEEPIDLE)
+		   << "s/" << get_option(fd, IPPROTO_TCP, TCP_KEEPINTVL)
+		   << "s x" << get_option(fd, IPPROTO_TCP, TCP_KEEPCNT);
+	} else {
+		os << ", keepalive off";
+	}
+	return os.str();
+}
@@ -0,0 +1,37 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+#include <string>
+#include <string_view>
+
+
+/* How a listening socket and the connections accepted from it are tuned.
+ * Everything is set on the listening socket once: Linux copies the socket
+ * and TCP options of a listener into each socket it accepts, so accepted
+ * connections get them without a syscall of their own. A 0 leaves the
+ * kernel default (or turns the option off).
+ */
+struct SocketOptions {
+	int backlog            = 511;    // pending connections, capped by net.core.somaxconn
+	bool nodelay           = true;   // TCP_NODELAY, responses go out as soon as written
+	int defer_accept       = 0;      // seconds, accept only once the request starts arriving
+	int fastopen           = 0;      // TCP_FASTOPEN queue, data in the SYN of known clients
+	int rcvbuf             = 0;      // bytes, fixing a size turns autotuning off
+	int sndbuf             = 0;
+	int notsent_lowat      = 0;      // bytes unsent before the socket stops being writable
+	int busy_poll          = 0;      // microseconds to spin on the device for data
+	int keepalive_idle     = 0;      // seconds before the first probe, 0 is no keepalive
+	int keepalive_interval = 10;     // seconds between probes
+	int keepalive_count    = 6;      // unanswered probes until the connection is dropped
+
+	// "default", "latency" or "throughput"; false for any other name
+	static bool preset(std::string_view name, SocketOptions &options);
+
+	// set on the listening socket fd and (re)start listening, false if listen fails
+	bool apply(int fd) const;
+	// the values in effect on fd, as the kernel reports them
+	std::string describe(int fd) const;
+};
+
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "debug.h"
+
+
+template<class T> class Task;
+
+namespace detail {
+
+// resume whoever is co_awaiting the finished task
+struct FinalAwaiter {
+	bool await_ready() noexcept { return false; }
+
+	template<class Promise>
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> h) noexcept {
+		auto continuation = h.promise().continuation;
+		return continuation ? continuation : std::noop_coroutine();
+	}
+
+	void await_resume() noexcept {}
+};
+
+struct PromiseBase {
+	std::coroutine_handle<> continuation;
+	std::exception_ptr error;
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { error = std::current_exception(); }
+
+	void rethrow_if_failed() {
+		if(error)
+			std::rethrow_exception(error);
+	}
+};
+
+template<class T>
+struct TaskPromise : PromiseBase {
+	std::optional<T> value;
+
+	Task<T> get_return_object();
+
+	template<class U>
+	void return_value(U &&v) { value.emplace(std::forward<U>(v)); }
+
+	T result() {
+		rethrow_if_failed();
+		return std::move(*value);
+	}
+};
+
+template<>
+struct TaskPromise<void> : PromiseBase {
+	Task<void> get_return_object();
+
+	void return_void() {}
+
+	void result() {
+		rethrow_if_failed();
+	}
+};
+
+}
+
+/* Lazily started coroutine producing a T. The body does not run until the
+ * task is co_awaited, and the awaiting coroutine is resumed by symmetric
+ * transfer as soon as the task completes.
+ */
+template<class T>
+class Task {
+public:
+	using promise_type = detail::TaskPromise<T>;
+
+private:
+	std::coroutine_handle<promise_type> handle;
+
+public:
+	explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+
+	Task(const Task &) = delete;
+	Task& operator= (const Task &) = delete;
+
+	Task(Task &&other) : handle(std::exchange(other.handle, nullptr)) {}
+	Task& operator= (Task &&other) {
+		if(this != &other) {
+			if(handle) handle.destroy();
+			handle = std::exchange(other.handle, nullptr);
+		}
+		return *this;
+	}
+
+	~Task() {
+		if(handle) handle.destroy();
+	}
+
+	bool await_ready() const noexcept {
+		return !handle || handle.done();
+	}
+
+	// start the task and come back to `awaiting` once it finishes
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+		handle.promise().continuation = awaiting;
+		return handle;
+	}
+
+	T await_resume() {
+		return handle.promise().result();
+	}
+};
+
+template<class T>
+Task<T> detail::TaskPromise<T>::get_return_object() {
+	return Task<T>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+inline Task<void> detail::TaskPromise<void>::get_return_object() {
+	return Task<void>(std::coroutine_handle<TaskPromise>::from_promise(*this));
+}
+
+
+// fire-and-forget driver, frees itself when the task is done
+struct Detached {
+	struct promise_type {
+		Detached get_return_object() { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() {
+			try {
+				throw;
+			} catch(std::exception &e) {
+				wlog("uncaught exception in task: %\n", e.what());
+			} catch(...) {
+				wlog("uncaught exception in task\n");
+			}
+		}
+	};
+};
+
+inline Detached spawn(Task<void> task) {
+	co_await task;
+}
+
+
+#endif
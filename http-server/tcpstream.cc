@@ -1,3 +1,4 @@
+#include <sys/uio.h>
 #include <unistd.h>
 #include <cstring>
 
@@ -5,38 +6,54 @@
 #include <algorithm>
 
 #include "tcpstream.h"
+#include "pool.h"
 #include "debug.h"
 
 
 
 TCPBuf::TCPBuf() :
 	conn(-1),
-	buf(nullptr)
+	owned(false),
+	buf(nullptr),
+	bufsize(0),
+	next_size(BufferPool::small),
+	total_read(0),
+	read_limit(unlimited),
+	limit_hit(false)
 {
 }
 
-TCPBuf::TCPBuf(int conn) :
+TCPBuf::TCPBuf(int conn, bool owned) :
 	conn(conn),
-	buf(new char[bufsize])
+	owned(owned),
+	buf(nullptr),
+	bufsize(0),
+	next_size(BufferPool::small),
+	total_read(0),
+	read_limit(unlimited),
+	limit_hit(false)
 {
-	setg(buf + putbacksize,
-		 buf + putbacksize,
-		 buf + putbacksize);
 }
 
 TCPBuf::~TCPBuf() {
-	if(conn > 0) {
+	if(conn > 0 && owned) {
 		wlog("close connection from %\n", conn);
 		close(conn);
 	}
 
-	if(buf) delete []buf;
+	if(buf) BufferPool::give(buf, bufsize);
 	conn = -1;
 }
 
 TCPBuf::TCPBuf(TCPBuf && other) :
 	conn(other.conn),
-	buf(other.buf)
+	owned(other.owned),
+	buf(other.buf),
+	bufsize(other.bufsize),
+	next_size(other.next_size),
+	total_read(other.total_read),
+	read_limit(other.read_limit),
+	limit_hit(other.limit_hit)
 {
 	other.buf = nullptr;
 	other.conn = -1;
@@ -57,37 +74,125 @@ std::streamsize TCPBuf::xsputn(const char *s, std::streamsize n) {
 	return write(conn, s, n);
 }
 
+void TCPBuf::borrow() {
+	// no larger than the read limit still allows, a header never takes a 64K buffer
+	size_t want = next_size;
+	if(read_limit != unlimited)
+		want = std::min(want, read_limit - std::min(total_read, read_limit) + putbacksize);
+	if(buf && bufsize >= want)
+		return;
+	// only while empty, so just the putback bytes move over
+	char putback[putbacksize];
+	size_t kept = 0;
+	if(buf) {
+		kept = std::min<size_t>(gptr() - eback(), putbacksize);
+		std::memcpy(putback, gptr() - kept, kept);
+		BufferPool::give(buf, bufsize);
+	}
+
+	bufsize = want;
+	buf = BufferPool::take(bufsize);
+	keep_putback(putback, kept, 0);
+}
+
+void TCPBuf::keep_putback(const char *data, size_t n, size_t buffered) {
+	size_t kept = std::min<size_t>(n, putbacksize);
+	std::memmove(buf + putbacksize - kept, data + n - kept, kept);
+	setg(buf + putbacksize - kept,
+		buf + putbacksize,
+		buf + putbacksize + buffered);
+}
+
 int TCPBuf::underflow() {
 	if(gptr() < egptr()) {
 		return traits_type::to_int_type(*gptr());
 	}
 
-	int num_putback = gptr() - eback();
-	if(num_putback > putbacksize) {
-		num_putback = putbacksize;
+	if(total_read >= read_limit) {
+		limit_hit = true;
+		return EOF;
 	}
 
-	std::memmove(buf + (putbacksize - num_putback), gptr() - num_putback, num_putback);
+	borrow();
+	keep_putback(eback(), gptr() - eback(), 0);
 
-	int num = read(conn, buf + putbacksize, bufsize - putbacksize);
+	// never past the limit, whatever room the buffer has
+	auto room = std::min(bufsize - putbacksize, read_limit - total_read);
+	int num = read(conn, buf + putbacksize, room);
 	if(num <= 0) {
 		return EOF; // end or error
 	}
+	total_read += num;
+	// a full buffer means more is waiting, the next one is a class larger
+	if(size_t(num) == bufsize - putbacksize)
+		next_size = std::min(bufsize * 4, BufferPool::large);
 
-	// reset buffer
-	setg(buf + (putbacksize - num_putback),
-		buf + putbacksize,
-		buf + putbacksize + num);
-
+	setg(eback(), gptr(), gptr() + num);
 	return traits_type::to_int_type(*gptr());
 }
 
+std::streamsize TCPBuf::xsgetn(char *s, std::streamsize n) {
+	std::streamsize avail = egptr() - gptr();
+	if(avail > 0) {
+		auto num = std::min(avail, n);
+		std::memcpy(s, gptr(), num);
+		gbump(num);
+		return num;
+	}
+
+	if(total_read >= read_limit) {
+		limit_hit = true;
+		return 0;
+	}
+
+	borrow();
+	// small reads refill the buffer
+	if(size_t(n) < bufsize - putbacksize) {
+		if(underflow() == EOF)
+			return 0;
+		return xsgetn(s, n);
+	}
+
+	// large ones land in s, and what follows (a pipelined request) in the buffer
+	auto left = read_limit - total_read;
+	auto direct_room = std::min(size_t(n), left);
+	struct iovec iov[2] = {
+		{ s, direct_room },
+		{ buf + putbacksize, std::min(bufsize - putbacksize, left - direct_room) },
+	};
+	auto num = readv(conn, iov, 2);
+	if(num <= 0)
+		return 0;
+	total_read += num;
+
+	auto direct = std::min<ssize_t>(num, n);
+	keep_putback(s, direct, num - direct);
+	return direct;
+}
+
+void TCPBuf::release_buffer() {
+	if(!buf || gptr() < egptr())
+		return;
+	BufferPool::give(buf, bufsize);
+	buf = nullptr;
+	bufsize = 0;
+	next_size = BufferPool::small;
+	setg(nullptr, nullptr, nullptr);
+}
+
+void TCPBuf::set_read_limit(size_t n) {
+	size_t buffered = egptr() - gptr();
+	size_t consumed = total_read - buffered;
+	read_limit = n == unlimited ? unlimited : consumed + n;
+	limit_hit = false;
+}
+
 TCPBuf::operator bool() {
 	return conn > 0;
 }
 
-TCPStream::TCPStream(int conn) :
-	std::iostream(0), tcpbuf(conn)
+TCPStream::TCPStream(int conn, bool owned) :
+	std::iostream(0), tcpbuf(conn, owned)
 {
 	rdbuf(&tcpbuf);
 }
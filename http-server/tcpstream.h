@@ -7,19 +7,34 @@
 
 class TCPBuf : public std::streambuf {
 	int conn;
+	bool owned;  // the socket is closed along with the buffer
 
-	static constexpr std::streamsize bufsize = 1024;
 	static constexpr std::streamsize putbacksize = 4;
+	// borrowed from BufferPool at the first read, given back once drained
 	char *buf;
+	size_t bufsize;
+	size_t next_size;   // for the next borrow, grown after a read filled the buffer
+
+	size_t total_read;  // bytes taken from the socket so far
+	size_t read_limit;  // no read goes past it, underflow reports EOF once total_read reaches it
+	bool limit_hit;
 protected:
 	int overflow(int ch) override;
 	std::streamsize xsputn(const char *s, std::streamsize n) override;
 
 	int underflow() override;
+	/* copies what is buffered, or reads straight into s with one readv()
+	 * that puts whatever follows into the buffer
+	 */
+	std::streamsize xsgetn(char *s, std::streamsize n) override;
+
+	// keep the last bytes consumed from data, for unget()
+	void keep_putback(const char *data, size_t n, size_t buffered);
+	void borrow();
 
 public:
 	TCPBuf();
-	TCPBuf(int _conn);
+	TCPBuf(int _conn, bool owned = true);
 	~TCPBuf();
 
 	TCPBuf(const TCPBuf &) = delete;
@@ -28,6 +43,16 @@ public:
 	TCPBuf(TCPBuf &&);
 	TCPBuf& operator= (TCPBuf &&) = delete;
 
+	int fd() const { return conn; }
+
+	static constexpr size_t unlimited = ~size_t(0);
+
+	// allow at most n more bytes to be consumed, see limit_reached()
+	void set_read_limit(size_t n);
+	bool limit_reached() const { return limit_hit; }
+	// give the buffer back if nothing is left in it
+	void release_buffer();
+
 	operator bool();
 };
 
@@ -36,7 +61,8 @@ class TCPStream : public std::iostream {
 	TCPBuf tcpbuf;
 public:
 	TCPStream() = default;
-	TCPStream(int conn);
+	// owned: close conn with the stream
+	TCPStream(int conn, bool owned = true);
 	virtual ~TCPStream() = default;
 
 	TCPStream(const TCPStream &) = delete;
@@ -45,6 +71,12 @@ public:
 	TCPStream(TCPStream &&);
 	TCPStream& operator= (TCPStream &&) = delete;
 
+	int fd() const { return tcpbuf.fd(); }
+
+	void set_read_limit(size_t n) { tcpbuf.set_read_limit(n); }
+	bool limit_reached() const { return tcpbuf.limit_reached(); }
+	void release_buffer() { tcpbuf.release_buffer(); }
+
 	operator bool();
 };
 
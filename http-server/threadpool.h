@@ -6,17 +6,37 @@
 #include <utility>
 #include <array>
 #include "ThreadSafeQueue.h"
+#include "unique_function.h"
 
 
 template<size_t N>
 class ThreadPool {
+public:
+	using task_t = unique_function<void ()>;
+
+private:
 	std::array<std::unique_ptr<std::thread>, N> pool;
-	ThreadSafeQueue<std::function<void()>> tasks;
+	ThreadSafeQueue<task_t> tasks;
+
+	// func and args moved (or copied, if lvalues) into one task, called with the args as rvalues
+	template<class Func, class...Args>
+	static task_t bind(Func &&func, Args&&...args) {
+		if constexpr (sizeof...(Args) == 0) {
+			return task_t(std::forward<Func>(func));
+		} else {
+			return [func = std::forward<Func>(func), ...args = std::forward<Args>(args)]() mutable {
+				std::invoke(func, std::move(args)...);
+			};
+		}
+	}
+
+	// thrown by the tasks shutdown() queues, ends one runner each
+	struct Stop {};
 
 public:
 
 	~ThreadPool() {
-		for(auto &pthread : pool) { pthread.reset(); }
+		shutdown();
 	}
 
 	ThreadPool() {
@@ -25,6 +45,8 @@ public:
 				try {
 					auto task = this->tasks.dequeue();
 					task();
+				} catch(Stop &) {
+					return;
 				} catch(std::exception &e) {
 					// do nothing
 				}
@@ -36,12 +58,27 @@ public:
 		}
 	}
 
+	// run what is already queued, then join the threads
+	void shutdown() {
+		for(auto &pthread : pool) {
+			if(pthread) tasks.enqueue([] { throw Stop(); });
+		}
+		for(auto &pthread : pool) {
+			if(pthread) pthread->join();
+			pthread.reset();
+		}
+	}
+
+	// a callable that fits a task_t inline is queued without any allocation
 	template<class Func, class...Args>
 	void submitTask(Func &&func, Args&&...args) {
-		auto task = [=]() {
-			return func(args...);
-		};
-		tasks.enqueue(task);
+		tasks.enqueue(bind(std::forward<Func>(func), std::forward<Args>(args)...));
+	}
+
+	// runs ahead of everything queued with submitTask
+	template<class Func, class...Args>
+	void submitUrgentTask(Func &&func, Args&&...args) {
+		tasks.enqueue_urgent(bind(std::forward<Func>(func), std::forward<Args>(args)...));
 	}
 };
 
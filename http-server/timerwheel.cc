@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <climits>
+
+#include "timerwheel.h"
+
+
+TimerNode::TimerNode() :
+	TimerLink{nullptr, nullptr},
+	expires(0),
+	wheel(nullptr),
+	owned(false),
+	callback()
+{
+}
+
+TimerNode::~TimerNode() {
+	cancel();
+}
+
+void TimerNode::cancel() {
+	if(wheel)
+		wheel->cancel(*this);
+}
+
+
+constexpr int TimerWheel::tick_ms;
+constexpr uint64_t TimerWheel::max_ticks;
+
+TimerWheel::TimerWheel() :
+	mutex(),
+	slots(),
+	occupied(),
+	now_tick(0),
+	wakeup_tick(UINT64_MAX),
+	origin(clock::now()),
+	count(0)
+{
+	for(auto &level : slots) {
+		for(auto &head : level)
+			head.prev = head.next = &head;
+	}
+}
+
+TimerWheel::~TimerWheel() {
+	// detach whatever is left so owners don't cancel into a dead wheel
+	for(int level = 0; level < levels; level++) {
+		for(auto &head : slots[level]) {
+			while(head.next != &head) {
+				auto *node = static_cast<TimerNode *>(head.next);
+				unlink(node);
+				node->wheel = nullptr;
+				if(node->owned)
+					delete node;
+			}
+		}
+	}
+}
+
+uint64_t TimerWheel::to_tick(clock::time_point t) const {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(t - origin).count() / tick_ms;
+}
+
+// caller holds mutex, node is not linked
+void TimerWheel::link(TimerNode *node) {
+	if(node->expires <= now_tick)
+		node->expires = now_tick + 1;
+	if(node->expires - now_tick >= max_ticks)
+		node->expires = now_tick + max_ticks - 1;
+
+	auto delta = node->expires - now_tick;
+	int level = 0;
+	while(level < levels - 1 && delta >= (uint64_t)1 << (slot_bits * (level + 1)))
+		level++;
+
+	auto index = (node->expires >> (slot_bits * level)) & slot_mask;
+	auto &head = slots[level][index];
+	node->prev = head.prev;
+	node->next = &head;
+	head.prev->next = node;
+	head.prev = node;
+	occupied[level] |= (uint64_t)1 << index;
+	count++;
+}
+
+// caller holds mutex, node is linked
+void TimerWheel::unlink(TimerNode *node) {
+	auto *prev = node->prev;
+	auto *next = node->next;
+	prev->next = next;
+	next->prev = prev;
+	node->prev = node->next = nullptr;
+	count--;
+
+	// a list that is now empty consists of its head alone
+	if(prev == next) {
+		auto slot = prev - &slots[0][0];
+		occupied[slot / nslots] &= ~((uint64_t)1 << (slot % nslots));
+	}
+}
+
+// move the timers of the current slot at level one level down
+void TimerWheel::cascade(int level) {
+	auto index = (now_tick >> (slot_bits * level)) & slot_mask;
+	auto &head = slots[level][index];
+	while(head.next != &head) {
+		auto *node = static_cast<TimerNode *>(head.next);
+		unlink(node);
+		link(node);
+	}
+
+	if(index == 0 && level + 1 < levels)
+		cascade(level + 1);
+}
+
+void TimerWheel::tick() {
+	now_tick++;
+	auto index = now_tick & slot_mask;
+	if(index == 0)
+		cascade(1);
+
+	auto &head = slots[0][index];
+	while(head.next != &head) {
+		auto *node = static_cast<TimerNode *>(head.next);
+		unlink(node);
+
+		// the callback may re-arm or destroy its node
+		auto callback = std::move(node->callback);
+		node->callback = nullptr;
+		if(node->owned)
+			delete node;
+		if(callback)
+			callback();
+	}
+}
+
+// tick at which advance() has work to do next
+uint64_t TimerWheel::next_expiry() const {
+	if(occupied[0]) {
+		// level 0 holds deltas below one revolution: rotate so bit 0 is the next tick
+		auto shift = (now_tick + 1) & slot_mask;
+		auto bits = occupied[0];
+		auto rotated = shift ? (bits >> shift | bits << (nslots - shift)) : bits;
+		return now_tick + 1 + __builtin_ctzll(rotated);
+	}
+
+	for(int level = 1; level < levels; level++) {
+		if(occupied[level])
+			return ((now_tick >> slot_bits) + 1) << slot_bits;
+	}
+	return UINT64_MAX;
+}
+
+bool TimerWheel::schedule(TimerNode &node, int delay_ms, callback_t callback) {
+	auto ticks = delay_ms > 0 ? ((uint64_t)delay_ms + tick_ms - 1) / tick_ms : 0;
+	auto expires = to_tick(clock::now()) + ticks;
+
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	if(node.prev)
+		unlink(&node);
+	node.wheel = this;
+	node.callback = std::move(callback);
+	node.expires = expires;
+	link(&node);
+	return node.expires < wakeup_tick;
+}
+
+bool TimerWheel::schedule(int delay_ms, callback_t callback) {
+	auto *node = new TimerNode;
+	node->owned = true;
+	return schedule(*node, delay_ms, std::move(callback));
+}
+
+void TimerWheel::cancel(TimerNode &node) {
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	if(!node.prev)
+		return;
+	unlink(&node);
+	node.callback = nullptr;
+}
+
+void TimerWheel::advance() {
+	auto target = to_tick(clock::now());
+
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	// an idle wheel has nothing to cascade
+	if(count == 0 && now_tick < target)
+		now_tick = target;
+	while(now_tick < target && count)
+		tick();
+	now_tick = std::max(now_tick, target);
+}
+
+int TimerWheel::next_timeout() {
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	wakeup_tick = next_expiry();
+	if(wakeup_tick == UINT64_MAX)
+		return -1;
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - origin).count();
+	auto due = (long long)(wakeup_tick * tick_ms) - elapsed;
+	return (int)std::max<long long>(0, std::min<long long>(due, INT_MAX));
+}
+
+size_t TimerWheel::size() {
+	std::lock_guard<std::recursive_mutex> lock(mutex);
+	return count;
+}
@@ -0,0 +1,103 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+#include "unique_function.h"
+
+
+class TimerWheel;
+
+struct TimerLink {
+	TimerLink *prev;
+	TimerLink *next;
+};
+
+/* Intrusive timer, embedded in whatever owns the deadline (a connection,
+ * say). Arming it allocates nothing, and destroying it cancels it.
+ */
+class TimerNode : private TimerLink {
+	uint64_t expires;        // in ticks
+	TimerWheel *wheel;       // the wheel it was last scheduled on
+	bool owned;              // one-shot node the wheel frees after firing
+	unique_function<void ()> callback;
+
+	friend class TimerWheel;
+public:
+	TimerNode();
+	~TimerNode();
+
+	// disarm it on the wheel it was last scheduled on, from any thread
+	void cancel();
+
+	TimerNode(const TimerNode &) = delete;
+	TimerNode& operator= (const TimerNode &) = delete;
+};
+
+/* Hierarchical timer wheel: 4 levels of 64 slots, 10ms per tick, so
+ * deadlines up to ~46 hours. Insert and cancel are O(1) list operations;
+ * a timer is moved down a level at most 3 times before it fires.
+ *
+ * Safe to use from any thread. Callbacks run in the thread calling
+ * advance() while the wheel is locked, so once cancel() returns the
+ * callback is neither pending nor running. Callbacks may schedule and
+ * cancel timers themselves.
+ */
+class TimerWheel {
+public:
+	using clock = std::chrono::steady_clock;
+	using callback_t = unique_function<void ()>;
+
+	static constexpr int tick_ms = 10;
+
+private:
+	static constexpr int levels = 4;
+	static constexpr int slot_bits = 6;
+	static constexpr int nslots = 1 << slot_bits;
+	static constexpr uint64_t slot_mask = nslots - 1;
+	static constexpr uint64_t max_ticks = (uint64_t)1 << (levels * slot_bits);
+
+	std::recursive_mutex mutex;
+	TimerLink slots[levels][nslots];   // list heads
+	uint64_t occupied[levels];         // bit i set if slots[level][i] is non-empty
+	uint64_t now_tick;
+	uint64_t wakeup_tick;              // when the owner plans to call advance()
+	clock::time_point origin;
+	size_t count;
+
+	uint64_t to_tick(clock::time_point t) const;
+	void link(TimerNode *node);
+	void unlink(TimerNode *node);
+	void cascade(int level);
+	void tick();
+	uint64_t next_expiry() const;
+
+public:
+	TimerWheel();
+	~TimerWheel();
+
+	TimerWheel(const TimerWheel &) = delete;
+	TimerWheel& operator= (const TimerWheel &) = delete;
+
+	/* (re)arm node to fire after delay_ms. Returns true if it is due
+	 * before the wake-up planned by the last next_timeout(), i.e. the
+	 * thread driving the wheel has to be woken up.
+	 */
+	bool schedule(TimerNode &node, int delay_ms, callback_t callback);
+	// one-shot timer owned by the wheel
+	bool schedule(int delay_ms, callback_t callback);
+	void cancel(TimerNode &node);
+
+	// fire everything that is due
+	void advance();
+	// milliseconds until the next timer is due, -1 if none
+	int next_timeout();
+
+	size_t size();
+};
+
+
+#endif
@@ -0,0 +1,436 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+
+#include "tls.h"
+#include "eventloop.h"
+#include "pool.h"
+#include "debug.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+
+// the oldest error OpenSSL queued, for the log
+static std::string ssl_error() {
+	char buf[256];
+	auto code = ERR_get_error();
+	if(code == 0)
+		return errno ? strerror(errno) : "connection closed";
+	ERR_error_string_n(code, buf, sizeof(buf));
+	ERR_clear_error();
+	return buf;
+}
+
+// h2 if the client offers it, else http/1.1; neither: no ALPN at all
+static int select_protocol(SSL *ssl, const unsigned char **out, unsigned char *outlen,
+		const unsigned char *in, unsigned int inlen, void *arg) {
+	static const unsigned char protocols[] = "\x02h2\x08http/1.1";
+	if(SSL_select_next_proto((unsigned char **)out, outlen, protocols, sizeof(protocols) - 1,
+			in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+// whether the kernel took over both directions of ssl's socket
+static bool kernel_tls(SSL *ssl) {
+#ifndef OPENSSL_NO_KTLS
+	return BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl));
+#else
+	return false;
+#endif
+}
+
+
+/* One accepted connection: the handshake, then the relay between the
+ * client's records and the server's end of a socket pair, until both
+ * directions are closed. up is what goes to the server, down what goes to
+ * the client; each holds a pool buffer only while bytes wait in it.
+ */
+class TLSContext::Stream {
+	struct Buffer {
+		char *data = nullptr;
+		size_t size = 0, begin = 0, end = 0;
+
+		bool empty() const { return begin == end; }
+		char *take() {
+			if(!data) {
+				size = BufferPool::medium;
+				data = BufferPool::take(size);
+			}
+			begin = end = 0;
+			return data;
+		}
+		void release() {
+			if(data && empty()) {
+				BufferPool::give(data, size);
+				data = nullptr;
+			}
+		}
+	};
+
+	TLSContext &owner;
+	EventLoop &loop;
+	SSL *ssl;
+	int tcp;
+	int inner;         // the relay's end of the pair, -1 until the handshake is done
+	int timeout_ms;
+	ready_t ready;
+	TimerNode timer;   // the handshake, then the wait for the client's close
+	Buffer up;
+	Buffer down;
+	bool up_closed;    // the client closed, and the server has seen all it sent
+	bool down_closed;  // the server closed, and the client has got it all
+	uint32_t tcp_armed, inner_armed;  // watches waiting to fire
+
+	// watch what events asks for, unless a watch is already waiting
+	void arm(int fd, uint32_t &armed, uint32_t events);
+	void on_event();
+	void handshake();
+	void established();
+	void pump();
+	// close everything, and the stream is gone
+	void finish();
+
+public:
+	Stream(TLSContext &owner, EventLoop &loop, SSL *ssl, int conn, int timeout_ms, ready_t ready);
+	~Stream();
+
+	void start();
+	void close() { finish(); }
+};
+
+TLSContext::Stream::Stream(TLSContext &owner, EventLoop &loop, SSL *ssl, int conn, int timeout_ms,
+		ready_t ready) :
+	owner(owner),
+	loop(loop),
+	ssl(ssl),
+	tcp(conn),
+	inner(-1),
+	timeout_ms(timeout_ms),
+	ready(std::move(ready)),
+	timer(),
+	up(),
+	down(),
+	up_closed(false),
+	down_closed(false),
+	tcp_armed(0),
+	inner_armed(0)
+{
+	owner.streams.insert(this);
+}
+
+TLSContext::Stream::~Stream() {
+	owner.streams.erase(this);
+}
+
+void TLSContext::Stream::start() {
+	// a client that never finishes the handshake finds its socket shut down
+	loop.schedule(timer, timeout_ms, [this] { ::shutdown(tcp, SHUT_RDWR); });
+	on_event();
+}
+
+void TLSContext::Stream::arm(int fd, uint32_t &armed, uint32_t events) {
+	for(uint32_t bit : { IO_READ, IO_WRITE }) {
+		if(!(events & bit) || (armed & bit))
+			continue;
+		armed |= bit;
+		loop.watch(fd, bit, [this, &armed, bit](uint32_t) {
+			armed &= ~bit;
+			on_event();
+		});
+	}
+}
+
+void TLSContext::Stream::on_event() {
+	ERR_clear_error();
+	if(inner < 0)
+		handshake();
+	else
+		pump();
+}
+
+void TLSContext::Stream::handshake() {
+	int r = SSL_do_handshake(ssl);
+	if(r == 1) {
+		established();
+		return;
+	}
+	switch(SSL_get_error(ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+		arm(tcp, tcp_armed, IO_READ);
+		break;
+	case SSL_ERROR_WANT_WRITE:
+		arm(tcp, tcp_armed, IO_WRITE);
+		break;
+	default:
+		wlog("tls handshake on % failed: %\n", tcp, ssl_error());
+		finish();
+	}
+}
+
+void TLSContext::Stream::established() {
+	loop.cancel(timer);
+	loop.unwatch(tcp);
+	tcp_armed = 0;
+
+	static bool reported = false;
+	bool offloaded = kernel_tls(ssl);
+	if(!reported) {
+		reported = true;
+		if(offloaded)
+			wlog("tls: records handled by the kernel (kTLS)\n");
+		else
+			wlog("tls: no kernel TLS for both directions, relaying in user space\n");
+	}
+
+	if(offloaded) {
+		// the socket speaks plain text from here, blocking like any accepted one
+		int fd = tcp;
+		tcp = -1;
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+		auto ready = std::move(this->ready);
+		finish();
+		ready(fd);
+		return;
+	}
+
+	int pair[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) < 0) {
+		wlog("tls relay for % failed: %\n", tcp, strerror(errno));
+		finish();
+		return;
+	}
+	fcntl(pair[1], F_SETFL, O_NONBLOCK);
+	inner = pair[1];
+	ready(pair[0]);
+	pump();
+}
+
+void TLSContext::Stream::pump() {
+	uint32_t tcp_wants = 0, inner_wants = 0;
+	for(bool progress = true; progress; ) {
+		progress = false;
+
+		// client to server, a record at a time while the server takes it
+		if(!up_closed && up.empty()) {
+			auto *buf = up.take();
+			int n = SSL_read(ssl, buf, up.size);
+			if(n > 0) {
+				up.end = n;
+				progress = true;
+			} else switch(SSL_get_error(ssl, n)) {
+			case SSL_ERROR_WANT_READ:
+				tcp_wants |= IO_READ;
+				break;
+			case SSL_ERROR_WANT_WRITE:
+				tcp_wants |= IO_WRITE;
+				break;
+			case SSL_ERROR_ZERO_RETURN:
+				up_closed = true;
+				::shutdown(inner, SHUT_WR);
+				break;
+			default:
+				finish();
+				return;
+			}
+		}
+		if(!up.empty()) {
+			auto n = send(inner, up.data + up.begin, up.end - up.begin, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(n > 0) {
+				up.begin += n;
+				progress = true;
+			} else if(errno == EINTR) {
+				progress = true;
+			} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				inner_wants |= IO_WRITE;
+			} else {
+				finish();
+				return;
+			}
+		}
+
+		// server to client
+		if(!down_closed && down.empty()) {
+			auto *buf = down.take();
+			auto n = recv(inner, buf, down.size, MSG_DONTWAIT);
+			if(n > 0) {
+				down.end = n;
+				progress = true;
+			} else if(n == 0) {
+				/* close_notify, then the client's close or the timer ends
+				 * the stream; what it still sends goes to the server, which
+				 * may be skipping an unread body
+				 */
+				down_closed = true;
+				SSL_shutdown(ssl);
+				::shutdown(tcp, SHUT_WR);
+				loop.schedule(timer, timeout_ms, [this] { ::shutdown(tcp, SHUT_RDWR); });
+			} else if(errno == EINTR) {
+				progress = true;
+			} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				inner_wants |= IO_READ;
+			} else {
+				finish();
+				return;
+			}
+		}
+		if(!down.empty()) {
+			int n = SSL_write(ssl, down.data + down.begin, down.end - down.begin);
+			if(n > 0) {
+				down.begin += n;
+				progress = true;
+			} else switch(SSL_get_error(ssl, n)) {
+			case SSL_ERROR_WANT_WRITE:
+				tcp_wants |= IO_WRITE;
+				break;
+			case SSL_ERROR_WANT_READ:
+				tcp_wants |= IO_READ;
+				break;
+			default:
+				finish();
+				return;
+			}
+		}
+	}
+
+	if(up_closed && down_closed) {
+		finish();
+		return;
+	}
+	up.release();
+	down.release();
+	arm(tcp, tcp_armed, tcp_wants);
+	arm(inner, inner_armed, inner_wants);
+}
+
+void TLSContext::Stream::finish() {
+	loop.cancel(timer);
+	if(tcp >= 0) {
+		loop.unwatch(tcp);
+		::close(tcp);
+	}
+	if(inner >= 0) {
+		loop.unwatch(inner);
+		::close(inner);
+	}
+	SSL_free(ssl);
+	up.begin = up.end = down.begin = down.end = 0;
+	up.release();
+	down.release();
+	delete this;
+}
+
+
+TLSContext::TLSContext() :
+	ctx(nullptr),
+	streams()
+{
+}
+
+TLSContext::~TLSContext() {
+	close_all();
+	SSL_CTX_free(ctx);
+}
+
+bool TLSContext::load(const std::string &cert, const std::string &key, const std::string &ticket_keys) {
+	SSL_CTX_free(ctx);
+	ctx = SSL_CTX_new(TLS_server_method());
+	if(!ctx) {
+		wlog("tls: %\n", ssl_error());
+		return false;
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	// a client gone without close_notify ends its stream like one that sent it
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF |
+		SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE);
+	// an idle connection keeps no record buffers
+	SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS | SSL_MODE_ENABLE_PARTIAL_WRITE |
+		SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	if(SSL_CTX_use_certificate_chain_file(ctx, cert.c_str()) != 1) {
+		wlog("tls: cannot load certificate %: %\n", cert, ssl_error());
+		return false;
+	}
+	if(SSL_CTX_use_PrivateKey_file(ctx, key.c_str(), SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(ctx) != 1) {
+		wlog("tls: cannot load key % for %: %\n", key, cert, ssl_error());
+		return false;
+	}
+
+	SSL_CTX_set_alpn_select_cb(ctx, select_protocol, nullptr);
+
+	// tickets (the default) for clients that take them, the cache for the others
+	static const unsigned char context[] = "HttpServer";
+	SSL_CTX_set_session_id_context(ctx, context, sizeof(context) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	if(!ticket_keys.empty()) {
+		std::ifstream in(ticket_keys, std::ios::binary);
+		std::string keys((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		// name, HMAC secret and AES key, 16 + 32 + 32 bytes
+		if(keys.size() != 80) {
+			wlog("tls: ticket keys % must be 80 bytes, not %\n", ticket_keys, keys.size());
+			return false;
+		}
+		SSL_CTX_set_tlsext_ticket_keys(ctx, keys.data(), keys.size());
+	}
+
+	wlog("tls: certificate %, %\n", cert,
+		ticket_keys.empty() ? std::string("ticket keys of this process") : "ticket keys from " + ticket_keys);
+	return true;
+}
+
+void TLSContext::accept(EventLoop &loop, int conn, int timeout_ms, ready_t ready) {
+	SSL *ssl = ctx ? SSL_new(ctx) : nullptr;
+	if(!ssl || SSL_set_fd(ssl, conn) != 1) {
+		wlog("tls: no session for %: %\n", conn, ssl_error());
+		SSL_free(ssl);
+		::close(conn);
+		return;
+	}
+	SSL_set_accept_state(ssl);
+	fcntl(conn, F_SETFL, fcntl(conn, F_GETFL) | O_NONBLOCK);
+
+	auto *stream = new Stream(*this, loop, ssl, conn, timeout_ms, std::move(ready));
+	stream->start();
+}
+
+void TLSContext::close_all() {
+	while(!streams.empty())
+		(*streams.begin())->close();
+}
+
+#else
+
+class TLSContext::Stream {
+};
+
+TLSContext::TLSContext() :
+	ctx(nullptr),
+	streams()
+{
+}
+
+TLSContext::~TLSContext() {
+}
+
+bool TLSContext::load(const std::string &cert, const std::string &key, const std::string &ticket_keys) {
+	wlog("tls: built without OpenSSL\n");
+	return false;
+}
+
+void TLSContext::accept(EventLoop &loop, int conn, int timeout_ms, ready_t ready) {
+	::close(conn);
+}
+
+void TLSContext::close_all() {
+}
+
+#endif
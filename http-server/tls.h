@@ -0,0 +1,66 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <string>
+#include <unordered_set>
+
+#include "unique_function.h"
+
+class EventLoop;
+struct ssl_ctx_st;
+
+
+/* TLS for the listeners marked tls: (see Listener), terminated in the
+ * event loop. After the handshake the server reads and writes plain HTTP
+ * on the fd it is handed, like on any accepted socket:
+ *
+ *  - the socket itself, once the kernel took over the records in both
+ *    directions (kTLS); sendfile() then still sends files without a copy
+ *  - else one end of a socket pair, and the loop relays between the other
+ *    end and the TLS session
+ *
+ * ALPN picks h2 when the client offers it, http/1.1 otherwise. Sessions
+ * resume from tickets, or else from the server's cache; the ticket keys
+ * are random per process unless loaded from a file, which lets tickets
+ * outlive an upgrade.
+ *
+ * Without OpenSSL at build time load() fails, and so does every tls:
+ * listener.
+ */
+class TLSContext {
+public:
+	// the fd to serve, in the loop thread
+	using ready_t = unique_function<void (int fd)>;
+
+private:
+	class Stream;
+
+	struct ssl_ctx_st *ctx;
+	// loop thread only: handshakes and relays in progress
+	std::unordered_set<Stream *> streams;
+
+	friend class Stream;
+public:
+	TLSContext();
+	~TLSContext();
+
+	TLSContext(const TLSContext &) = delete;
+	TLSContext& operator= (const TLSContext &) = delete;
+
+	/* cert: PEM chain, leaf first; key: its PEM private key; ticket_keys:
+	 * a file of 80 random bytes, or empty. false, after logging why, if
+	 * any of them does not load
+	 */
+	bool load(const std::string &cert, const std::string &key, const std::string &ticket_keys = "");
+
+	/* loop thread: the handshake on conn, fresh from accept, within
+	 * timeout_ms; then ready. conn is closed if the handshake fails.
+	 */
+	void accept(EventLoop &loop, int conn, int timeout_ms, ready_t ready);
+
+	// loop thread: end every handshake and relay, as the loop stops
+	void close_all();
+};
+
+
+#endif
@@ -0,0 +1,228 @@
+/* Packs a directory into one bundle file for HttpServer --bundle={file}.
+ * The format is described in bundle.h.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "argv.h"
+#include "bundle.h"
+#include "file.h"
+#include "manifest.h"
+#include "mime.h"
+
+static cl::opt<std::string> WorkDirectory(cl::BothOpt, "w", "work-directory");
+static cl::opt<std::string> Output(cl::BothOpt, "o", "output");
+static cl::opt<void> NoGzip(cl::LongOpt, "no-gzip");
+static cl::opt<void> Help(cl::BothOpt, "h", "help");
+
+struct Item {
+	AssetPtr asset;
+	std::string content;
+	std::string gzip;
+	std::string header;
+	std::string gzip_header;
+	std::string etag;
+	std::string gzip_etag;
+	BundleEntry entry;
+};
+
+static bool compressible(const std::string &suffix) {
+	auto type = mime_type(suffix);
+	if(!type.empty())
+		return type.startsWith("text/") || type.endsWith("+xml") || type.endsWith("/xml")
+			|| type.endsWith("/json") || type == "application/wasm";
+	return suffix == "txt";
+}
+
+static std::string gzip(const std::string &data) {
+#ifdef HAVE_ZLIB
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// 15 + 16: gzip framing rather than zlib
+	if(deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+		return "";
+
+	std::string out(deflateBound(&stream, data.size()), '\0');
+	stream.next_in = (Bytef *)data.data();
+	stream.avail_in = data.size();
+	stream.next_out = (Bytef *)&out[0];
+	stream.avail_out = out.size();
+	int ret = deflate(&stream, Z_FINISH);
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+	return ret == Z_STREAM_END ? out : "";
+#else
+	return "";
+#endif
+}
+
+static std::string etag_of(const std::string &content) {
+	char buf[sizeof(BundleEntry::etag)];
+	snprintf(buf, sizeof(buf), "\"%016llx\"", (unsigned long long)bundle_hash(content));
+	return buf;
+}
+
+static uint64_t align(uint64_t offset, uint64_t size) {
+	uint64_t alignment = size >= 64 * 1024 ? 4096 : bundle_alignment;
+	return (offset + alignment - 1) / alignment * alignment;
+}
+
+int main(int argc, const char **argv) {
+	cl::Argv::parseCommandline(argc, argv);
+
+	if(Help || !WorkDirectory || !Output) {
+		std::clog << "usage:\n";
+		std::clog << "<bin> -w {dir}/--work-directory={dir} -o {file}/--output={file}\n";
+		std::clog << "<bin> --no-gzip\n";
+		std::clog << "\n";
+		return Help ? 0 : 1;
+	}
+
+	auto manifest = Manifest::build(WorkDirectory.value());
+	if(manifest->size() == 0) {
+		std::clog << WorkDirectory.value() << " is empty or not a directory\n";
+		return 1;
+	}
+
+	// sorted, so the same tree always gives the same bundle
+	std::vector<Item> items;
+	for(auto &kv : manifest->entries())
+		items.push_back(Item { kv.second, "", "", "", "", "", "", BundleEntry() });
+	std::sort(items.begin(), items.end(), [](const Item &a, const Item &b) {
+		return a.asset->path < b.asset->path;
+	});
+
+	std::unordered_map<std::string, uint32_t> numbers;
+	for(uint32_t i = 0; i < items.size(); i++)
+		numbers[items[i].asset->path] = i + 1;
+
+	size_t compressed = 0;
+	for(auto &item : items) {
+		auto &asset = *item.asset;
+		memset(&item.entry, 0, sizeof(item.entry));
+		item.entry.hash = bundle_hash(asset.path);
+		if(asset.directory) {
+			item.entry.flags = BUNDLE_DIRECTORY;
+			if(!asset.index.empty())
+				item.entry.index = numbers[asset.index];
+			continue;
+		}
+
+		item.content = File(asset.fullpath).readall();
+		item.etag = etag_of(item.content);
+		strcpy(item.entry.etag, item.etag.c_str());
+
+		auto suffix = File(asset.path).file_suffix();
+		if(!NoGzip && item.content.size() >= 256 && compressible(suffix)) {
+			item.gzip = gzip(item.content);
+			if(item.gzip.size() * 10 >= item.content.size() * 9)
+				item.gzip.clear();
+		}
+
+		std::string common;
+		auto type = mime_type(suffix);
+		if(!type.empty())
+			common += "Content-Type: " + type.str() + "\r\n";
+		if(!item.gzip.empty()) {
+			// each encoding is its own representation with its own tag
+			item.gzip_etag = etag_of(item.gzip);
+			strcpy(item.entry.gzip_etag, item.gzip_etag.c_str());
+			common += "Vary: Accept-Encoding\r\n";
+			item.gzip_header = common + "Content-Encoding: gzip\r\n"
+				+ "ETag: " + item.gzip_etag + "\r\n"
+				+ "Content-Length: " + std::to_string(item.gzip.size()) + "\r\n";
+			compressed++;
+		}
+		item.header = common + "ETag: " + item.etag + "\r\n"
+			+ "Content-Length: " + std::to_string(item.content.size()) + "\r\n";
+	}
+
+	uint32_t nslots = 16;
+	while(nslots < items.size() * 2)
+		nslots *= 2;
+	std::vector<uint32_t> slots(nslots, 0);
+	for(uint32_t i = 0; i < items.size(); i++) {
+		auto slot = items[i].entry.hash & (nslots - 1);
+		while(slots[slot])
+			slot = (slot + 1) & (nslots - 1);
+		slots[slot] = i + 1;
+	}
+
+	// paths and header lines follow the index, bodies come last
+	uint64_t offset = sizeof(BundleHeader) + items.size() * sizeof(BundleEntry)
+		+ nslots * sizeof(uint32_t);
+	std::string strings;
+	auto add_string = [&](const std::string &s) {
+		BundleRange range { offset + strings.size(), s.size() };
+		strings += s;
+		return range;
+	};
+	for(auto &item : items) {
+		item.entry.path = add_string(item.asset->path);
+		item.entry.header = add_string(item.header);
+		item.entry.gzip_header = add_string(item.gzip_header);
+	}
+	offset += strings.size();
+
+	for(auto &item : items) {
+		offset = align(offset, item.content.size());
+		item.entry.body = BundleRange { offset, item.content.size() };
+		offset += item.content.size();
+		offset = align(offset, item.gzip.size());
+		item.entry.gzip_body = BundleRange { offset, item.gzip.size() };
+		offset += item.gzip.size();
+	}
+
+	BundleHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, bundle_magic, sizeof(header.magic));
+	header.version = bundle_version;
+	header.count = items.size();
+	header.nslots = nslots;
+	header.file_size = offset;
+
+	// written aside and renamed, a running server never maps half a bundle
+	auto output = Output.value();
+	auto temporary = output + ".tmp";
+	std::ofstream ofs(temporary, std::ios::binary | std::ios::trunc);
+	ofs.write((const char *)&header, sizeof(header));
+	for(auto &item : items)
+		ofs.write((const char *)&item.entry, sizeof(item.entry));
+	ofs.write((const char *)slots.data(), slots.size() * sizeof(uint32_t));
+	ofs << strings;
+
+	auto pad_to = [&ofs](uint64_t position) {
+		uint64_t current = ofs.tellp();
+		if(position > current)
+			ofs << std::string(position - current, '\0');
+	};
+	for(auto &item : items) {
+		pad_to(item.entry.body.offset);
+		ofs << item.content;
+		pad_to(item.entry.gzip_body.offset);
+		ofs << item.gzip;
+	}
+	pad_to(offset);
+	ofs.close();
+
+	if(!ofs || rename(temporary.c_str(), output.c_str()) < 0) {
+		std::clog << "fail to write " << output << "\n";
+		remove(temporary.c_str());
+		return 1;
+	}
+
+	std::clog << output << ": " << items.size() << " entries, " << compressed
+		<< " precompressed, " << offset << " bytes\n";
+	return 0;
+}
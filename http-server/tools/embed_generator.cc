@@ -0,0 +1,172 @@
+/* Writes a C++ source that carries a directory, for HttpServer built with
+ * -DEMBED_DIRECTORY={dir}; embedded.h is its interface.
+ */
+#include <stdio.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "argv.h"
+#include "bundle.h"
+#include "file.h"
+#include "manifest.h"
+#include "mime.h"
+
+static cl::opt<std::string> WorkDirectory(cl::BothOpt, "w", "work-directory");
+static cl::opt<std::string> Output(cl::BothOpt, "o", "output");
+static cl::opt<void> Help(cl::BothOpt, "h", "help");
+
+// bytes as a C++ string literal, split over lines
+static void write_literal(std::ostream &os, const std::string &data) {
+	constexpr size_t line = 80;
+	std::string s = "\t\"";
+	for(size_t i = 0; i < data.size(); i++) {
+		unsigned char c = data[i];
+		// '?' is escaped against trigraphs
+		if(c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?') {
+			s += c;
+		} else {
+			char escape[5];
+			snprintf(escape, sizeof(escape), "\\%03o", c);
+			s += escape;
+		}
+		if(s.size() >= line && i + 1 < data.size()) {
+			os << s << "\"\n";
+			s = "\t\"";
+		}
+	}
+	os << s << "\"";
+}
+
+static std::string quote(const std::string &s) {
+	std::ostringstream oss;
+	write_literal(oss, s);
+	return oss.str().substr(1);
+}
+
+int main(int argc, const char **argv) {
+	cl::Argv::parseCommandline(argc, argv);
+
+	if(Help || !WorkDirectory || !Output) {
+		std::clog << "usage:\n";
+		std::clog << "<bin> -w {dir}/--work-directory={dir} -o {file}/--output={file}\n";
+		std::clog << "\n";
+		return Help ? 0 : 1;
+	}
+
+	auto manifest = Manifest::build(WorkDirectory.value());
+	if(manifest->size() == 0) {
+		std::clog << WorkDirectory.value() << " is empty or not a directory\n";
+		return 1;
+	}
+
+	std::vector<AssetPtr> assets;
+	for(auto &kv : manifest->entries())
+		assets.push_back(kv.second);
+	std::sort(assets.begin(), assets.end(), [](const AssetPtr &a, const AssetPtr &b) {
+		return a->path < b->path;
+	});
+	std::unordered_map<std::string, size_t> numbers;
+	for(size_t i = 0; i < assets.size(); i++)
+		numbers[assets[i]->path] = i + 1;
+
+	// written aside and renamed, make never compiles half a file
+	auto output = Output.value();
+	auto temporary = output + ".tmp";
+	std::ofstream ofs(temporary, std::ios::trunc);
+	ofs << "// generated by embed-generator from " << manifest->directory() << ", do not edit\n";
+	ofs << "#include <array>\n\n";
+	ofs << "#include \"embedded.h\"\n";
+	ofs << "#include \"manifest.h\"\n";
+	ofs << "#include \"perfect_hash.h\"\n\n";
+	ofs << "namespace {\n\n";
+
+	std::vector<std::string> entries;
+	size_t bytes = 0;
+	for(size_t i = 0; i < assets.size(); i++) {
+		auto &asset = *assets[i];
+		std::ostringstream entry;
+		if(asset.directory) {
+			entry << "\t{ " << quote(asset.path) << ", true, "
+				<< (asset.index.empty() ? 0 : numbers[asset.index]) << ", {}, {}, {} },\n";
+			entries.push_back(entry.str());
+			continue;
+		}
+
+		auto content = File(asset.fullpath).readall();
+		bytes += content.size();
+		char etag[32];
+		snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)bundle_hash(content));
+
+		std::string header;
+		auto type = mime_type_of(asset.path);
+		if(!type.empty())
+			header += "Content-Type: " + type.str() + "\r\n";
+		header += std::string("ETag: ") + etag + "\r\n";
+		header += "Content-Length: " + std::to_string(content.size()) + "\r\n";
+
+		ofs << "// " << asset.path << "\n";
+		ofs << "alignas(64) constexpr char body_" << i << "[] =\n";
+		write_literal(ofs, content);
+		ofs << ";\n\n";
+
+		entry << "\t{ " << quote(asset.path) << ", false, 0, " << quote(header)
+			<< ", std::string_view(body_" << i << ", sizeof(body_" << i << ") - 1), "
+			<< quote(etag) << " },\n";
+		entries.push_back(entry.str());
+	}
+
+	ofs << "constexpr std::array<EmbeddedAsset, " << assets.size() << "> assets = {{\n";
+	for(auto &entry : entries)
+		ofs << entry;
+	ofs << "}};\n\n";
+
+	ofs << "constexpr std::array<std::string_view, " << assets.size() << "> paths = {\n";
+	for(auto &asset : assets)
+		ofs << "\t" << quote(asset->path) << ",\n";
+	ofs << "};\n\n";
+
+	ofs << "constexpr PerfectHash<" << assets.size() << "> table(paths);\n\n";
+	ofs << R"(const EmbeddedAsset *lookup(std::string_view path) {
+	int i = table.find(normalize_path(path));
+	return i < 0 ? nullptr : &assets[i];
+}
+
+}
+
+namespace embedded {
+
+const EmbeddedAsset *find(std::string_view path) {
+	auto *asset = lookup(path);
+	if(asset && asset->directory && asset->index)
+		return &assets[asset->index - 1];
+	return asset;
+}
+
+bool is_directory(std::string_view path) {
+	auto *asset = lookup(path);
+	return asset && asset->directory;
+}
+
+size_t size() {
+	return assets.size();
+}
+
+}
+)";
+	ofs.close();
+
+	if(!ofs || rename(temporary.c_str(), output.c_str()) < 0) {
+		std::clog << "fail to write " << output << "\n";
+		remove(temporary.c_str());
+		return 1;
+	}
+
+	std::clog << output << ": " << assets.size() << " entries, " << bytes << " bytes embedded\n";
+	return 0;
+}
@@ -0,0 +1,70 @@
+#!/usr/bin/env python3
+"""Memory an idle keep-alive connection costs the server.
+
+usage: idle_rss.py PID PORT [N]
+
+Opens N (default 10000) connections to the server running as PID on
+127.0.0.1:PORT, makes one request on each and leaves them idle, then
+reports how much the server's RSS grew per connection. The kernel's socket
+buffers are not in RSS. Both sides need a descriptor limit above N
+(ulimit -n); past ~28000 connections the client spreads over several
+loopback source addresses to get enough ports.
+"""
+
+import resource
+import socket
+import sys
+import time
+
+
+def rss(pid):
+	with open("/proc/%d/status" % pid) as f:
+		for line in f:
+			if line.startswith("VmRSS:"):
+				return int(line.split()[1]) * 1024
+	raise RuntimeError("no VmRSS for pid %d" % pid)
+
+
+def main():
+	if len(sys.argv) < 3:
+		sys.exit(__doc__)
+	pid, port = int(sys.argv[1]), int(sys.argv[2])
+	n = int(sys.argv[3]) if len(sys.argv) > 3 else 10000
+
+	soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+	if soft < n + 64:
+		resource.setrlimit(resource.RLIMIT_NOFILE, (min(n + 64, hard), hard))
+
+	request = b"GET /add/1/2 HTTP/1.1\r\nHost: localhost\r\n\r\n"
+	per_source = 25000
+
+	# warm up, so pools and threads are not counted as connection cost
+	warm = socket.create_connection(("127.0.0.1", port))
+	warm.sendall(request)
+	warm.recv(4096)
+	warm.close()
+	time.sleep(1)
+	before = rss(pid)
+
+	conns = []
+	for i in range(n):
+		source = ("127.0.0.%d" % (1 + i // per_source), 0)
+		s = socket.create_connection(("127.0.0.1", port), source_address=source)
+		s.sendall(request)
+		conns.append(s)
+	for s in conns:
+		if not s.recv(4096):
+			sys.exit("server closed a connection")
+
+	# let the workers hand every connection back to the loop
+	time.sleep(2)
+	after = rss(pid)
+
+	print("%d idle connections: RSS %.1f MB -> %.1f MB, %d bytes per connection"
+			% (n, before / 1e6, after / 1e6, (after - before) // n))
+	for s in conns:
+		s.close()
+
+
+if __name__ == "__main__":
+	main()
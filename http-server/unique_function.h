@@ -0,0 +1,128 @@
+#ifndef UNIQUE_FUNCTION_H
+#define UNIQUE_FUNCTION_H
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+
+template<class Signature>
+class unique_function;
+
+/* std::function without the copy: a move-only callable wrapper, so a task
+ * can own what it captures (a connection, a coroutine's result) instead of
+ * sharing it. Callables of up to inline_size bytes that move without
+ * throwing are kept in place and cost no allocation; larger ones go to the
+ * heap once, and moving the wrapper never copies them.
+ */
+template<class R, class... Args>
+class unique_function<R (Args...)> {
+public:
+	static constexpr size_t inline_size = 4 * sizeof(void *);
+
+private:
+	struct Ops {
+		R (*invoke)(void *self, Args &&...args);
+		// move-construct into to and destroy what is left in from
+		void (*relocate)(void *to, void *from) noexcept;
+		void (*destroy)(void *self) noexcept;
+	};
+
+	template<class F>
+	static constexpr bool stored_inline = sizeof(F) <= inline_size
+		&& alignof(F) <= alignof(void *) && std::is_nothrow_move_constructible<F>::value;
+
+	template<class F>
+	static F *target(void *self) {
+		if constexpr (stored_inline<F>)
+			return std::launder(reinterpret_cast<F *>(self));
+		else
+			return *reinterpret_cast<F **>(self);
+	}
+
+	template<class F>
+	static constexpr Ops ops_for = {
+		[](void *self, Args &&...args) -> R {
+			return std::invoke(*target<F>(self), std::forward<Args>(args)...);
+		},
+		[](void *to, void *from) noexcept {
+			if constexpr (stored_inline<F>) {
+				::new(to) F(std::move(*target<F>(from)));
+				target<F>(from)->~F();
+			} else {
+				*reinterpret_cast<F **>(to) = target<F>(from);
+			}
+		},
+		[](void *self) noexcept {
+			if constexpr (stored_inline<F>)
+				target<F>(self)->~F();
+			else
+				delete target<F>(self);
+		},
+	};
+
+	const Ops *ops;
+	alignas(void *) mutable unsigned char storage[inline_size];
+
+	void reset() noexcept {
+		if(ops)
+			ops->destroy(storage);
+		ops = nullptr;
+	}
+
+public:
+	unique_function() noexcept : ops(nullptr) {}
+	unique_function(std::nullptr_t) noexcept : ops(nullptr) {}
+
+	template<class F, class D = std::decay_t<F>, class = std::enable_if_t<
+		!std::is_same<D, unique_function>::value && std::is_invocable_r<R, D &, Args...>::value>>
+	unique_function(F &&f) :
+		ops(&ops_for<D>)
+	{
+		if constexpr (stored_inline<D>)
+			::new(static_cast<void *>(storage)) D(std::forward<F>(f));
+		else
+			*reinterpret_cast<D **>(storage) = new D(std::forward<F>(f));
+	}
+
+	unique_function(unique_function &&that) noexcept :
+		ops(that.ops)
+	{
+		if(ops)
+			ops->relocate(storage, that.storage);
+		that.ops = nullptr;
+	}
+
+	unique_function& operator= (unique_function &&that) noexcept {
+		if(this != &that) {
+			reset();
+			ops = that.ops;
+			if(ops)
+				ops->relocate(storage, that.storage);
+			that.ops = nullptr;
+		}
+		return *this;
+	}
+
+	unique_function& operator= (std::nullptr_t) noexcept {
+		reset();
+		return *this;
+	}
+
+	unique_function(const unique_function &) = delete;
+	unique_function& operator= (const unique_function &) = delete;
+
+	~unique_function() { reset(); }
+
+	explicit operator bool() const noexcept { return ops != nullptr; }
+
+	// const like std::function's, the target may still change its state
+	R operator()(Args... args) const {
+		return ops->invoke(storage, std::forward<Args>(args)...);
+	}
+};
+
+
+#endif
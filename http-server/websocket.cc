@@ -0,0 +1,624 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "websocket.h"
+#include "eventloop.h"
+#include "pool.h"
+#include "debug.h"
+
+
+namespace websocket {
+
+static void encode_header(Opcode opcode, uint64_t length, std::string &out) {
+	out += char(0x80 | opcode);
+	if(length < 126) {
+		out += char(length);
+	} else if(length <= 0xffff) {
+		out += char(126);
+		out += char(length >> 8);
+		out += char(length);
+	} else {
+		out += char(127);
+		for(int shift = 56; shift >= 0; shift -= 8)
+			out += char(length >> shift);
+	}
+}
+
+Frame frame(Opcode opcode, std::string_view payload) {
+	auto s = std::make_shared<std::string>();
+	s->reserve(payload.size() + 10);
+	encode_header(opcode, payload.size(), *s);
+	s->append(payload);
+	return s;
+}
+
+Frame close_frame(uint16_t code, std::string_view reason) {
+	std::string payload;
+	if(code) {
+		payload += char(code >> 8);
+		payload += char(code);
+		// a control frame carries 125 bytes at most
+		payload.append(reason.substr(0, 123));
+	}
+	return frame(CLOSE, payload);
+}
+
+size_t parse_header(const char *data, size_t n, Header &header) {
+	if(n < 2)
+		return 0;
+	auto *p = (const uint8_t *)data;
+	header.fin = p[0] & 0x80;
+	header.rsv = (p[0] >> 4) & 0x7;
+	header.opcode = Opcode(p[0] & 0xf);
+	header.masked = p[1] & 0x80;
+
+	size_t size = 2;
+	uint64_t length = p[1] & 0x7f;
+	int extended = length == 126 ? 2 : length == 127 ? 8 : 0;
+	size_t need = size + extended + (header.masked ? 4 : 0);
+	if(n < need)
+		return 0;
+	if(extended) {
+		length = 0;
+		for(int i = 0; i < extended; i++)
+			length = length << 8 | p[size + i];
+		size += extended;
+	}
+	header.length = length;
+	if(header.masked) {
+		memcpy(header.key, p + size, 4);
+		size += 4;
+	}
+	return size;
+}
+
+void unmask(char *data, size_t n, const uint8_t key[4]) {
+	uint32_t key32;
+	memcpy(&key32, key, 4);
+	size_t i = 0;
+#ifdef __SSE2__
+	// 64 bytes per step, then 16; every step starts on a multiple of 4, where the key starts over
+	const __m128i mask = _mm_set1_epi32(key32);
+	for(; i + 64 <= n; i += 64) {
+		auto *p = (__m128i *)(data + i);
+		__m128i a = _mm_loadu_si128(p), b = _mm_loadu_si128(p + 1);
+		__m128i c = _mm_loadu_si128(p + 2), d = _mm_loadu_si128(p + 3);
+		_mm_storeu_si128(p, _mm_xor_si128(a, mask));
+		_mm_storeu_si128(p + 1, _mm_xor_si128(b, mask));
+		_mm_storeu_si128(p + 2, _mm_xor_si128(c, mask));
+		_mm_storeu_si128(p + 3, _mm_xor_si128(d, mask));
+	}
+	for(; i + 16 <= n; i += 16) {
+		auto *p = (__m128i *)(data + i);
+		_mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), mask));
+	}
+#endif
+	uint64_t key64 = uint64_t(key32) << 32 | key32;
+	for(; i + 8 <= n; i += 8) {
+		uint64_t word;
+		memcpy(&word, data + i, 8);
+		word ^= key64;
+		memcpy(data + i, &word, 8);
+	}
+	for(; i < n; i++)
+		data[i] ^= key[i & 3];
+}
+
+bool valid_utf8(std::string_view s) {
+	auto *p = (const uint8_t *)s.data();
+	size_t n = s.size(), i = 0;
+	while(i < n) {
+		// plain ASCII 8 bytes at a time
+		if(i + 8 <= n) {
+			uint64_t word;
+			memcpy(&word, p + i, 8);
+			if(!(word & 0x8080808080808080ull)) {
+				i += 8;
+				continue;
+			}
+		}
+		uint8_t c = p[i];
+		if(c < 0x80) {
+			i++;
+			continue;
+		}
+
+		// the bounds of the second byte exclude overlong forms, surrogates and beyond U+10FFFF
+		int more;
+		uint8_t lo = 0x80, hi = 0xbf;
+		if(c >= 0xc2 && c <= 0xdf) more = 1;
+		else if(c == 0xe0) more = 2, lo = 0xa0;
+		else if(c == 0xed) more = 2, hi = 0x9f;
+		else if(c >= 0xe1 && c <= 0xef) more = 2;
+		else if(c == 0xf0) more = 3, lo = 0x90;
+		else if(c == 0xf4) more = 3, hi = 0x8f;
+		else if(c >= 0xf1 && c <= 0xf3) more = 3;
+		else return false;
+
+		if(n - i <= size_t(more))
+			return false;
+		if(p[i + 1] < lo || p[i + 1] > hi)
+			return false;
+		for(int k = 2; k <= more; k++) {
+			if((p[i + k] & 0xc0) != 0x80)
+				return false;
+		}
+		i += more + 1;
+	}
+	return true;
+}
+
+
+// SHA-1 (RFC 3174), for the handshake only
+static void sha1(std::string_view data, uint8_t digest[20]) {
+	uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+	auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+
+	std::string msg(data);
+	uint64_t bits = uint64_t(data.size()) * 8;
+	msg += char(0x80);
+	while(msg.size() % 64 != 56)
+		msg += char(0);
+	for(int shift = 56; shift >= 0; shift -= 8)
+		msg += char(bits >> shift);
+
+	for(size_t block = 0; block < msg.size(); block += 64) {
+		auto *p = (const uint8_t *)msg.data() + block;
+		uint32_t w[80];
+		for(int i = 0; i < 16; i++)
+			w[i] = uint32_t(p[4 * i]) << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+		for(int i = 16; i < 80; i++)
+			w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for(int i = 0; i < 80; i++) {
+			uint32_t f, k;
+			if(i < 20)      f = (b & c) | (~b & d),          k = 0x5a827999;
+			else if(i < 40) f = b ^ c ^ d,                   k = 0x6ed9eba1;
+			else if(i < 60) f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+			else            f = b ^ c ^ d,                   k = 0xca62c1d6;
+			uint32_t t = rotl(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = rotl(b, 30);
+			b = a;
+			a = t;
+		}
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+	}
+
+	for(int i = 0; i < 20; i++)
+		digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+std::string accept_key(std::string_view key) {
+	static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+	uint8_t digest[21] = {};
+	sha1(std::string(key) + guid, digest);
+
+	// 20 bytes: six groups of three and a last one of two, padded
+	std::string out;
+	for(int i = 0; i < 21; i += 3) {
+		uint32_t v = digest[i] << 16 | digest[i + 1] << 8 | digest[i + 2];
+		out += alphabet[(v >> 18) & 63];
+		out += alphabet[(v >> 12) & 63];
+		out += i + 1 < 20 ? alphabet[(v >> 6) & 63] : '=';
+		out += i + 2 < 20 ? alphabet[v & 63] : '=';
+	}
+	return out;
+}
+
+}
+
+
+WebSocketRoute::WebSocketRoute(const std::string &key, const WebSocketHandler &handler) :
+	pattern(key),
+	handler(handler)
+{
+}
+
+bool WebSocketRoute::match(std::string_view path) const {
+	return std::regex_match(path.begin(), path.end(), pattern);
+}
+
+
+WebSocket::WebSocket(ConnectionPtr c, EventLoop &loop, const WebSocketHandler &handler,
+		std::string path, const HTTPLimits &limits, std::string received) :
+	c(std::move(c)),
+	fd(this->c->fd),
+	loop(loop),
+	handler(handler),
+	_path(std::move(path)),
+	max_message(limits.max_body_size),
+	write_timeout(limits.write_timeout),
+	on_finished(),
+	in(std::move(received)),
+	message(),
+	message_opcode(websocket::CONTINUATION),
+	input_done(false),
+	mutex(),
+	queue(),
+	sent(0),
+	backlog(0),
+	writing(false),
+	close_sent(false),
+	finished(false),
+	close_code(websocket::ABNORMAL)
+{
+}
+
+void WebSocket::start(finished_t on_finished) {
+	this->on_finished = std::move(on_finished);
+	if(handler.on_open)
+		handler.on_open(shared_from_this());
+
+	if(!in.empty()) {
+		auto used = consume(&in[0], in.size());
+		in.erase(0, used);
+	}
+	if(!finished) {
+		loop.watch(fd, IO_READ, [self = shared_from_this()](uint32_t events) {
+			self->on_readable();
+		});
+	}
+}
+
+bool WebSocket::enqueue(websocket::Frame frame) {
+	if(finished || close_sent)
+		return false;
+	backlog += frame->size();
+	queue.push_back(std::move(frame));
+	if(backlog > max_backlog) {
+		// the loop reads EOF and finishes it
+		wlog("websocket % is % bytes behind, dropping it\n", fd, backlog);
+		::shutdown(fd, SHUT_RDWR);
+		return false;
+	}
+	if(writing)
+		return false;
+	writing = true;
+	return true;
+}
+
+bool WebSocket::enqueue_close(uint16_t code, std::string_view reason) {
+	if(finished || close_sent)
+		return false;
+	auto frame = websocket::close_frame(code, reason);
+	backlog += frame->size();
+	queue.push_back(std::move(frame));
+	close_sent = true;
+	if(writing)
+		return false;
+	writing = true;
+	return true;
+}
+
+bool WebSocket::send(websocket::Frame frame) {
+	std::unique_lock<std::mutex> lock(mutex);
+	bool open = !finished && !close_sent;
+	if(enqueue(std::move(frame))) {
+		lock.unlock();
+		loop.post([self = shared_from_this()] { self->flush(); });
+	}
+	return open;
+}
+
+bool WebSocket::send(std::string_view message, websocket::Opcode opcode) {
+	return send(websocket::frame(opcode, message));
+}
+
+void WebSocket::close(uint16_t code, std::string_view reason) {
+	std::unique_lock<std::mutex> lock(mutex);
+	if(!finished && !close_sent)
+		close_code = code;
+	if(enqueue_close(code, reason)) {
+		lock.unlock();
+		loop.post([self = shared_from_this()] { self->flush(); });
+	}
+}
+
+size_t WebSocket::broadcast(const std::vector<WebSocketPtr> &sockets, const websocket::Frame &frame) {
+	std::vector<WebSocketPtr> idle;
+	size_t count = 0;
+	for(auto &ws : sockets) {
+		std::lock_guard<std::mutex> lock(ws->mutex);
+		if(!ws->finished && !ws->close_sent)
+			count++;
+		if(ws->enqueue(frame))
+			idle.push_back(ws);
+	}
+	if(!idle.empty()) {
+		auto &loop = idle.front()->loop;
+		loop.post([idle = std::move(idle)] {
+			for(auto &ws : idle)
+				ws->flush();
+		});
+	}
+	return count;
+}
+
+void WebSocket::on_readable() {
+	if(finished)
+		return;
+
+	// borrowed for this wakeup only, an idle socket keeps no buffer
+	size_t size = BufferPool::large;
+	char *buf = BufferPool::take(size);
+	bool eof = false;
+	for(int i = 0; i < 16 && !finished; i++) {
+		auto n = recv(fd, buf, size, MSG_DONTWAIT);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			eof = errno != EAGAIN && errno != EWOULDBLOCK;
+			break;
+		}
+		if(n == 0) {
+			eof = true;
+			break;
+		}
+		if(input_done)
+			continue;
+
+		if(in.empty()) {
+			// whole frames straight from the buffer, only a partial one is kept
+			auto used = consume(buf, n);
+			in.assign(buf + used, n - used);
+		} else {
+			in.append(buf, n);
+			auto used = consume(&in[0], in.size());
+			in.erase(0, used);
+		}
+		if(size_t(n) < size)
+			break;
+	}
+	BufferPool::give(buf, size);
+	if(in.empty() && in.capacity() > BufferPool::large)
+		std::string().swap(in);
+
+	if(eof)
+		finish();
+	else if(!finished)
+		loop.watch(fd, IO_READ, [self = shared_from_this()](uint32_t events) {
+			self->on_readable();
+		});
+}
+
+size_t WebSocket::consume(char *data, size_t n) {
+	size_t pos = 0;
+	while(!input_done && !finished) {
+		websocket::Header header;
+		auto size = websocket::parse_header(data + pos, n - pos, header);
+		if(size == 0)
+			break;
+		// refused before it is read, not after
+		if(header.length > max_message || message.size() + header.length > max_message) {
+			end_input(websocket::TOO_BIG);
+			break;
+		}
+		if(n - pos - size < header.length)
+			break;
+
+		char *payload = data + pos + size;
+		if(header.masked)
+			websocket::unmask(payload, header.length, header.key);
+		pos += size + header.length;
+		on_frame(header, payload);
+	}
+	return input_done ? n : pos;
+}
+
+void WebSocket::on_frame(const websocket::Header &header, char *payload) {
+	using namespace websocket;
+	std::string_view data(payload, header.length);
+
+	// clients must mask, and no extension gives the reserved bits a meaning
+	if(!header.masked || header.rsv) {
+		end_input(PROTOCOL_ERROR);
+		return;
+	}
+
+	if(header.opcode & 0x8) {
+		if(!header.fin || header.length > 125) {
+			end_input(PROTOCOL_ERROR);
+			return;
+		}
+		switch(header.opcode) {
+		case CLOSE: {
+			uint16_t code = NO_STATUS;
+			if(data.size() == 1) {
+				end_input(PROTOCOL_ERROR);
+				return;
+			}
+			if(data.size() >= 2) {
+				code = uint8_t(data[0]) << 8 | uint8_t(data[1]);
+				bool known = (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011)
+					|| (code >= 3000 && code <= 4999);
+				if(!known) {
+					end_input(PROTOCOL_ERROR);
+					return;
+				}
+				if(!valid_utf8(data.substr(2))) {
+					end_input(INVALID_DATA);
+					return;
+				}
+			}
+			// the answer echoes the status; after it only the TCP close is left
+			end_input(code);
+			return;
+		}
+		case PING:
+			send(frame(PONG, data));
+			return;
+		case PONG:
+			return;
+		default:
+			end_input(PROTOCOL_ERROR);
+			return;
+		}
+	}
+
+	if(header.opcode == CONTINUATION) {
+		if(message_opcode == CONTINUATION) {
+			end_input(PROTOCOL_ERROR);
+			return;
+		}
+	} else if(header.opcode == TEXT || header.opcode == BINARY) {
+		if(message_opcode != CONTINUATION) {
+			end_input(PROTOCOL_ERROR);
+			return;
+		}
+		// the common case, a message in one frame, goes out without a copy
+		if(header.fin) {
+			if(header.opcode == TEXT && !valid_utf8(data)) {
+				end_input(INVALID_DATA);
+				return;
+			}
+			if(handler.on_message)
+				handler.on_message(shared_from_this(), header.opcode, data);
+			return;
+		}
+		message_opcode = header.opcode;
+	} else {
+		end_input(PROTOCOL_ERROR);
+		return;
+	}
+
+	message.append(data);
+	if(!header.fin)
+		return;
+
+	auto opcode = message_opcode;
+	message_opcode = CONTINUATION;
+	if(opcode == TEXT && !valid_utf8(message)) {
+		end_input(INVALID_DATA);
+		return;
+	}
+	if(handler.on_message)
+		handler.on_message(shared_from_this(), opcode, message);
+	std::string().swap(message);
+}
+
+void WebSocket::end_input(uint16_t code) {
+	input_done = true;
+	std::string().swap(message);
+
+	bool post, done;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(!close_sent)
+			close_code = code;
+		post = enqueue_close(code == websocket::NO_STATUS ? 0 : code, {});
+		// our close went out before, nothing is left to wait for
+		done = !writing && !finished;
+	}
+	if(post)
+		loop.post([self = shared_from_this()] { self->flush(); });
+	else if(done)
+		finish();
+}
+
+void WebSocket::flush() {
+	std::unique_lock<std::mutex> lock(mutex);
+	if(finished)
+		return;
+
+	while(!queue.empty()) {
+		struct iovec iov[64];
+		int count = 0;
+		for(auto it = queue.begin(); it != queue.end() && count < 64; ++it, ++count) {
+			size_t skip = count == 0 ? sent : 0;
+			iov[count].iov_base = (void *)((*it)->data() + skip);
+			iov[count].iov_len = (*it)->size() - skip;
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+
+		auto n = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				// a client that stops reading is cut off, like a stalled response
+				loop.schedule(c->deadline, write_timeout, [conn = fd] {
+					::shutdown(conn, SHUT_RDWR);
+				});
+				loop.watch(fd, IO_WRITE, [self = shared_from_this()](uint32_t events) {
+					self->flush();
+				});
+				return;
+			}
+			// the reader sees the error as well and finishes
+			queue.clear();
+			backlog = 0;
+			writing = false;
+			::shutdown(fd, SHUT_RDWR);
+			return;
+		}
+
+		backlog -= n;
+		size_t done = n;
+		while(done > 0) {
+			size_t left = queue.front()->size() - sent;
+			if(done < left) {
+				sent += done;
+				break;
+			}
+			done -= left;
+			sent = 0;
+			queue.pop_front();
+		}
+	}
+	writing = false;
+
+	if(!close_sent) {
+		loop.cancel(c->deadline);
+		return;
+	}
+	if(!input_done) {
+		// our close is out, the client has write_timeout to answer it
+		loop.schedule(c->deadline, write_timeout, [conn = fd] {
+			::shutdown(conn, SHUT_RDWR);
+		});
+		return;
+	}
+	lock.unlock();
+	finish();
+}
+
+void WebSocket::finish() {
+	auto self = shared_from_this();
+	uint16_t code;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if(finished)
+			return;
+		finished = true;
+		queue.clear();
+		backlog = 0;
+		code = close_code;
+	}
+	loop.unwatch(fd);
+	loop.cancel(c->deadline);
+
+	if(handler.on_close)
+		handler.on_close(self, code);
+	if(on_finished)
+		on_finished(self);
+	// the socket closes with the last owner of the connection
+	c = ConnectionPtr();
+}
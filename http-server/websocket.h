@@ -0,0 +1,180 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <regex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "server.h"
+
+
+/* The WebSocket protocol (RFC 6455): frames as they go over the wire. The
+ * server never masks what it sends, so an encoded frame is the same bytes
+ * for every socket and one copy can be queued on all of them.
+ */
+namespace websocket {
+
+enum Opcode : uint8_t {
+	CONTINUATION = 0x0,
+	TEXT         = 0x1,
+	BINARY       = 0x2,
+	CLOSE        = 0x8,
+	PING         = 0x9,
+	PONG         = 0xa,
+};
+
+// status codes of a close frame
+enum CloseCode : uint16_t {
+	NORMAL         = 1000,
+	GOING_AWAY     = 1001,
+	PROTOCOL_ERROR = 1002,
+	NO_STATUS      = 1005,  // only reported, never sent
+	ABNORMAL       = 1006,  // only reported: the connection ended without a close
+	INVALID_DATA   = 1007,
+	POLICY         = 1008,
+	TOO_BIG        = 1009,
+};
+
+// one whole encoded frame, shared by every socket it is queued on
+using Frame = std::shared_ptr<const std::string>;
+
+Frame frame(Opcode opcode, std::string_view payload);
+// a close frame; code 0 for one without a status
+Frame close_frame(uint16_t code, std::string_view reason = {});
+
+// the header of a frame from the client
+struct Header {
+	bool fin;
+	uint8_t rsv;         // extension bits, none are negotiated
+	Opcode opcode;
+	bool masked;
+	uint8_t key[4];
+	uint64_t length;     // of the payload
+};
+// size of the header at the start of data, 0 if it is not all there yet
+size_t parse_header(const char *data, size_t n, Header &header);
+
+// XOR the payload with the masking key, in place
+void unmask(char *data, size_t n, const uint8_t key[4]);
+bool valid_utf8(std::string_view s);
+
+// Sec-WebSocket-Accept for the Sec-WebSocket-Key of a handshake
+std::string accept_key(std::string_view key);
+
+}
+
+
+class WebSocket;
+using WebSocketPtr = std::shared_ptr<WebSocket>;
+
+/* What a route does with its sockets. Every callback runs in the event loop
+ * thread, between reads of other connections, so it has to be quick and
+ * must not block; longer work goes to the workers (Executor::submit), which
+ * can send from there.
+ */
+struct WebSocketHandler {
+	// the handshake is done; keep ws to send to it later
+	std::function<void (const WebSocketPtr &ws)> on_open;
+	// one whole message, reassembled from its fragments; text is valid UTF-8
+	std::function<void (const WebSocketPtr &ws, websocket::Opcode opcode, std::string_view message)> on_message;
+	// the socket is gone, with the status of the close frame or ABNORMAL
+	std::function<void (const WebSocketPtr &ws, uint16_t code)> on_close;
+};
+
+struct WebSocketRoute {
+	std::regex pattern;  // matched against the whole request path, like a Callback
+	WebSocketHandler handler;
+
+	WebSocketRoute(const std::string &key, const WebSocketHandler &handler);
+	bool match(std::string_view path) const;
+};
+
+/* One accepted WebSocket connection. It belongs to the event loop like an
+ * idle keep-alive connection does: the loop reads it when data arrives and
+ * no worker is tied to it in between, and it holds no buffer while nothing
+ * is in flight. Messages can be sent from any thread; they are queued and
+ * written by the loop. A socket that falls max_backlog behind is dropped.
+ */
+class WebSocket : public std::enable_shared_from_this<WebSocket> {
+public:
+	using finished_t = std::function<void (const WebSocketPtr &ws)>;
+
+	// unsent bytes past which a client counts as too slow and is cut off
+	static constexpr size_t max_backlog = 1024 * 1024;
+
+private:
+	ConnectionPtr c;
+	int fd;
+	EventLoop &loop;
+	const WebSocketHandler &handler;
+	std::string _path;
+	size_t max_message;
+	int write_timeout;
+	finished_t on_finished;
+
+	// loop thread only
+	std::string in;               // the start of a frame not yet complete
+	std::string message;          // fragments of the message in progress
+	websocket::Opcode message_opcode;  // CONTINUATION while there is none
+	bool input_done;              // a close arrived or the input was bad, the rest is ignored
+
+	// guarded by mutex, senders queue from any thread
+	std::mutex mutex;
+	std::deque<websocket::Frame> queue;
+	size_t sent;                  // of queue.front()
+	size_t backlog;               // bytes queued, not yet sent
+	bool writing;                 // a flush is posted or waits for the socket
+	bool close_sent;
+	bool finished;
+	uint16_t close_code;          // what on_close reports
+
+	// append frame to the queue; true if the caller has to post a flush
+	bool enqueue(websocket::Frame frame);
+	// close frame, and no more frames after it
+	bool enqueue_close(uint16_t code, std::string_view reason);
+
+	void on_readable();
+	// parse the frames in data, unmasking it in place; the bytes used up
+	size_t consume(char *data, size_t n);
+	void on_frame(const websocket::Header &header, char *payload);
+	/* a close frame arrived, or input that breaks the protocol: ignore
+	 * the rest and answer with a close of code, unless ours went first
+	 */
+	void end_input(uint16_t code);
+	void flush();
+	void finish();
+
+public:
+	/* made by the server once the handshake is answered; received: frames
+	 * that came in with the handshake
+	 */
+	WebSocket(ConnectionPtr c, EventLoop &loop, const WebSocketHandler &handler,
+			std::string path, const HTTPLimits &limits, std::string received);
+
+	WebSocket(const WebSocket &) = delete;
+	WebSocket& operator= (const WebSocket &) = delete;
+
+	// loop thread: call on_open and start reading
+	void start(finished_t on_finished);
+
+	// without the leading '/', as the route matched it
+	const std::string &path() const { return _path; }
+
+	// false if the socket is closing or gone; any thread
+	bool send(websocket::Frame frame);
+	bool send(std::string_view message, websocket::Opcode opcode = websocket::TEXT);
+	// start the closing handshake; any thread
+	void close(uint16_t code = websocket::NORMAL, std::string_view reason = {});
+
+	// queue one frame on every socket, with a single post to the loop; the sockets it went to
+	static size_t broadcast(const std::vector<WebSocketPtr> &sockets, const websocket::Frame &frame);
+};
+
+
+#endif